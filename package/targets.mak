@@ -1,4 +1,5 @@
 BIN_TARGETS := \
+aa-analyze \
 aa-chroot \
 aa-ctty \
 aa-echo \
@@ -33,6 +34,7 @@ aa-stage4
 
 DOC_TARGETS := \
 anopa.1 \
+aa-analyze.1 \
 aa-chroot.1 \
 aa-command.1 \
 aa-ctty.1 \
@@ -74,3 +76,21 @@ endif
 ifdef DO_STATIC
 STATIC_LIBS := libanopa.a
 endif
+
+# multicall: one binary (anopa) holding all programs, installed as symlinks to it
+ifdef DO_MULTICALL
+MULTICALL_TARGETS := $(BIN_TARGETS)
+BIN_TARGETS := anopa
+
+install-bin: $(MULTICALL_TARGETS:%=$(DESTDIR)$(bindir)/%)
+
+$(MULTICALL_TARGETS:%=$(DESTDIR)$(bindir)/%): $(DESTDIR)$(bindir)/anopa
+	exec $(INSTALL) -D -l anopa $@
+endif
+
+# each program's main() is renamed (e.g. aa_start_main()) for anopa to call it
+src/multicall/%.o: src/anopa/%.c
+	exec $(REALCC) $(CPPFLAGS_ALL) $(CFLAGS_ALL) -Dmain=$(subst -,_,$*)_main -c -o $@ $<
+
+src/multicall/%.o: src/utils/%.c
+	exec $(REALCC) $(CPPFLAGS_ALL) $(CFLAGS_ALL) -Dmain=$(subst -,_,$*)_main -c -o $@ $<
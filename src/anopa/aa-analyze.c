@@ -0,0 +1,449 @@
+/*
+ * anopa - Copyright (C) 2015-2017 Olivier Brunel
+ *
+ * aa-analyze.c
+ * Copyright (C) 2015-2017 Olivier Brunel <jjk@jjacky.com>
+ *
+ * This file is part of anopa.
+ *
+ * anopa is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * anopa is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * anopa. If not, see http://www.gnu.org/licenses/
+ */
+
+#define _BSD_SOURCE
+
+#include "anopa/config.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <getopt.h>
+#include <skalibs/bytestr.h>
+#include <skalibs/genalloc.h>
+#include <skalibs/types.h>
+#include <skalibs/djbtime.h>
+#include <skalibs/tai.h>
+#include <anopa/common.h>
+#include <anopa/output.h>
+#include <anopa/init_repo.h>
+#include <anopa/service_status.h>
+#include <anopa/timeline.h>
+#include <anopa/err.h>
+#include "util.h"
+
+enum
+{
+    MODE_BLAME = 0,
+    MODE_CHAIN,
+    MODE_TRACE
+};
+
+/* microseconds since the beginning of the transaction, or -1 if unset */
+static int64_t
+usecs (tain const *t)
+{
+    tain d;
+
+    if (t->sec.x == 0 || tain_less (t, aa_timeline_stamp ()))
+        return -1;
+    tain_sub (&d, t, aa_timeline_stamp ());
+    return (int64_t) d.sec.x * 1000000 + d.nano / 1000;
+}
+
+static int64_t
+duration (aa_tl_entry *e)
+{
+    int64_t start = usecs (&e->start);
+    int64_t end = usecs (&e->end);
+
+    return (start < 0 || end < start) ? -1 : end - start;
+}
+
+static void
+put_secs (int64_t us, int pad)
+{
+    char buf[UINT64_FMT + 5];
+    size_t l;
+    unsigned int ms;
+
+    if (us < 0)
+        us = 0;
+    l = uint64_fmt (buf, (uint64_t) us / 1000000);
+    ms = (us % 1000000) / 1000;
+    buf[l++] = '.';
+    buf[l++] = '0' + ms / 100;
+    buf[l++] = '0' + (ms / 10) % 10;
+    buf[l++] = '0' + ms % 10;
+    buf[l++] = 's';
+    buf[l] = '\0';
+
+    for ( ; pad > (int) l; --pad)
+        aa_bs_noflush (AA_OUT, " ");
+    aa_bs_noflush (AA_OUT, buf);
+}
+
+static void
+put_event (aa_tl_entry *e)
+{
+    if (e->event == AA_EVT_STARTED || e->event == AA_EVT_STOPPED
+            || e->event >= _AA_NB_EVT)
+        return;
+
+    aa_bs_noflush (AA_OUT, " (");
+    aa_is_noflush (AA_OUT, ANSI_HIGHLIGHT_RED_ON);
+    aa_bs_noflush (AA_OUT, eventmsg[e->event]);
+    aa_is_noflush (AA_OUT, ANSI_HIGHLIGHT_OFF);
+    if ((e->event == AA_EVT_STARTING_FAILED || e->event == AA_EVT_STOPPING_FAILED
+                || e->event == AA_EVT_ERROR) && e->code > 0 && e->code < _NB_ERR)
+    {
+        aa_bs_noflush (AA_OUT, ": ");
+        aa_bs_noflush (AA_OUT, errmsg[e->code]);
+    }
+    aa_bs_noflush (AA_OUT, ")");
+}
+
+static void
+put_transaction (void)
+{
+    char buf[LOCALTMN_FMT];
+    localtmn local;
+    int64_t end = 0;
+    size_t i;
+
+    for (i = 0; i < aa_timeline_nb (); ++i)
+    {
+        int64_t us = usecs (&aa_timeline_get (i)->end);
+
+        if (us > end)
+            end = us;
+    }
+
+    localtmn_from_tain (&local, aa_timeline_stamp (), 1);
+    buf[localtmn_fmt (buf, &local)] = '\0';
+    buf[19] = '\0';
+
+    aa_is_noflush (AA_OUT, ANSI_HIGHLIGHT_ON);
+    aa_bs_noflush (AA_OUT, (aa_timeline_is_start ()) ? "Start" : "Stop");
+    aa_is_noflush (AA_OUT, ANSI_HIGHLIGHT_OFF);
+    aa_bs_noflush (AA_OUT, " on ");
+    aa_bs_noflush (AA_OUT, buf);
+    aa_bs_noflush (AA_OUT, ": ");
+    buf[uint_fmt (buf, aa_timeline_nb ())] = '\0';
+    aa_bs_noflush (AA_OUT, buf);
+    aa_bs_noflush (AA_OUT, " services in ");
+    put_secs (end, 0);
+    aa_bs_flush (AA_OUT, "\n\n");
+}
+
+static int
+cmp_duration (const void *_i1, const void *_i2)
+{
+    int64_t d1 = duration (aa_timeline_get (*(const size_t *) _i1));
+    int64_t d2 = duration (aa_timeline_get (*(const size_t *) _i2));
+
+    return (d1 > d2) ? -1 : (d1 < d2);
+}
+
+/* services by time taken, longest first */
+static void
+blame (void)
+{
+    genalloc ga = GENALLOC_ZERO; /* size_t */
+    size_t i;
+
+    put_transaction ();
+
+    for (i = 0; i < aa_timeline_nb (); ++i)
+        if (duration (aa_timeline_get (i)) >= 0
+                && !genalloc_append (size_t, &ga, &i))
+            aa_strerr_diefu1sys (2, "sort services");
+    qsort (ga.s, genalloc_len (size_t, &ga), sizeof (size_t), cmp_duration);
+
+    for (i = 0; i < genalloc_len (size_t, &ga); ++i)
+    {
+        aa_tl_entry *e = aa_timeline_get (genalloc_s (size_t, &ga)[i]);
+
+        put_secs (duration (e), 10);
+        aa_bs_noflush (AA_OUT, "  ");
+        aa_bs_noflush (AA_OUT, aa_timeline_name (e));
+        put_event (e);
+        aa_bs_flush (AA_OUT, "\n");
+    }
+
+    genalloc_free (size_t, &ga);
+}
+
+/* from the service done last (or name), following deciding dependencies all
+ * the way back, i.e. what it ended up waiting for */
+static void
+chain (const char *name)
+{
+    genalloc ga = GENALLOC_ZERO; /* int */
+    int i;
+
+    if (name)
+    {
+        i = aa_timeline_find (name);
+        if (i < 0)
+            aa_strerr_dief2x (3, "no such service in timeline: ", name);
+    }
+    else
+    {
+        int64_t end = -1;
+        size_t n;
+
+        i = -1;
+        for (n = 0; n < aa_timeline_nb (); ++n)
+        {
+            int64_t us = usecs (&aa_timeline_get (n)->end);
+
+            if (us > end)
+            {
+                end = us;
+                i = n;
+            }
+        }
+        if (i < 0)
+            aa_strerr_dief1x (3, "no service in timeline");
+    }
+
+    /* (the chain can't loop, but let's not trust the file) */
+    while (i >= 0 && genalloc_len (int, &ga) < aa_timeline_nb ())
+    {
+        const char *after;
+
+        if (!genalloc_append (int, &ga, &i))
+            aa_strerr_diefu1sys (2, "build critical chain");
+        after = aa_timeline_after (aa_timeline_get (i));
+        i = (after) ? aa_timeline_find (after) : -1;
+    }
+
+    put_transaction ();
+
+    for (i = genalloc_len (int, &ga) - 1; i >= 0; --i)
+    {
+        aa_tl_entry *e = aa_timeline_get (genalloc_s (int, &ga)[i]);
+        int64_t start = usecs (&e->start);
+
+        aa_bs_noflush (AA_OUT, aa_timeline_name (e));
+        aa_bs_noflush (AA_OUT, " @");
+        put_secs (start, 0);
+        aa_bs_noflush (AA_OUT, " +");
+        put_secs (duration (e), 0);
+        put_event (e);
+        /* time between its deciding dependency being done and its start */
+        if (i < (int) genalloc_len (int, &ga) - 1)
+        {
+            int64_t end = usecs (&aa_timeline_get (genalloc_s (int, &ga)[i + 1])->end);
+
+            if (start - end >= 1000)
+            {
+                aa_bs_noflush (AA_OUT, " [waited ");
+                put_secs (start - end, 0);
+                aa_bs_noflush (AA_OUT, "]");
+            }
+        }
+        aa_bs_flush (AA_OUT, "\n");
+    }
+
+    genalloc_free (int, &ga);
+}
+
+static void
+put_json_event (const char *name, const char *cat, int64_t ts, int64_t dur,
+                unsigned int tid, aa_tl_entry *e, int first)
+{
+    char buf[UINT64_FMT];
+    const char *after = aa_timeline_after (e);
+
+    aa_bs_noflush (AA_OUT, (first) ? "\n{\"name\":\"" : ",\n{\"name\":\"");
+    put_escaped (name, 1);
+    aa_bs_noflush (AA_OUT, "\",\"cat\":\"");
+    aa_bs_noflush (AA_OUT, cat);
+    aa_bs_noflush (AA_OUT, "\",\"ph\":\"X\",\"pid\":1,\"tid\":");
+    aa_bb_noflush (AA_OUT, buf, uint_fmt (buf, tid));
+    aa_bs_noflush (AA_OUT, ",\"ts\":");
+    aa_bb_noflush (AA_OUT, buf, uint64_fmt (buf, (uint64_t) ts));
+    aa_bs_noflush (AA_OUT, ",\"dur\":");
+    aa_bb_noflush (AA_OUT, buf, uint64_fmt (buf, (uint64_t) dur));
+    aa_bs_noflush (AA_OUT, ",\"args\":{\"status\":\"");
+    aa_bs_noflush (AA_OUT, (e->event < _AA_NB_EVT) ? eventmsg[e->event] : "");
+    aa_bs_noflush (AA_OUT, "\"");
+    if (after)
+    {
+        aa_bs_noflush (AA_OUT, ",\"after\":\"");
+        put_escaped (after, 1);
+        aa_bs_noflush (AA_OUT, "\"");
+    }
+    aa_bs_noflush (AA_OUT, "}}");
+}
+
+static int
+cmp_start (const void *_i1, const void *_i2)
+{
+    int64_t s1 = usecs (&aa_timeline_get (*(const size_t *) _i1)->start);
+    int64_t s2 = usecs (&aa_timeline_get (*(const size_t *) _i2)->start);
+
+    return (s1 < s2) ? -1 : (s1 > s2);
+}
+
+/* Trace Event Format, as used by chrome://tracing or Perfetto. Services that
+ * don't overlap share the same row (tid) */
+static void
+trace (void)
+{
+    genalloc ga = GENALLOC_ZERO; /* size_t, by start */
+    genalloc ga_rows = GENALLOC_ZERO; /* int64_t: end of last one on the row */
+    const char *cat = (aa_timeline_is_start ()) ? "start" : "stop";
+    size_t i;
+
+    for (i = 0; i < aa_timeline_nb (); ++i)
+        if (duration (aa_timeline_get (i)) >= 0
+                && !genalloc_append (size_t, &ga, &i))
+            aa_strerr_diefu1sys (2, "sort services");
+    qsort (ga.s, genalloc_len (size_t, &ga), sizeof (size_t), cmp_start);
+
+    aa_bs_noflush (AA_OUT, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+    for (i = 0; i < genalloc_len (size_t, &ga); ++i)
+    {
+        aa_tl_entry *e = aa_timeline_get (genalloc_s (size_t, &ga)[i]);
+        int64_t start = usecs (&e->start);
+        int64_t end = usecs (&e->end);
+        int64_t ready = usecs (&e->ready);
+        size_t row;
+
+        for (row = 0; row < genalloc_len (int64_t, &ga_rows); ++row)
+            if (genalloc_s (int64_t, &ga_rows)[row] <= start)
+                break;
+        if (row == genalloc_len (int64_t, &ga_rows)
+                && !genalloc_append (int64_t, &ga_rows, &end))
+            aa_strerr_diefu1sys (2, "build trace");
+        genalloc_s (int64_t, &ga_rows)[row] = end;
+
+        put_json_event (aa_timeline_name (e), cat, start, end - start, row + 1, e, i == 0);
+        /* long-run getting ready, once up */
+        if (ready >= start && ready <= end)
+            put_json_event ("ready", cat, ready, end - ready, row + 1, e, 0);
+    }
+    aa_bs_flush (AA_OUT, "\n]}\n");
+
+    genalloc_free (size_t, &ga);
+    genalloc_free (int64_t, &ga_rows);
+}
+
+static void
+dieusage (int rc)
+{
+    aa_die_usage (rc, "[OPTION...] [service]",
+            " -D, --double-output           Enable double-output mode\n"
+            " -r, --repodir DIR             Use DIR as repository directory\n"
+            " -t, --transaction N           Use the N-th previous transaction (0 is the last one)\n"
+            " -b, --blame                   Show services by time taken (default)\n"
+            " -c, --critical-chain          Show the chain of services the last one (or service) waited for\n"
+            " -T, --trace                   Output as Trace Event Format (JSON)\n"
+            " -h, --help                    Show this help screen and exit\n"
+            " -V, --version                 Show version information and exit\n"
+            );
+}
+
+int
+main (int argc, char * const argv[])
+{
+    PROG = "aa-analyze";
+    const char *path_repo = "/run/services";
+    unsigned int transaction = 0;
+    int mode = MODE_BLAME;
+    int r;
+
+    for (;;)
+    {
+        struct option longopts[] = {
+            { "blame",              no_argument,        NULL,   'b' },
+            { "critical-chain",     no_argument,        NULL,   'c' },
+            { "double-output",      no_argument,        NULL,   'D' },
+            { "help",               no_argument,        NULL,   'h' },
+            { "repodir",            required_argument,  NULL,   'r' },
+            { "trace",              no_argument,        NULL,   'T' },
+            { "transaction",        required_argument,  NULL,   't' },
+            { "version",            no_argument,        NULL,   'V' },
+            { NULL, 0, 0, 0 }
+        };
+        int c;
+
+        c = getopt_long (argc, argv, "bcDhr:Tt:V", longopts, NULL);
+        if (c == -1)
+            break;
+        switch (c)
+        {
+            case 'b':
+                mode = MODE_BLAME;
+                break;
+
+            case 'c':
+                mode = MODE_CHAIN;
+                break;
+
+            case 'D':
+                aa_set_double_output (1);
+                break;
+
+            case 'h':
+                dieusage (0);
+
+            case 'r':
+                unslash (optarg);
+                path_repo = optarg;
+                break;
+
+            case 'T':
+                mode = MODE_TRACE;
+                break;
+
+            case 't':
+                if (!uint0_scan (optarg, &transaction))
+                    aa_strerr_diefu2x (1, "set transaction: invalid number: ", optarg);
+                break;
+
+            case 'V':
+                aa_die_version ();
+
+            default:
+                dieusage (1);
+        }
+    }
+    argc -= optind;
+    argv += optind;
+
+    if (argc > 1 || (argc == 1 && mode != MODE_CHAIN))
+        dieusage (1);
+
+    r = aa_init_repo (path_repo, AA_REPO_READ);
+    if (r < 0)
+        aa_strerr_diefu2sys (2, "init repository ", path_repo);
+
+    r = aa_timeline_load (transaction);
+    if (r < 0)
+        aa_strerr_diefu1sys (2, "load " AA_TIMELINE_FILENAME);
+    else if (r == 0)
+        aa_strerr_dief1x (3, "no such transaction in timeline");
+
+    if (mode == MODE_BLAME)
+        blame ();
+    else if (mode == MODE_CHAIN)
+        chain ((argc == 1) ? argv[0] : NULL);
+    else
+        trace ();
+
+    aa_timeline_free ();
+    return 0;
+}
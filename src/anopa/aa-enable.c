@@ -44,9 +44,13 @@
 #include <anopa/init_repo.h>
 #include <anopa/scan_dir.h>
 #include <anopa/enable_service.h>
+#include <anopa/service_status.h>
+#include <anopa/journal.h>
+#include <anopa/status_table.h>
 #include <anopa/ga_list.h>
 #include <anopa/stats.h>
 #include <anopa/err.h>
+#include <anopa/graph.h>
 #include "util.h"
 #include "common.h"
 
@@ -78,6 +82,21 @@ warn_cb (const char *name, int err)
     aa_end_warn ();
 }
 
+/* a new servicedir: leftovers of a previous one (in the status table or the
+ * journal) must not be taken as its status */
+static void
+clear_status (const char *name)
+{
+    if (aa_service_status_clear (name) < 0)
+    {
+        int e = errno;
+
+        aa_put_warn (name, "Failed to clear service status: ", 0);
+        aa_bs_noflush (AA_ERR, strerror (e));
+        aa_end_warn ();
+    }
+}
+
 static void
 ae_cb (const char *name, aa_enable_flags type)
 {
@@ -149,6 +168,20 @@ process:
         return -1;
     }
 
+    if (!(flags & AA_FLAG_UPGRADE_SERVICEDIR))
+    {
+        clear_status (cur_name);
+        if (r > 0)
+        {
+            size_t l = strlen (cur_name);
+            char buf[l + sizeof ("/log")];
+
+            byte_copy (buf, l, cur_name);
+            byte_copy (buf + l, sizeof ("/log"), "/log");
+            clear_status (buf);
+        }
+    }
+
     if (!quiet)
     {
         aa_bs_noflush (AA_OUT, "Enabled: ");
@@ -352,6 +385,10 @@ main (int argc, char * const argv[])
         else
             aa_strerr_diefu2sys (1, "init repository ", path_repo);
     }
+    if (aa_journal_open (0) < 0)
+        aa_strerr_warnu1sys ("open " AA_JOURNAL_FILENAME);
+    if (aa_status_table_open (AA_STATUS_TABLE_RDWR) < 0)
+        aa_strerr_warnu1sys ("open " AA_STATUS_TABLE_FILENAME);
 
     /* process listdir (path_list) first, to ensure if the service was also
      * specified on cmdline (and will fail: already exists) the one processed is
@@ -427,6 +464,14 @@ main (int argc, char * const argv[])
             aa_put_err ("Failed to create symlink " SCANDIR_FINISH, strerror (errno), 1);
     }
 
+    if (aa_journal_close () < 0)
+        aa_strerr_warnu1sys ("write " AA_JOURNAL_FILENAME);
+    aa_status_table_close ();
+
+    /* servicedirs were (possibly) changed, so the graph needs to be updated */
+    if (aa_graph_write () < 0)
+        aa_put_warn ("Failed to write " AA_GRAPH_FILENAME, strerror (errno), 1);
+
     if (alarm_s6)
     {
         r = s6_svc_writectl (AA_SCANDIR_DIRNAME, S6_SVSCAN_CTLDIR, "a", 1);
@@ -32,6 +32,8 @@
 #include <anopa/common.h>
 #include <anopa/output.h>
 #include <anopa/init_repo.h>
+#include <anopa/journal.h>
+#include <anopa/status_table.h>
 #include <anopa/service.h>
 #include <anopa/service_status.h>
 #include <anopa/err.h>
@@ -211,6 +213,10 @@ main (int argc, char * const argv[])
     r = aa_init_repo (path_repo, AA_REPO_READ);
     if (r < 0)
         aa_strerr_diefu2sys (2, "init repository ", path_repo);
+    if (aa_journal_open (0) < 0)
+        aa_strerr_warnu1sys ("open " AA_JOURNAL_FILENAME);
+    if (aa_status_table_open (AA_STATUS_TABLE_RDWR) < 0)
+        aa_strerr_warnu1sys ("open " AA_STATUS_TABLE_FILENAME);
 
     for (i = 0; i < argc; ++i)
         if (str_equal (argv[i], "-"))
@@ -221,5 +227,8 @@ main (int argc, char * const argv[])
         else
             reset_service (argv[i], mode);
 
+    if (aa_journal_close () < 0)
+        aa_strerr_warnu1sys ("write " AA_JOURNAL_FILENAME);
+    aa_status_table_close ();
     return 0;
 }
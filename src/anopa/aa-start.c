@@ -39,11 +39,16 @@
 #include <skalibs/direntry.h>
 #include <skalibs/genalloc.h>
 #include <skalibs/tai.h>
-#include <skalibs/iopause.h>
 #include <skalibs/djbunix.h>
 #include <skalibs/types.h>
 #include <anopa/common.h>
 #include <anopa/err.h>
+#include <anopa/graph.h>
+#include <anopa/prefetch.h>
+#include <anopa/durations.h>
+#include <anopa/journal.h>
+#include <anopa/status_table.h>
+#include <anopa/timeline.h>
 #include <anopa/init_repo.h>
 #include <anopa/output.h>
 #include <anopa/scan_dir.h>
@@ -68,8 +73,8 @@ static int no_wants = 0;
 static int verbose = 0;
 static int rc = 0;
 
-void
-check_essential (int si)
+static void
+check_essential_start (int si)
 {
     if (rc == 0)
     {
@@ -205,6 +210,28 @@ it_start (direntry *d, void *data)
     return 0;
 }
 
+static int
+it_prefetch (direntry *d, void *data)
+{
+    if (*d->d_name != '.')
+        aa_prefetch_add (d->d_name);
+    return 0;
+}
+
+static int
+scan_listdir (const char *path_list, aa_sd_it_fn iterator)
+{
+    stralloc sa = STRALLOC_ZERO;
+    int r;
+
+    if (*path_list != '/' && *path_list != '.')
+        stralloc_cats (&sa, LISTDIR_PREFIX);
+    stralloc_catb (&sa, path_list, strlen (path_list) + 1);
+    r = aa_scan_dir (&sa, 1, iterator, NULL);
+    stralloc_free (&sa);
+    return r;
+}
+
 static void
 scan_cb (int si, int sni)
 {
@@ -225,6 +252,9 @@ dieusage (int rc)
             " -l, --listdir DIR             Use DIR to list services to start\n"
             " -W, --no-wants                Don't auto-start services from 'wants'\n"
             " -t, --timeout SECS            Use SECS seconds as default timeout\n"
+            " -J, --journal                 Record statuses in the repository's journal\n"
+            " -j, --jobs NB                 Run at most NB oneshots at once\n"
+            " -A, --adaptive-jobs           Adapt number of oneshots at once to system pressure\n"
             " -n, --dry-list                Only show service names (don't start anything)\n"
             " -v, --verbose                 Print auto-added dependencies\n"
             " -h, --help                    Show this help screen and exit\n"
@@ -244,14 +274,20 @@ main (int argc, char * const argv[])
     PROG = "aa-start";
     const char *path_repo = "/run/services";
     const char *path_list = NULL;
+    int journal = 0;
     int i;
 
+    check_essential = check_essential_start;
+
     aa_secs_timeout = DEFAULT_TIMEOUT_SECS;
     for (;;)
     {
         struct option longopts[] = {
+            { "adaptive-jobs",      no_argument,        NULL,   'A' },
             { "double-output",      no_argument,        NULL,   'D' },
             { "help",               no_argument,        NULL,   'h' },
+            { "journal",            no_argument,        NULL,   'J' },
+            { "jobs",               required_argument,  NULL,   'j' },
             { "listdir",            required_argument,  NULL,   'l' },
             { "dry-list",           no_argument,        NULL,   'n' },
             { "repodir",            required_argument,  NULL,   'r' },
@@ -263,11 +299,15 @@ main (int argc, char * const argv[])
         };
         int c;
 
-        c = getopt_long (argc, argv, "Dhl:nr:t:VvW", longopts, NULL);
+        c = getopt_long (argc, argv, "ADhJj:l:nr:t:VvW", longopts, NULL);
         if (c == -1)
             break;
         switch (c)
         {
+            case 'A':
+                adaptive_jobs = 1;
+                break;
+
             case 'D':
                 aa_set_double_output (1);
                 break;
@@ -275,6 +315,15 @@ main (int argc, char * const argv[])
             case 'h':
                 dieusage (0);
 
+            case 'J':
+                journal = 1;
+                break;
+
+            case 'j':
+                if (!uint0_scan (optarg, &max_jobs))
+                    aa_strerr_diefu2sys (ERR_IO, "set max jobs to ", optarg);
+                break;
+
             case 'l':
                 unslash (optarg);
                 path_list = optarg;
@@ -323,17 +372,38 @@ main (int argc, char * const argv[])
 
     if (aa_init_repo (path_repo, (mode & AA_MODE_IS_DRY) ? AA_REPO_READ : AA_REPO_WRITE) < 0)
         aa_strerr_diefu2sys (ERR_IO, "init repository ", path_repo);
+    /* not fatal, we'll just read everything from the servicedirs then */
+    i = aa_graph_load ();
+    if (i < 0)
+        aa_strerr_warnu1sys ("load " AA_GRAPH_FILENAME);
+    /* in which case, read those we'll need concurrently beforehand. (Any error
+     * is ignored here, it'll be reported when loading/reading them again) */
+    if (i <= 0)
+    {
+        if (path_list)
+            scan_listdir (path_list, it_prefetch);
+        for (i = 0; i < argc; ++i)
+            if (!str_equal (argv[i], "-"))
+                aa_prefetch_add (argv[i]);
+        aa_prefetch_run (AA_PREFETCH_THREADS, no_wants);
+    }
+    /* last known durations, to start the longest chains first */
+    if (aa_durations_load () < 0)
+        aa_strerr_warnu1sys ("load " AA_DURATIONS_FILENAME);
+    /* w/ a journal, statuses are recorded there instead of each in its own
+     * file (hence loaded before services are) */
+    if (((mode & AA_MODE_IS_DRY) ? aa_journal_load () : aa_journal_open (journal)) < 0)
+        aa_strerr_warnu1sys ("open " AA_JOURNAL_FILENAME);
+    /* not fatal either, statuses are then only read from/written to files */
+    if (aa_status_table_open ((mode & AA_MODE_IS_DRY)
+                ? AA_STATUS_TABLE_RDONLY : AA_STATUS_TABLE_CREATE) < 0)
+        aa_strerr_warnu1sys ("open " AA_STATUS_TABLE_FILENAME);
 
     if (path_list)
     {
-        stralloc sa = STRALLOC_ZERO;
         int r;
 
-        if (*path_list != '/' && *path_list != '.')
-            stralloc_cats (&sa, LISTDIR_PREFIX);
-        stralloc_catb (&sa, path_list, strlen (path_list) + 1);
-        r = aa_scan_dir (&sa, 1, it_start, NULL);
-        stralloc_free (&sa);
+        r = scan_listdir (path_list, it_start);
         if (r < 0)
             aa_strerr_diefu3sys (-r, "read list directory ",
                     (*path_list != '/' && *path_list != '.') ? LISTDIR_PREFIX : path_list,
@@ -353,6 +423,15 @@ main (int argc, char * const argv[])
 
     mainloop (mode, scan_cb);
 
+    if (aa_journal_close () < 0)
+        aa_strerr_warnu1sys ("write " AA_JOURNAL_FILENAME);
+    aa_status_table_close ();
+    if (!(mode & AA_MODE_IS_DRY) && aa_timeline_write () < 0)
+        aa_strerr_warnu1sys ("write " AA_TIMELINE_FILENAME);
+    aa_timeline_free ();
+    if (!(mode & AA_MODE_IS_DRY) && aa_durations_write () < 0)
+        aa_strerr_warnu1sys ("write " AA_DURATIONS_FILENAME);
+
     if (!(mode & AA_MODE_IS_DRY))
     {
         aa_bs_noflush (AA_OUT, "\n");
@@ -373,12 +452,14 @@ main (int argc, char * const argv[])
     genalloc_free (size_t, &ga_io);
     genalloc_free (size_t, &ga_unknown);
     genalloc_free (size_t, &ga_skipped);
-    genalloc_free (pid_t, &ga_pid);
-    genalloc_free (int, &aa_tmp_list);
-    genalloc_free (int, &aa_main_list);
-    stralloc_free (&aa_names);
+    set_free (&aa_tmp_list);
+    set_free (&aa_main_list);
     genalloc_deepfree (struct progress, &ga_progress, free_progress);
+    /* names are needed to remove fifos of longruns still waited on */
     aa_free_services (close_fd);
-    genalloc_free (iopause_fd, &ga_iop);
+    stralloc_free (&aa_names);
+    aa_graph_free ();
+    aa_prefetch_free ();
+    aa_durations_free ();
     return rc;
 }
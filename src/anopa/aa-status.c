@@ -33,6 +33,7 @@
 #include <stdlib.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
+#include <sys/inotify.h>
 #include <skalibs/bytestr.h>
 #include <skalibs/djbunix.h>
 #include <skalibs/genalloc.h>
@@ -42,10 +43,14 @@
 #include <skalibs/djbtime.h>
 #include <skalibs/tai.h>
 #include <skalibs/sig.h>
+#include <skalibs/iopause.h>
 #include <s6/supervise.h>
+#include <s6/ftrigr.h>
 #include <anopa/common.h>
 #include <anopa/output.h>
 #include <anopa/init_repo.h>
+#include <anopa/journal.h>
+#include <anopa/status_table.h>
 #include <anopa/scan_dir.h>
 #include <anopa/service.h>
 #include <anopa/service_status.h>
@@ -60,9 +65,21 @@ enum
     MODE_DRY_LIST
 };
 
+enum
+{
+    FORMAT_HUMAN = 0,
+    FORMAT_JSON,
+    FORMAT_TSV
+};
+
 struct config
 {
     int mode;
+    int format;
+    int stream;
+    int history;
+    int watch;
+    int no_status; /* names only, and they're not sorted by time */
     size_t cols;
     size_t max_name;
 };
@@ -71,8 +88,11 @@ struct serv
 {
     int si;
     int is_s6;
+    int has_s6;
     s6_svstatus_t st6;
     tain stamp;
+    int dirty; /* watch mode: status to be re-read */
+    int unsub; /* watch mode: longrun not supervised yet, to subscribe to */
 };
 
 enum
@@ -204,6 +224,32 @@ pad_col (int i, size_t done)
         pad_with (cols[i].len - done);
 }
 
+/* previous events from the journal, i.e. older than the current status */
+static void
+put_history (aa_service *s)
+{
+    aa_service_status st = { .sa = STRALLOC_ZERO };
+    int first = 1;
+    unsigned int n;
+
+    for (n = 0; aa_journal_get (&st, aa_service_name (s), n) == 0; ++n)
+    {
+        /* cleared, i.e. anything older is from a previous servicedir */
+        if (st.event == AA_EVT_NONE)
+            break;
+        if (!tain_less (&st.stamp, &s->st.stamp) || st.event >= _AA_NB_EVT)
+            continue;
+
+        aa_bs_noflush (AA_OUT, (first) ? "History: " : "         ");
+        put_time (&st.stamp, 1);
+        aa_bs_noflush (AA_OUT, eventmsg[st.event]);
+        aa_bs_flush (AA_OUT, "\n");
+        first = 0;
+    }
+
+    stralloc_free (&st.sa);
+}
+
 static int
 put_list_header (struct config *cfg)
 {
@@ -539,10 +585,116 @@ status_service (struct serv *serv, struct config *cfg)
     }
     aa_bs_flush (AA_OUT, "\n");
 
+    if (cfg->history && cfg->mode == MODE_NORMAL)
+        put_history (s);
+
     if (first)
         first = 0;
 }
 
+/* starts a field (w/ its name for JSON), after the previous one if any */
+static void
+put_field (const char *name, int format, int first)
+{
+    if (format == FORMAT_JSON)
+    {
+        aa_bs_noflush (AA_OUT, (first) ? "{\"" : ",\"");
+        aa_bs_noflush (AA_OUT, name);
+        aa_bs_noflush (AA_OUT, "\":");
+    }
+    else if (!first)
+        aa_bs_noflush (AA_OUT, "\t");
+}
+
+static void
+put_field_s (const char *name, const char *s, int format)
+{
+    put_field (name, format, 0);
+    if (!s)
+    {
+        if (format == FORMAT_JSON)
+            aa_bs_noflush (AA_OUT, "null");
+        return;
+    }
+    if (format == FORMAT_JSON)
+        aa_bs_noflush (AA_OUT, "\"");
+    put_escaped (s, format == FORMAT_JSON);
+    if (format == FORMAT_JSON)
+        aa_bs_noflush (AA_OUT, "\"");
+}
+
+static void
+put_field_stamp (const char *name, tain *stamp, int format)
+{
+    char buf[TIMESTAMP + 1];
+
+    if (!stamp)
+    {
+        put_field_s (name, NULL, format);
+        return;
+    }
+    buf[timestamp_fmt (buf, stamp)] = '\0';
+    put_field_s (name, buf, format);
+}
+
+static void
+put_field_n (const char *name, int has, int n, int format)
+{
+    char buf[INT_FMT];
+
+    put_field (name, format, 0);
+    if (has)
+        aa_bb_noflush (AA_OUT, buf, int_fmt (buf, n));
+    else if (format == FORMAT_JSON)
+        aa_bs_noflush (AA_OUT, "null");
+}
+
+/* one record per service; TSV fields are the same as JSON keys, in the same
+ * order, given on a first line. Missing values are null/empty */
+static void
+put_record (struct serv *serv, struct config *cfg)
+{
+    static int first = 1;
+    aa_service *s = aa_service (serv->si);
+    int has_st = s->st.event != AA_EVT_NONE && s->st.event < _AA_NB_EVT;
+    int format = cfg->format;
+
+    if (first && format == FORMAT_TSV)
+        aa_bs_noflush (AA_OUT, "name\ttype\tsource\tstamp\tevent\tstatus\tcode\tmessage"
+                "\tpid\tready\tready_stamp\twant_up\n");
+    first = 0;
+
+    put_field ("name", format, 1);
+    if (format == FORMAT_JSON)
+        aa_bs_noflush (AA_OUT, "\"");
+    put_escaped (aa_service_name (s), format == FORMAT_JSON);
+    if (format == FORMAT_JSON)
+        aa_bs_noflush (AA_OUT, "\"");
+    put_field_s ("type", (s->st.type == AA_TYPE_ONESHOT) ? "oneshot" : "longrun", format);
+    put_field_s ("source", (serv->is_s6) ? "s6" : (has_st) ? "anopa" : NULL, format);
+    put_field_stamp ("stamp", (serv->is_s6 || has_st) ? &serv->stamp : NULL, format);
+    put_field_n ("event", has_st, s->st.event, format);
+    put_field_s ("status", (has_st) ? eventmsg[s->st.event] : NULL, format);
+    put_field_n ("code", has_st, s->st.code, format);
+    put_field_s ("message", (has_st) ? aa_service_status_get_msg (&s->st) : NULL, format);
+    put_field_n ("pid", serv->has_s6, (serv->st6.flagfinishing) ? 0 : serv->st6.pid, format);
+    put_field_n ("ready", serv->has_s6, serv->st6.flagready, format);
+    put_field_stamp ("ready_stamp", (serv->has_s6 && serv->st6.flagready)
+            ? &serv->st6.readystamp : NULL, format);
+    put_field_n ("want_up", serv->has_s6, serv->st6.flagwantup, format);
+
+    aa_bs_flush (AA_OUT, (format == FORMAT_JSON) ? "}\n" : "\n");
+}
+
+static void
+show_service (struct serv *serv, struct config *cfg)
+{
+    if (cfg->format == FORMAT_HUMAN)
+        status_service (serv, cfg);
+    else
+        put_record (serv, cfg);
+}
+
 static int
 match_status (struct serv *serv, unsigned int filter)
 {
@@ -602,28 +754,16 @@ filter_to_type (unsigned int filter)
 }
 
 static int
-load_service (const char *name, struct config *cfg)
+read_status (struct serv *serv, struct config *cfg)
 {
-    aa_service *s;
-    struct serv serv = { 0, };
-    int r;
-
-    r = aa_get_service (name, &serv.si, 1);
-    if (r < 0)
-    {
-        aa_put_err (name, errmsg[-r], 1);
-        return -1;
-    }
+    aa_service *s = aa_service (serv->si);
+    const char *name = aa_service_name (s);
 
-    r = aa_preload_service (serv.si);
-    if (r < 0)
-    {
-        aa_put_err (name, errmsg[-r], 1);
-        return -1;
-    }
+    /* names only: statuses are only needed to filter or sort by time */
+    if (cfg->no_status)
+        return 0;
 
-    s = aa_service (serv.si);
-    if (aa_service_status_read (&s->st, aa_service_name (s)) < 0 && errno != ENOENT)
+    if (aa_service_status_read (&s->st, name) < 0 && errno != ENOENT)
     {
         int e = errno;
 
@@ -633,15 +773,10 @@ load_service (const char *name, struct config *cfg)
         return -1;
     }
 
-    if (filter_type != FILTER_NONE && filter_type != FILTER_ALL
-            && s->st.type != filter_to_type (filter_type))
-        return -1;
-    if (filter_type == FILTER_LOG && aa_service_name (s)[strlen (aa_service_name (s)) - 4] != '/')
-        return -1;
-
+    serv->is_s6 = serv->has_s6 = 0;
     if (s->st.type == AA_TYPE_LONGRUN)
     {
-        if (!s6_svstatus_read (name, &serv.st6))
+        if (!s6_svstatus_read (name, &serv->st6))
         {
             if (errno != ENOENT)
             {
@@ -653,19 +788,58 @@ load_service (const char *name, struct config *cfg)
                 return -1;
             }
         }
-        else if (tain_less (&s->st.stamp, &serv.st6.stamp))
+        else
         {
-            serv.is_s6 = 1;
-            if (cfg->mode == MODE_LIST && serv.st6.flagready)
-                serv.stamp = serv.st6.readystamp;
-            else
-                serv.stamp = serv.st6.stamp;
+            serv->has_s6 = 1;
+            if (tain_less (&s->st.stamp, &serv->st6.stamp))
+            {
+                serv->is_s6 = 1;
+                if (cfg->mode == MODE_LIST && serv->st6.flagready)
+                    serv->stamp = serv->st6.readystamp;
+                else
+                    serv->stamp = serv->st6.stamp;
+            }
         }
     }
-    if (!serv.is_s6)
-        serv.stamp = s->st.stamp;
+    if (!serv->is_s6)
+        serv->stamp = s->st.stamp;
+
+    return 0;
+}
 
-    if (filter_status != FILTER_NONE && !match_status (&serv, filter_status))
+static int
+load_service (const char *name, struct config *cfg)
+{
+    aa_service *s;
+    struct serv serv = { 0, };
+    int r;
+
+    r = aa_get_service (name, &serv.si, 1);
+    if (r < 0)
+    {
+        aa_put_err (name, errmsg[-r], 1);
+        return -1;
+    }
+
+    r = aa_preload_service (serv.si);
+    if (r < 0)
+    {
+        aa_put_err (name, errmsg[-r], 1);
+        return -1;
+    }
+
+    s = aa_service (serv.si);
+    if (filter_type != FILTER_NONE && filter_type != FILTER_ALL
+            && s->st.type != filter_to_type (filter_type))
+        return -1;
+    if (filter_type == FILTER_LOG && aa_service_name (s)[strlen (aa_service_name (s)) - 4] != '/')
+        return -1;
+
+    if (read_status (&serv, cfg) < 0)
+        return -1;
+
+    /* when watching, its status might match later on */
+    if (filter_status != FILTER_NONE && !cfg->watch && !match_status (&serv, filter_status))
         return -1;
 
     if (cfg->mode == MODE_LIST)
@@ -676,7 +850,11 @@ load_service (const char *name, struct config *cfg)
             cfg->max_name = l;
     }
 
-    genalloc_append (struct serv, &ga_serv, &serv);
+    /* no sorting, so no need to wait for the others */
+    if (cfg->stream && (filter_status == FILTER_NONE || match_status (&serv, filter_status)))
+        put_record (&serv, cfg);
+    if (!cfg->stream || cfg->watch)
+        genalloc_append (struct serv, &ga_serv, &serv);
     return serv.si;
 }
 
@@ -789,6 +967,306 @@ cmp_serv_stamp (const void *_serv1, const void *_serv2)
     return (sort_order == SORT_ASC) ? r : -r;
 }
 
+/* watch mode: statuses are re-read at most every WATCH_INTERVAL ms */
+#define WATCH_INTERVAL      250
+/* how often to try again to subscribe to longruns not supervised yet */
+#define WATCH_RETRY         1000
+
+static genalloc ga_wd = GENALLOC_ZERO; /* int: serv index for inotify wd */
+static genalloc ga_ft = GENALLOC_ZERO; /* int: serv index for ftrigr id */
+static unsigned int nb_dirty = 0;
+static unsigned int nb_unsub = 0;
+
+#define get_serv(i)         (&genalloc_s (struct serv, &ga_serv)[i])
+
+static int
+map_set (genalloc *ga, int key, int idx)
+{
+    size_t len = genalloc_len (int, ga);
+    int none = -1;
+
+    for ( ; len <= (size_t) key; ++len)
+        if (!genalloc_append (int, ga, &none))
+            return 0;
+    genalloc_s (int, ga)[key] = idx;
+    return 1;
+}
+
+static inline int
+map_get (genalloc *ga, int key)
+{
+    return (key >= 0 && (size_t) key < genalloc_len (int, ga)) ? genalloc_s (int, ga)[key] : -1;
+}
+
+static void
+set_dirty (int i)
+{
+    if (i < 0 || get_serv (i)->dirty)
+        return;
+    get_serv (i)->dirty = 1;
+    ++nb_dirty;
+}
+
+static void
+set_all_dirty (void)
+{
+    for (size_t i = 0; i < genalloc_len (struct serv, &ga_serv); ++i)
+        set_dirty (i);
+}
+
+static void
+refresh (struct config *cfg)
+{
+    for (size_t i = 0; nb_dirty > 0 && i < genalloc_len (struct serv, &ga_serv); ++i)
+    {
+        struct serv *serv = get_serv (i);
+        aa_service *s = aa_service (serv->si);
+        struct serv old = *serv;
+        aa_evt event = s->st.event;
+        int code = s->st.code;
+
+        if (!serv->dirty)
+            continue;
+        serv->dirty = 0;
+        --nb_dirty;
+
+        if (read_status (serv, cfg) < 0)
+            continue;
+        if (serv->is_s6 == old.is_s6
+                && !tain_less (&serv->stamp, &old.stamp)
+                && !tain_less (&old.stamp, &serv->stamp)
+                && ((serv->is_s6)
+                    ? serv->st6.pid == old.st6.pid
+                        && serv->st6.flagready == old.st6.flagready
+                        && serv->st6.flagwantup == old.st6.flagwantup
+                        && serv->st6.flagfinishing == old.st6.flagfinishing
+                    : s->st.event == event && s->st.code == code))
+            continue;
+
+        if (filter_status == FILTER_NONE || match_status (serv, filter_status))
+            show_service (serv, cfg);
+    }
+}
+
+static void
+handle_inotify (int fd, int wd_repo)
+{
+    char buf[4096] __attribute__ ((aligned (__alignof__ (struct inotify_event))));
+
+    for (;;)
+    {
+        ssize_t r;
+        ssize_t i;
+
+        r = read (fd, buf, sizeof (buf));
+        if (r < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN)
+                aa_strerr_diefu1sys (ERR_IO, "read inotify events");
+            return;
+        }
+
+        for (i = 0; i < r; )
+        {
+            struct inotify_event *ev = (struct inotify_event *) (buf + i);
+
+            i += sizeof (*ev) + ev->len;
+            if (ev->mask & IN_Q_OVERFLOW)
+                set_all_dirty ();
+            else if (ev->len == 0)
+                continue;
+            else if (ev->wd == wd_repo)
+            {
+                /* no telling which services got a new record, and the table
+                 * is updated in place, so this is how we learn of changes */
+                if (str_equal (ev->name, AA_JOURNAL_FILENAME))
+                {
+                    if (aa_journal_load () < 0)
+                        aa_strerr_warnu1sys ("load " AA_JOURNAL_FILENAME);
+                    set_all_dirty ();
+                }
+                else if (str_equal (ev->name, AA_STATUS_TABLE_FILENAME))
+                {
+                    aa_status_table_close ();
+                    if (aa_status_table_open (AA_STATUS_TABLE_RDONLY) < 0)
+                        aa_strerr_warnu1sys ("open " AA_STATUS_TABLE_FILENAME);
+                    set_all_dirty ();
+                }
+            }
+            else if (str_equal (ev->name, AA_SVST_FILENAME))
+                set_dirty (map_get (&ga_wd, ev->wd));
+        }
+    }
+}
+
+static void
+handle_ftrigr (ftrigr_t *ft)
+{
+    int r;
+
+    r = ftrigr_update (ft);
+    if (r < 0)
+        aa_strerr_diefu1sys (ERR_IO, "read s6 events");
+    else if (r == 0)
+        return;
+
+    for (size_t i = 0; i < genalloc_len (uint16_t, &ft->list); ++i)
+    {
+        uint16_t id = genalloc_s (uint16_t, &ft->list)[i];
+        char c;
+
+        if (ftrigr_check (ft, id, &c) > 0)
+            set_dirty (map_get (&ga_ft, id));
+    }
+}
+
+/* subscribes to s6 events of longrun i. If not supervised (yet), it is flagged
+ * to try again later */
+static void
+subscribe (ftrigr_t *ft, int i)
+{
+    struct serv *serv = get_serv (i);
+    const char *name = aa_service_name (aa_service (serv->si));
+    size_t l = strlen (name);
+    char fifodir[l + 1 + sizeof (S6_SUPERVISE_EVENTDIR)];
+    tain deadline;
+    uint16_t id;
+
+    byte_copy (fifodir, l, name);
+    fifodir[l] = '/';
+    byte_copy (fifodir + l + 1, sizeof (S6_SUPERVISE_EVENTDIR), S6_SUPERVISE_EVENTDIR);
+
+    tain_addsec_g (&deadline, 1);
+    id = ftrigr_subscribe_g (ft, fifodir, ".", FTRIGR_REPEAT, &deadline);
+    if (id == 0 && errno == ENOENT)
+    {
+        if (!serv->unsub)
+        {
+            serv->unsub = 1;
+            ++nb_unsub;
+        }
+        return;
+    }
+
+    if (serv->unsub)
+    {
+        serv->unsub = 0;
+        --nb_unsub;
+        /* it might have changed meanwhile */
+        set_dirty (i);
+    }
+    if (id == 0)
+        aa_strerr_warnu2sys ("subscribe to eventdir of ", name);
+    else if (!map_set (&ga_ft, id, i))
+        aa_strerr_diefu1sys (ERR_IO, "watch s6 events");
+}
+
+static void
+watch (struct config *cfg)
+{
+    ftrigr_t ft = FTRIGR_ZERO;
+    iopause_fd iop[2];
+    unsigned int nb_iop = 1;
+    tain next = TAIN_ZERO;
+    tain retry;
+    int wd_repo;
+    int fd;
+
+    fd = inotify_init1 (IN_NONBLOCK | IN_CLOEXEC);
+    if (fd < 0)
+        aa_strerr_diefu1sys (ERR_IO, "initialize inotify");
+    /* status.anopa is always replaced (renamed into place), the journal
+     * appended to, and the table replaced when (re)built */
+    wd_repo = inotify_add_watch (fd, ".", IN_MODIFY | IN_MOVED_TO);
+    if (wd_repo < 0)
+        aa_strerr_diefu1sys (ERR_IO, "watch repository");
+
+    tain_now_g ();
+    {
+        tain deadline;
+
+        tain_addsec_g (&deadline, 1);
+        if (ftrigr_startf_g (&ft, &deadline))
+            nb_iop = 2;
+        else
+            aa_strerr_warnu1sys ("start s6 event listener; Long-run services won't be watched");
+    }
+
+    for (size_t i = 0; i < genalloc_len (struct serv, &ga_serv); ++i)
+    {
+        aa_service *s = aa_service (get_serv (i)->si);
+        const char *name = aa_service_name (s);
+        int wd;
+
+        wd = inotify_add_watch (fd, name, IN_MOVED_TO);
+        if (wd < 0 || !map_set (&ga_wd, wd, i))
+            aa_strerr_warnu2sys ("watch servicedir of ", name);
+
+        if (nb_iop == 2 && s->st.type == AA_TYPE_LONGRUN)
+            subscribe (&ft, i);
+    }
+
+    {
+        tain interval;
+
+        tain_from_millisecs (&interval, WATCH_RETRY);
+        tain_add_g (&retry, &interval);
+    }
+
+    iop[0].fd = fd;
+    iop[0].events = IOPAUSE_READ;
+    iop[1].fd = ftrigr_fd (&ft);
+    iop[1].events = IOPAUSE_READ;
+
+    for (;;)
+    {
+        tain deadline;
+        int r;
+
+        if (nb_dirty > 0)
+            deadline = next;
+        else
+            tain_add_g (&deadline, &tain_infinite_relative);
+        if (nb_unsub > 0 && tain_less (&retry, &deadline))
+            deadline = retry;
+
+        r = iopause_g (iop, nb_iop, &deadline);
+        if (r < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            aa_strerr_diefu1sys (ERR_IO, "iopause");
+        }
+
+        if (r > 0 && (iop[0].revents & IOPAUSE_READ))
+            handle_inotify (fd, wd_repo);
+        if (r > 0 && nb_iop == 2 && (iop[1].revents & IOPAUSE_READ))
+            handle_ftrigr (&ft);
+
+        if (nb_dirty > 0 && !tain_less (&STAMP, &next))
+        {
+            tain interval;
+
+            refresh (cfg);
+            tain_from_millisecs (&interval, WATCH_INTERVAL);
+            tain_add_g (&next, &interval);
+        }
+
+        if (nb_unsub > 0 && !tain_less (&STAMP, &retry))
+        {
+            tain interval;
+
+            for (size_t i = 0; i < genalloc_len (struct serv, &ga_serv); ++i)
+                if (get_serv (i)->unsub)
+                    subscribe (&ft, i);
+            tain_from_millisecs (&interval, WATCH_RETRY);
+            tain_add_g (&retry, &interval);
+        }
+    }
+}
+
 static void
 dieusage (int rc)
 {
@@ -803,7 +1281,10 @@ dieusage (int rc)
             " -R, --reverse                 Reverse sort order\n"
             " -N, --name                    Sort by name\n"
             " -L, --list                    Show statuses as one-liners list\n"
+            " -H, --history                 Also show previous events from the journal\n"
+            " -w, --watch                   Keep running, showing services as their status changes\n"
             " -n, --dry-list                Only show service names\n"
+            " -F, --format FORMAT           Output one record per service, FORMAT being json or tsv\n"
             " -h, --help                    Show this help screen and exit\n"
             " -V, --version                 Show version information and exit\n"
             );
@@ -817,6 +1298,7 @@ main (int argc, char * const argv[])
     const char *path_list = NULL;
     struct config cfg = { 0, };
     int (*sort_fn) (const void *, const void *) = cmp_serv_stamp;
+    int sort_set = 0;
     int all = 0;
     int r;
 
@@ -826,7 +1308,9 @@ main (int argc, char * const argv[])
             { "all",                no_argument,        NULL,   'a' },
             { "double-output",      no_argument,        NULL,   'D' },
             { "filter",             required_argument,  NULL,   'f' },
+            { "format",             required_argument,  NULL,   'F' },
             { "help",               no_argument,        NULL,   'h' },
+            { "history",            no_argument,        NULL,   'H' },
             { "listdir",            required_argument,  NULL,   'l' },
             { "list",               no_argument,        NULL,   'L' },
             { "name",               no_argument,        NULL,   'N' },
@@ -835,11 +1319,12 @@ main (int argc, char * const argv[])
             { "repodir",            required_argument,  NULL,   'r' },
             { "sort",               required_argument,  NULL,   's' },
             { "version",            no_argument,        NULL,   'V' },
+            { "watch",              no_argument,        NULL,   'w' },
             { NULL, 0, 0, 0 }
         };
         int c;
 
-        c = getopt_long (argc, argv, "aDf:hl:LNnRr:s:V", longopts, NULL);
+        c = getopt_long (argc, argv, "aDf:F:Hhl:LNnRr:s:Vw", longopts, NULL);
         if (c == -1)
             break;
         switch (c)
@@ -857,6 +1342,22 @@ main (int argc, char * const argv[])
                     aa_strerr_diefu3sys (1, "set filter '", optarg, "'");
                 break;
 
+            case 'F':
+                if (str_equal (optarg, "json"))
+                    cfg.format = FORMAT_JSON;
+                else if (str_equal (optarg, "tsv"))
+                    cfg.format = FORMAT_TSV;
+                else
+                {
+                    errno = EINVAL;
+                    aa_strerr_diefu3sys (1, "set format '", optarg, "'");
+                }
+                break;
+
+            case 'H':
+                cfg.history = 1;
+                break;
+
             case 'h':
                 dieusage (0);
 
@@ -871,6 +1372,7 @@ main (int argc, char * const argv[])
 
             case 'N':
                 sort_fn = cmp_serv_name;
+                sort_set = 1;
                 break;
 
             case 'n':
@@ -879,6 +1381,7 @@ main (int argc, char * const argv[])
 
             case 'R':
                 sort_order = SORT_DESC;
+                sort_set = 1;
                 break;
 
             case 'r':
@@ -898,11 +1401,16 @@ main (int argc, char * const argv[])
                     errno = EINVAL;
                     aa_strerr_diefu3sys (1, "set sort order '", optarg, "'");
                 }
+                sort_set = 1;
                 break;
 
             case 'V':
                 aa_die_version ();
 
+            case 'w':
+                cfg.watch = 1;
+                break;
+
             default:
                 dieusage (1);
         }
@@ -912,10 +1420,25 @@ main (int argc, char * const argv[])
 
     if (!all && !path_list && argc < 1)
         dieusage (1);
+    if (cfg.format != FORMAT_HUMAN)
+    {
+        /* records are streamed as services are loaded, unless sorted */
+        cfg.mode = MODE_NORMAL;
+        cfg.stream = !sort_set || !sort_fn;
+    }
+    if (cfg.mode == MODE_DRY_LIST)
+    {
+        cfg.watch = 0;
+        cfg.no_status = filter_status == FILTER_NONE && sort_fn != cmp_serv_stamp;
+    }
 
     r = aa_init_repo (path_repo, AA_REPO_READ);
     if (r < 0)
         aa_strerr_diefu2sys (2, "init repository ", path_repo);
+    if (aa_journal_load () < 0)
+        aa_strerr_warnu1sys ("load " AA_JOURNAL_FILENAME);
+    if (aa_status_table_open (AA_STATUS_TABLE_RDONLY) < 0)
+        aa_strerr_warnu1sys ("open " AA_STATUS_TABLE_FILENAME);
 
     if (cfg.mode == MODE_LIST)
     {
@@ -966,12 +1489,16 @@ main (int argc, char * const argv[])
             else
                 load_service (argv[i], &cfg);
 
-    if (sort_fn)
+    if (sort_fn && !cfg.stream)
         qsort (genalloc_s(struct serv, &ga_serv), genalloc_len (struct serv, &ga_serv),
                 sizeof (struct serv), sort_fn);
 
-    for (size_t i = 0; i < genalloc_len (struct serv, &ga_serv); ++i)
-        status_service (&genalloc_s (struct serv, &ga_serv)[i], &cfg);
+    for (size_t i = 0; !cfg.stream && i < genalloc_len (struct serv, &ga_serv); ++i)
+        if (filter_status == FILTER_NONE || match_status (get_serv (i), filter_status))
+            show_service (get_serv (i), &cfg);
+
+    if (cfg.watch)
+        watch (&cfg);
 
     return 0;
 }
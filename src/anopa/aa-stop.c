@@ -39,6 +39,10 @@
 #include <s6/supervise.h>
 #include <anopa/common.h>
 #include <anopa/err.h>
+#include <anopa/graph.h>
+#include <anopa/journal.h>
+#include <anopa/status_table.h>
+#include <anopa/timeline.h>
 #include <anopa/init_repo.h>
 #include <anopa/output.h>
 #include <anopa/scan_dir.h>
@@ -60,12 +64,6 @@ static int verbose = 0;
 static int rc = 0;
 static const char *skip = NULL;
 
-void
-check_essential (int si)
-{
-    /* required by start-stop.c; only used by aa-start.c */
-}
-
 static void
 autoload_cb (int si, aa_al al, const char *name, int err)
 {
@@ -222,12 +220,12 @@ add_service (const char *name, void *data)
         {
             size_t i;
 
-            add_to_list (&aa_main_list, si, 0);
-            remove_from_list (&aa_tmp_list, si);
+            add_to_set (&aa_main_list, si);
+            remove_from_set (&aa_tmp_list, si);
 
-            for (i = 0; i < genalloc_len (int, &aa_service (si)->needs); ++i)
+            for (i = 0; i < edges_len (&aa_service (si)->needs); ++i)
             {
-                int sni = list_get (&aa_service (si)->needs, i);
+                int sni = edges_get (&aa_service (si)->needs, i);
                 add_service (aa_service_name (aa_service (sni)), NULL);
             }
         }
@@ -267,6 +265,9 @@ dieusage (int rc)
             " -l, --listdir DIR             Use DIR to list services to stop\n"
             " -k, --skip SERVICE            Skip (do not stop) SERVICE\n"
             " -t, --timeout SECS            Use SECS seconds as default timeout\n"
+            " -J, --journal                 Record statuses in the repository's journal\n"
+            " -j, --jobs NB                 Run at most NB oneshots at once\n"
+            " -A, --adaptive-jobs           Adapt number of oneshots at once to system pressure\n"
             " -a, --all                     Stop all running services\n"
             " -n, --dry-list                Only show service names (don't stop anything)\n"
             " -v, --verbose                 Print auto-added dependencies\n"
@@ -311,15 +312,19 @@ main (int argc, char * const argv[])
     const char *path_repo = "/run/services";
     const char *path_list = NULL;
     int all = 0;
+    int journal = 0;
     int i;
 
     aa_secs_timeout = DEFAULT_TIMEOUT_SECS;
     for (;;)
     {
         struct option longopts[] = {
+            { "adaptive-jobs",      no_argument,        NULL,   'A' },
             { "all",                no_argument,        NULL,   'a' },
             { "double-output",      no_argument,        NULL,   'D' },
             { "help",               no_argument,        NULL,   'h' },
+            { "journal",            no_argument,        NULL,   'J' },
+            { "jobs",               required_argument,  NULL,   'j' },
             { "skip",               required_argument,  NULL,   'k' },
             { "listdir",            required_argument,  NULL,   'l' },
             { "dry-list",           no_argument,        NULL,   'n' },
@@ -331,7 +336,7 @@ main (int argc, char * const argv[])
         };
         int c;
 
-        c = getopt_long (argc, argv, "aDhk:l:nr:t:Vv", longopts, NULL);
+        c = getopt_long (argc, argv, "aADhJj:k:l:nr:t:Vv", longopts, NULL);
         if (c == -1)
             break;
         switch (c)
@@ -343,6 +348,10 @@ main (int argc, char * const argv[])
                     all = 1;
                 break;
 
+            case 'A':
+                adaptive_jobs = 1;
+                break;
+
             case 'D':
                 aa_set_double_output (1);
                 break;
@@ -350,6 +359,15 @@ main (int argc, char * const argv[])
             case 'h':
                 dieusage (0);
 
+            case 'J':
+                journal = 1;
+                break;
+
+            case 'j':
+                if (!uint0_scan (optarg, &max_jobs))
+                    aa_strerr_diefu2sys (ERR_IO, "set max jobs to ", optarg);
+                break;
+
             case 'k':
                 skip = optarg;
                 break;
@@ -401,6 +419,17 @@ main (int argc, char * const argv[])
 
     if (aa_init_repo (path_repo, (mode & AA_MODE_IS_DRY) ? AA_REPO_READ : AA_REPO_WRITE) < 0)
         aa_strerr_diefu2sys (ERR_IO, "init repository ", path_repo);
+    /* not fatal, we'll just read everything from the servicedirs then */
+    if (aa_graph_load () < 0)
+        aa_strerr_warnu1sys ("load " AA_GRAPH_FILENAME);
+    /* w/ a journal, statuses are recorded there instead of each in its own
+     * file (hence loaded before services are) */
+    if (((mode & AA_MODE_IS_DRY) ? aa_journal_load () : aa_journal_open (journal)) < 0)
+        aa_strerr_warnu1sys ("open " AA_JOURNAL_FILENAME);
+    /* not fatal either, statuses are then only read from/written to files */
+    if (aa_status_table_open ((mode & AA_MODE_IS_DRY)
+                ? AA_STATUS_TABLE_RDONLY : AA_STATUS_TABLE_CREATE) < 0)
+        aa_strerr_warnu1sys ("open " AA_STATUS_TABLE_FILENAME);
 
     /* let's "preload" every services from the repo. This will have everything
      * in tmp list, either LOAD_DONE when up, or LOAD_FAIL when not
@@ -429,16 +458,16 @@ main (int argc, char * const argv[])
          * sure to process "valid" services, since there could be LOAD_FAIL ones
          * (ERR_NOT_UP) that we should simply ignore.
          */
-        for (i = 0; i < genalloc_len (int, &aa_tmp_list); )
+        for (i = 0; i < set_len (&aa_tmp_list); )
         {
-            int si = list_get (&aa_tmp_list, i);
+            int si = set_get (&aa_tmp_list, i);
 
             if (aa_service (si)->ls == AA_LOAD_DONE)
             {
                 if (!skip || !str_equal (aa_service_name (aa_service (si)), skip))
                 {
-                    add_to_list (&aa_main_list, si, 0);
-                    remove_from_list (&aa_tmp_list, si);
+                    add_to_set (&aa_main_list, si);
+                    remove_from_set (&aa_tmp_list, si);
                 }
                 else
                 {
@@ -488,6 +517,13 @@ main (int argc, char * const argv[])
 
     mainloop (mode, scan_cb);
 
+    if (aa_journal_close () < 0)
+        aa_strerr_warnu1sys ("write " AA_JOURNAL_FILENAME);
+    aa_status_table_close ();
+    if (!(mode & AA_MODE_IS_DRY) && aa_timeline_write () < 0)
+        aa_strerr_warnu1sys ("write " AA_TIMELINE_FILENAME);
+    aa_timeline_free ();
+
     if (!(mode & AA_MODE_IS_DRY))
     {
         aa_bs_noflush (AA_OUT, "\n");
@@ -506,12 +542,12 @@ main (int argc, char * const argv[])
     genalloc_free (int, &ga_depend);
     genalloc_free (size_t, &ga_io);
     genalloc_free (size_t, &ga_unknown);
-    genalloc_free (pid_t, &ga_pid);
-    genalloc_free (int, &aa_tmp_list);
-    genalloc_free (int, &aa_main_list);
-    stralloc_free (&aa_names);
+    set_free (&aa_tmp_list);
+    set_free (&aa_main_list);
     genalloc_deepfree (struct progress, &ga_progress, free_progress);
+    /* names are needed to remove fifos of longruns still waited on */
     aa_free_services (close_fd);
-    genalloc_free (iopause_fd, &ga_iop);
+    stralloc_free (&aa_names);
+    aa_graph_free ();
     return rc;
 }
@@ -20,32 +20,40 @@
  * anopa. If not, see http://www.gnu.org/licenses/
  */
 
+#define _BSD_SOURCE
+
+#include <stdint.h>
+#include <string.h>
 #include <locale.h>
 #include <termios.h>
 #include <sys/ioctl.h>
 #include <langinfo.h>
 #include <errno.h>
 #include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
 #include <skalibs/allreadwrite.h>
 #include <skalibs/djbunix.h>
 #include <skalibs/bytestr.h>
 #include <skalibs/tai.h>
 #include <skalibs/stralloc.h>
 #include <skalibs/genalloc.h>
-#include <skalibs/iopause.h>
 #include <skalibs/selfpipe.h>
 #include <skalibs/sig.h>
 #include <skalibs/types.h>
 #include <anopa/service.h>
 #include <anopa/ga_int_list.h>
+#include <anopa/ga_int_set.h>
 #include <anopa/output.h>
 #include <anopa/err.h>
+#include <anopa/durations.h>
+#include <anopa/journal.h>
+#include <anopa/timeline.h>
 #include "start-stop.h"
 
-genalloc ga_iop = GENALLOC_ZERO;
+int fd_iop = -1;
 genalloc ga_progress = GENALLOC_ZERO;
-genalloc ga_pid = GENALLOC_ZERO;
-tain iol_deadline;
 unsigned int draw = 0;
 int nb_already = 0;
 int nb_done = 0;
@@ -57,9 +65,89 @@ int is_utf8 = 0;
 int ioloop = 1;
 int si_password = -1;
 int si_active = -1;
+unsigned int max_jobs = 0;
+int adaptive_jobs = 0;
+
+/* fds are watched via epoll, each w/ its service (or -1) so dispatching an
+ * event is direct */
+#define IOP_READ                    (EPOLLIN | EPOLLHUP)
+#define IOP_WRITE                   EPOLLOUT
+#define IOP_EXCEPT                  (EPOLLERR | EPOLLHUP)
+#define IOP_MAX_EVENTS              64
+#define iop_pack(fd,si)             (((uint64_t) (uint32_t) (si) << 32) | (uint32_t) (fd))
+#define iop_fd(data)                ((int) (uint32_t) (data))
+#define iop_si(data)                ((int) (uint32_t) ((data) >> 32))
+#define is_pidfd(fd,si)             ((si) >= 0 && aa_service (si)->oi >= 0 \
+                                        && (fd) == aa_oneshot (aa_service (si))->fd_pid)
+#define is_evfd(fd,si)              ((si) >= 0 && (fd) == aa_service (si)->fd_event)
+
+/* oneshots running w/out a pidfd (old kernel), reaped on SIGCHLD instead */
+static int nb_nopidfd = 0;
+
+/* deadlines of services in flight (timeout, then SIGKILL for oneshots) as a
+ * min-heap, so only expired ones are looked at; each service knows the index
+ * of its own (ti) */
+struct timer
+{
+    tain deadline;
+    int si;
+};
+static genalloc ga_timers = GENALLOC_ZERO; /* struct timer */
+#define timer(i)                    (&genalloc_s (struct timer, &ga_timers)[i])
+#define nb_timers()                 genalloc_len (struct timer, &ga_timers)
+/* warn when running more than FACTOR times (and at least MIN_MS more than) its
+ * p99, if known from enough previous starts */
+#define OVERRUN_FACTOR              2
+#define OVERRUN_MIN_MS              1000
+#define OVERRUN_MIN_SAMPLES         4
+
+/* current limit of oneshots running at once (0 for none) */
+static int cur_jobs = 0;
+static int ceil_jobs = 0;
+/* oneshots ready but held back by the limit, waiting their turn */
+static genalloc ga_jobs_waiting = GENALLOC_ZERO; /* int: si, FIFO */
+static size_t jobs_head = 0;
+/* pressure stall information, for adaptive jobs */
+static const char * const psi_files[] = {
+    "/proc/pressure/cpu",
+    "/proc/pressure/io",
+    "/proc/pressure/memory"
+};
+#define NB_PSI_FILES        (sizeof (psi_files) / sizeof (*psi_files))
+static uint64_t psi_total[NB_PSI_FILES];
+static tain psi_stamp;
+
+/* pools of services: at most limit of them exec-ed at once (i.e. until done),
+ * others waiting their turn */
+struct pool
+{
+    const char *name;
+    unsigned int limit;
+    unsigned int running;
+    genalloc waiting; /* int: si, FIFO */
+    size_t head;
+};
+static genalloc ga_pools = GENALLOC_ZERO; /* struct pool */
+
+/* timeline of the transaction, to be analyzed later (aa-analyze) */
+struct tl
+{
+    tain ready;
+    tain end;
+    int after; /* deciding dependency (the one done last), or -1 */
+    aa_evt event;
+    int code;
+    int state; /* 0: nothing yet, 1: exec-ed, 2: done */
+};
+static genalloc ga_tl = GENALLOC_ZERO; /* struct tl, indexed by si */
 
-/* aa-start.c */
-void check_essential (int si);
+static void
+no_check_essential (int si)
+{
+}
+
+/* called for every failed service; aa-start checks whether it was essential */
+void (*check_essential) (int si) = no_check_essential;
 
 void
 free_progress (struct progress *pg)
@@ -104,7 +192,7 @@ draw_progress_for (int si)
 {
     struct progress *pg;
 
-    pg = &genalloc_s (struct progress, &ga_progress)[aa_service (si)->pi];
+    pg = &genalloc_s (struct progress, &ga_progress)[aa_oneshot (aa_service (si))->pi];
     aa_progress_draw (&pg->aa_pg, aa_service_name (aa_service (si)), cols, is_utf8);
     pg->is_drawn = 1;
     draw |= DRAW_CUR_PROGRESS;
@@ -114,7 +202,8 @@ void
 draw_password ()
 {
     aa_service *s = aa_service (si_password);
-    struct progress *pg = &genalloc_s (struct progress, &ga_progress)[s->pi];
+    aa_oneshot *os = aa_oneshot (s);
+    struct progress *pg = &genalloc_s (struct progress, &ga_progress)[os->pi];
 
     if (pg->is_drawn == DRAWN_PASSWORD_READY)
         aa_is_noflush (AA_OUT, ANSI_HIGHLIGHT_ON);
@@ -160,11 +249,13 @@ draw_waiting (int already_drawn)
     int si;
     tain ts;
     int secs;
+    int ms;
+    unsigned int expected;
 
     if (already_drawn)
         aa_is_noflush (AA_OUT, ANSI_CLEAR_BEFORE ANSI_START_LINE);
 
-    nb = genalloc_len (pid_t, &ga_pid) + nb_wait_longrun;
+    nb = set_len (&aa_tmp_list) + nb_wait_longrun;
     if (nb <= 0)
         return;
     else if (n > nb)
@@ -181,31 +272,31 @@ draw_waiting (int already_drawn)
     else
         ++tick;
 
-    if ((size_t) n <= genalloc_len (pid_t, &ga_pid))
-        si = list_get (&aa_tmp_list, n - 1);
+    if ((size_t) n <= set_len (&aa_tmp_list))
+        si = set_get (&aa_tmp_list, n - 1);
     else
     {
-        int l = genalloc_len (int, &aa_main_list);
+        int l = set_len (&aa_main_list);
         int i;
         int j;
 
-        j = n - genalloc_len (pid_t, &ga_pid);
+        j = n - set_len (&aa_tmp_list);
         for (i = 0; i < l && j > 0; ++i)
-            if (aa_service (list_get (&aa_main_list, i))->ft_id > 0)
+            if (aa_service (set_get (&aa_main_list, i))->fd_event >= 0)
                 --j;
         if (j > 0)
         {
             aa_strerr_warnu1x ("find longrun service -- THIS IS A BUG!");
             return;
         }
-        si = list_get (&aa_main_list, i - 1);
+        si = set_get (&aa_main_list, i - 1);
     }
 
     if (!tain_sub (&ts, &STAMP, &aa_service (si)->ts_exec))
-        secs = -1;
+        secs = ms = -1;
     else
     {
-        secs = tain_to_millisecs (&ts);
+        secs = ms = tain_to_millisecs (&ts);
         if (secs > 0)
             secs /= 1000;
     }
@@ -234,6 +325,15 @@ draw_waiting (int already_drawn)
             aa_is_noflush (AA_OUT, "\u221e"); /* infinity sign */
         else
             aa_is_noflush (AA_OUT, "Inf");
+
+        /* expected time left, from previous starts */
+        expected = aa_durations_get (aa_service_name (aa_service (si)));
+        if (ms >= 0 && expected >= (unsigned int) ms + 1000)
+        {
+            aa_is_noflush (AA_OUT, "; ~");
+            is_noflush_time ((expected - ms + 999) / 1000);
+            aa_is_noflush (AA_OUT, " left");
+        }
     }
 
     if (nb > 1 || secs >= 0)
@@ -294,7 +394,6 @@ refresh_draw ()
 
             if (pg->si >= 0 && pg->is_drawn == DRAWN_PASSWORD_READY)
             {
-                iopause_fd iop;
                 int r;
 
                 r = term_set_echo (0);
@@ -306,9 +405,7 @@ refresh_draw ()
                     break;
                 }
 
-                iop.fd = 0;
-                iop.events = IOPAUSE_READ;
-                genalloc_append (iopause_fd, &ga_iop, &iop);
+                add_fd_to_iop (0, pg->si, EPOLLIN);
 
                 si_password = pg->si;
                 break;
@@ -360,18 +457,25 @@ add_name_to_ga (const char *name, genalloc *ga)
 }
 
 void
-remove_fd_from_iop (int fd)
+add_fd_to_iop (int fd, int si, uint32_t events)
 {
-    size_t i;
+    struct epoll_event ev;
 
-    for (i = 0; i < genalloc_len (iopause_fd, &ga_iop); ++i)
-        if (genalloc_s (iopause_fd, &ga_iop)[i].fd == fd)
-        {
-            ga_remove (&ga_iop, sizeof (iopause_fd), i);
-            break;
-        }
+    ev.events = events;
+    ev.data.u64 = iop_pack (fd, si);
+    if (epoll_ctl (fd_iop, EPOLL_CTL_ADD, fd, &ev) < 0)
+        aa_strerr_diefu1sys (ERR_IO, "add fd to epoll");
+}
+
+/* must be done before closing it, as a child might still share it */
+void
+remove_fd_from_iop (int fd)
+{
+    if (fd_iop >= 0)
+        epoll_ctl (fd_iop, EPOLL_CTL_DEL, fd, NULL);
 }
 
+/* si can be -1 if unknown (only when freeing services, after the loop) */
 void
 close_fd_for (int fd, int si)
 {
@@ -379,79 +483,201 @@ close_fd_for (int fd, int si)
     {
         size_t i;
 
-        for (i = 0; i < genalloc_len (int, &aa_tmp_list); ++i)
-            if (aa_service (list_get (&aa_tmp_list, i))->fd_in == fd
-                    || aa_service (list_get (&aa_tmp_list, i))->fd_out == fd
-                    || aa_service (list_get (&aa_tmp_list, i))->fd_progress == fd)
+        for (i = 0; i < set_len (&aa_tmp_list); ++i)
+        {
+            aa_service *s = aa_service (set_get (&aa_tmp_list, i));
+
+            if (s->oi >= 0 && (aa_oneshot (s)->fd_in == fd
+                        || aa_oneshot (s)->fd_out == fd
+                        || aa_oneshot (s)->fd_progress == fd))
             {
-                si = list_get (&aa_tmp_list, i);
+                si = set_get (&aa_tmp_list, i);
                 break;
             }
+        }
     }
 
-    fd_close (fd);
     remove_fd_from_iop (fd);
-    if (si >= 0)
+    fd_close (fd);
+    if (si >= 0 && aa_service (si)->oi >= 0)
     {
-        if (aa_service (si)->fd_in == fd)
-            aa_service (si)->fd_in = -1;
-        else if (aa_service (si)->fd_out == fd)
-            aa_service (si)->fd_out = -1;
-        else if (aa_service (si)->fd_progress == fd)
+        aa_oneshot *os = aa_oneshot (aa_service (si));
+
+        if (os->fd_in == fd)
+            os->fd_in = -1;
+        else if (os->fd_out == fd)
+            os->fd_out = -1;
+        else if (os->fd_progress == fd)
         {
-            if (aa_service (si)->pi >= 0)
+            if (os->pi >= 0)
             {
                 struct progress *pg;
 
-                pg = &genalloc_s (struct progress, &ga_progress)[aa_service (si)->pi];
+                pg = &genalloc_s (struct progress, &ga_progress)[os->pi];
                 if (pg->is_drawn)
                     clear_draw ();
                 pg->si = -1;
                 pg->aa_pg.sa.len = 0;
             }
-            aa_service (si)->fd_progress = -1;
+            os->fd_progress = -1;
         }
     }
 }
 
+static void
+swap_timers (size_t i, size_t j)
+{
+    struct timer t = *timer (i);
+
+    *timer (i) = *timer (j);
+    *timer (j) = t;
+    aa_service (timer (i)->si)->ti = i;
+    aa_service (timer (j)->si)->ti = j;
+}
+
+static void
+sift_timer (size_t i)
+{
+    size_t l = nb_timers ();
+
+    while (i > 0 && tain_less (&timer (i)->deadline, &timer ((i - 1) / 2)->deadline))
+    {
+        swap_timers (i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+
+    for (;;)
+    {
+        size_t c = 2 * i + 1;
+
+        if (c >= l)
+            break;
+        if (c + 1 < l && tain_less (&timer (c + 1)->deadline, &timer (c)->deadline))
+            ++c;
+        if (!tain_less (&timer (c)->deadline, &timer (i)->deadline))
+            break;
+        swap_timers (i, c);
+        i = c;
+    }
+}
+
+static void
+set_timer (int si, tain const *deadline)
+{
+    aa_service *s = aa_service (si);
+
+    if (s->ti < 0)
+    {
+        struct timer t = { .deadline = *deadline, .si = si };
+
+        if (!genalloc_append (struct timer, &ga_timers, &t))
+            aa_strerr_diefu1sys (ERR_IO, "set timeout");
+        s->ti = nb_timers () - 1;
+    }
+    else
+        timer (s->ti)->deadline = *deadline;
+    sift_timer (s->ti);
+}
+
+static void
+unset_timer (int si)
+{
+    size_t i = aa_service (si)->ti;
+    size_t last;
+
+    if (aa_service (si)->ti < 0)
+        return;
+
+    last = nb_timers () - 1;
+    if (i < last)
+        swap_timers (i, last);
+    genalloc_setlen (struct timer, &ga_timers, last);
+    aa_service (si)->ti = -1;
+    if (i < last)
+        sift_timer (i);
+}
+
+/* how long si can run before we warn it's taking far longer than usual (from
+ * its history of durations), or 0 */
+static unsigned int
+overrun_msecs (int si)
+{
+    const char *name = aa_service_name (aa_service (si));
+    unsigned int p99;
+
+    if (aa_durations_nb (name) < OVERRUN_MIN_SAMPLES)
+        return 0;
+    p99 = aa_durations_percentile (name, 99);
+    return (p99 * OVERRUN_FACTOR > p99 + OVERRUN_MIN_MS)
+        ? p99 * OVERRUN_FACTOR : p99 + OVERRUN_MIN_MS;
+}
+
+/* (re)sets the timer of si from when it was exec-ed & its timeout, or to warn
+ * about it running longer than usual first */
+static void
+schedule_timeout (int si)
+{
+    aa_service *s = aa_service (si);
+    unsigned int ms = 0;
+    tain ts;
+
+    if (s->overrun != 2)
+    {
+        ms = overrun_msecs (si);
+        if (s->secs_timeout > 0 && ms >= 1000 * s->secs_timeout)
+            ms = 0;
+        s->overrun = (ms > 0);
+    }
+    if (ms == 0 && s->secs_timeout == 0)
+    {
+        unset_timer (si);
+        return;
+    }
+
+    tain_from_millisecs (&ts, (ms > 0) ? ms : 1000 * s->secs_timeout);
+    tain_add (&ts, &s->ts_exec, &ts);
+    set_timer (si, &ts);
+}
+
 int
 handle_fd_out (int si)
 {
     aa_service *s = aa_service (si);
+    aa_oneshot *os = aa_oneshot (s);
 
     for (;;)
     {
         char buf[256];
         ssize_t r;
 
-        r = fd_read (s->fd_out, buf, 256);
+        r = fd_read (os->fd_out, buf, 256);
         if (r < 0)
             return (errno == EAGAIN) ? 0 : r;
         else if (r == 0)
         {
-            close_fd_for (s->fd_out, si);
+            close_fd_for (os->fd_out, si);
             return 0;
         }
 
-        if (!stralloc_catb (&s->sa_out, buf, r))
+        if (!stralloc_catb (&os->sa_out, buf, r))
             return -1;
 
         for (;;)
         {
             size_t len;
 
-            len = byte_chr (s->sa_out.s, s->sa_out.len, '\n');
-            if (len >= s->sa_out.len)
+            len = byte_chr (os->sa_out.s, os->sa_out.len, '\n');
+            if (len >= os->sa_out.len)
                 break;
 
             ++len;
             clear_draw ();
             aa_bs_noflush (AA_OUT, aa_service_name (s));
             aa_bs_noflush (AA_OUT, ": ");
-            aa_bb_flush (AA_OUT, s->sa_out.s, len);
+            aa_bb_flush (AA_OUT, os->sa_out.s, len);
 
-            memmove (s->sa_out.s, s->sa_out.s + len, s->sa_out.len - len);
-            s->sa_out.len -= len;
+            memmove (os->sa_out.s, os->sa_out.s + len, os->sa_out.len - len);
+            os->sa_out.len -= len;
         }
 
         if (r < 256)
@@ -463,12 +689,13 @@ int
 handle_fd_progress (int si)
 {
     aa_service *s = aa_service (si);
+    aa_oneshot *os = aa_oneshot (s);
     struct progress *pg;
     char buf[256];
     size_t i;
     ssize_t r;
 
-    if (s->pi < 0)
+    if (os->pi < 0)
     {
         for (i = 0; i < genalloc_len (struct progress, &ga_progress); ++i)
         {
@@ -476,12 +703,12 @@ handle_fd_progress (int si)
             if (pg->si < 0)
             {
                 pg->si = si;
-                s->pi = i;
+                os->pi = i;
                 break;
             }
         }
 
-        if (s->pi < 0)
+        if (os->pi < 0)
         {
             struct progress _pg = {
                 .si = si,
@@ -489,17 +716,17 @@ handle_fd_progress (int si)
                 .aa_pg.sa = STRALLOC_ZERO
             };
             genalloc_append (struct progress, &ga_progress, &_pg);
-            s->pi = genalloc_len (struct progress, &ga_progress) - 1;
+            os->pi = genalloc_len (struct progress, &ga_progress) - 1;
         }
     }
-    pg = &genalloc_s (struct progress, &ga_progress)[s->pi];
+    pg = &genalloc_s (struct progress, &ga_progress)[os->pi];
 
-    r = fd_read (s->fd_progress, buf + 1, 255);
+    r = fd_read (os->fd_progress, buf + 1, 255);
     if (r < 0)
         return r;
     else if (r == 0)
     {
-        close_fd_for (s->fd_progress, si);
+        close_fd_for (os->fd_progress, si);
         return 0;
     }
 
@@ -536,6 +763,7 @@ handle_fd_progress (int si)
         /* store timeout and disable it for now */
         pg->secs_timeout = s->secs_timeout;
         s->secs_timeout = 0;
+        unset_timer (si);
         return 0;
     }
     else if (pg->is_drawn < 0)
@@ -571,10 +799,9 @@ handle_fd_progress (int si)
 int
 handle_fd_in (void)
 {
-    aa_service *s;
+    aa_oneshot *os;
     struct progress *pg;
     char buf[256];
-    iopause_fd iop;
     ssize_t r;
 
     r = fd_read (0, buf, 256);
@@ -583,8 +810,8 @@ handle_fd_in (void)
     else if (r == 0 || si_password < 0)
         goto done;
 
-    s = aa_service (si_password);
-    pg = &genalloc_s (struct progress, &ga_progress)[s->pi];
+    os = aa_oneshot (aa_service (si_password));
+    pg = &genalloc_s (struct progress, &ga_progress)[os->pi];
     if (pg->si != si_password)
     {
         r = -1;
@@ -594,9 +821,7 @@ handle_fd_in (void)
     if (!stralloc_catb (&pg->aa_pg.sa, buf, r))
         return -1;
 
-    iop.fd = s->fd_in;
-    iop.events = IOPAUSE_WRITE;
-    genalloc_append (iopause_fd, &ga_iop, &iop);
+    add_fd_to_iop (os->fd_in, si_password, EPOLLOUT);
     pg->is_drawn = DRAWN_PASSWORD_WRITING;
     r = 0;
 
@@ -606,20 +831,16 @@ done:
 }
 
 int
-handle_fd (int fd)
+handle_fd (int fd, int si)
 {
-    int si;
-    size_t i;
-
     if (fd == 0 && si_password >= 0)
         return handle_fd_in ();
 
-    for (i = 0; i < genalloc_len (int, &aa_tmp_list); ++i)
+    if (si >= 0 && aa_service (si)->oi >= 0)
     {
-        si = list_get (&aa_tmp_list, i);
-        if (aa_service (si)->fd_out == fd)
+        if (aa_oneshot (aa_service (si))->fd_out == fd)
             return handle_fd_out (si);
-        else if (aa_service (si)->fd_progress == fd)
+        else if (aa_oneshot (aa_service (si))->fd_progress == fd)
             return handle_fd_progress (si);
     }
 
@@ -631,7 +852,8 @@ static void
 end_si_password (void)
 {
     aa_service *s = aa_service (si_password);
-    struct progress *pg = &genalloc_s (struct progress, &ga_progress)[s->pi];
+    aa_oneshot *os = aa_oneshot (s);
+    struct progress *pg = &genalloc_s (struct progress, &ga_progress)[os->pi];
     int r;
 
     clear_draw ();
@@ -641,17 +863,18 @@ end_si_password (void)
     aa_bs_noflush (AA_OUT, pg->aa_pg.sa.s);
     aa_bs_flush (AA_OUT, "\n");
 
-    remove_fd_from_iop (s->fd_in);
+    remove_fd_from_iop (os->fd_in);
     pg->si = -1;
     pg->is_drawn = 0;
     pg->aa_pg.sa.len = 0;
-    s->pi = -1;
-    si_password = -1;
+    os->pi = -1;
     /* restore timeout */
     s->secs_timeout = pg->secs_timeout;
     pg->secs_timeout = 0;
     /* reset ts */
     tain_copynow (&s->ts_exec);
+    schedule_timeout (si_password);
+    si_password = -1;
 
     r = term_set_echo (1);
     if (r < 0)
@@ -670,11 +893,11 @@ handle_fdw (int fd)
     size_t len;
     ssize_t r;
 
-    if (si_password < 0 || aa_service (si_password)->fd_in != fd)
+    if (si_password < 0 || aa_oneshot (aa_service (si_password))->fd_in != fd)
         return (errno = ENOENT, -1);
 
     s = aa_service (si_password);
-    pg = &genalloc_s (struct progress, &ga_progress)[s->pi];
+    pg = &genalloc_s (struct progress, &ga_progress)[aa_oneshot (s)->pi];
 
     offset = byte_chr (pg->aa_pg.sa.s, pg->aa_pg.sa.len, '\0') + 1;
     len = pg->aa_pg.sa.len - offset;
@@ -696,36 +919,263 @@ handle_fdw (int fd)
     return 0;
 }
 
+#ifndef P_PIDFD
+#define P_PIDFD     3
+#endif
+
 static int
-handle_oneshot (int is_start)
+open_pidfd (pid_t pid)
 {
-    int si;
-    int r;
+#ifdef SYS_pidfd_open
+    return syscall (SYS_pidfd_open, pid, 0);
+#else
+    (void) pid;
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+/* removes the oneshot from aa_tmp_list and closes all its fds; whatever output
+ * it had left in the pipe is read first, so nothing gets lost */
+static void
+remove_oneshot (int si)
+{
+    aa_service *s = aa_service (si);
+    aa_oneshot *os = aa_oneshot (s);
+
+    remove_from_set (&aa_tmp_list, si);
+    unset_timer (si);
+    if (os->fd_pid > 0)
+        close_fd_for (os->fd_pid, si);
+    else
+        --nb_nopidfd;
+    os->fd_pid = -1;
+
+    if (si == si_password)
+        end_si_password ();
+    if (os->fd_in > 0)
+        close_fd_for (os->fd_in, si);
+    if (os->fd_out > 0 && handle_fd_out (si) < 0)
+        aa_strerr_warnu2sys ("read output of ", aa_service_name (s));
+    if (os->fd_out > 0)
+        close_fd_for (os->fd_out, si);
+    if (os->fd_progress > 0)
+        close_fd_for (os->fd_progress, si);
+    aa_oneshot_release (si);
+}
+
+static void
+free_pool (struct pool *pool)
+{
+    genalloc_free (int, &pool->waiting);
+}
+
+/* returns the pool of the service, or NULL if it isn't in one. The pool's limit
+ * is the lowest one set among its services */
+static struct pool *
+get_pool (int si)
+{
+    aa_service *s = aa_service (si);
+    const char *name = aa_service_pool (s);
+    struct pool *pools = genalloc_s (struct pool, &ga_pools);
+    size_t l = genalloc_len (struct pool, &ga_pools);
+    size_t i;
+
+    if (!name)
+        return NULL;
+
+    for (i = 0; i < l; ++i)
+        if (str_equal (name, pools[i].name))
+        {
+            if (s->pool_limit < pools[i].limit)
+                pools[i].limit = s->pool_limit;
+            return &pools[i];
+        }
+
+    {
+        struct pool pool = {
+            .name = name,
+            .limit = s->pool_limit,
+            .running = 0,
+            .waiting = GENALLOC_ZERO,
+            .head = 0
+        };
+
+        if (!genalloc_append (struct pool, &ga_pools, &pool))
+            /* not much we can do, so it won't be limited */
+            return NULL;
+    }
+    return &genalloc_s (struct pool, &ga_pools)[l];
+}
+
+/* returns a service waiting in a pool that now has room, or -1 */
+static int
+pop_waiting (void)
+{
+    struct pool *pools = genalloc_s (struct pool, &ga_pools);
+    size_t l = genalloc_len (struct pool, &ga_pools);
+    size_t i;
+
+    for (i = 0; i < l; ++i)
+    {
+        struct pool *pool = &pools[i];
+        int si;
+
+        if (pool->running >= pool->limit || pool->head >= genalloc_len (int, &pool->waiting))
+            continue;
+
+        si = list_get (&pool->waiting, pool->head++);
+        if (pool->head == genalloc_len (int, &pool->waiting))
+        {
+            pool->head = 0;
+            genalloc_setlen (int, &pool->waiting, 0);
+        }
+        return si;
+    }
+
+    return -1;
+}
+
+static struct tl *
+get_tl (int si)
+{
+    struct tl zero = { .after = -1 };
+
+    while (genalloc_len (struct tl, &ga_tl) <= (size_t) si)
+        if (!genalloc_append (struct tl, &ga_tl, &zero))
+            return NULL;
+    return &genalloc_s (struct tl, &ga_tl)[si];
+}
+
+static void
+tl_exec (int si)
+{
+    aa_edges *after = &aa_service (si)->after;
+    struct tl *tl = get_tl (si);
+    size_t i;
+
+    if (!tl)
+        return;
+    tl->state = 1;
+    for (i = 0; i < edges_len (after); ++i)
+    {
+        int sa = edges_get (after, i);
+        struct tl *tla;
+
+        if ((size_t) sa >= genalloc_len (struct tl, &ga_tl))
+            continue;
+        tla = &genalloc_s (struct tl, &ga_tl)[sa];
+        if (tla->state == 2 && (tl->after < 0
+                    || tain_less (&genalloc_s (struct tl, &ga_tl)[tl->after].end, &tla->end)))
+            tl->after = sa;
+    }
+}
+
+static void
+tl_end (int si, aa_evt event, int code)
+{
+    struct tl *tl = get_tl (si);
+
+    if (!tl)
+        return;
+    tl->state = 2;
+    tl->end = STAMP;
+    tl->event = event;
+    tl->code = code;
+}
+
+static void
+add_timeline (void)
+{
+    size_t i;
+
+    for (i = 0; i < genalloc_len (struct tl, &ga_tl); ++i)
+    {
+        struct tl *tl = &genalloc_s (struct tl, &ga_tl)[i];
+        aa_service *s = aa_service (i);
+
+        if (tl->state == 0)
+            continue;
+        if (aa_timeline_add (aa_service_name (s),
+                    (tl->after >= 0) ? aa_service_name (aa_service (tl->after)) : NULL,
+                    &s->ts_exec, &tl->ready, &tl->end, tl->event, tl->code) < 0)
+        {
+            aa_strerr_warnu1sys ("record timeline");
+            break;
+        }
+    }
+}
+
+/* a service exec-ed is done: free its spot in its pool */
+static void
+service_done (int si)
+{
+    struct pool *pool = get_pool (si);
+
+    if (pool && pool->running > 0)
+        --pool->running;
+    aa_service_done (si);
+}
+
+/* remember how long it took, to order things & estimate on next start */
+static void
+save_duration (int si)
+{
+    tain ts;
+    int ms;
+
+    if (!tain_sub (&ts, &STAMP, &aa_service (si)->ts_exec))
+        return;
+    ms = tain_to_millisecs (&ts);
+    if (ms >= 0 && aa_durations_add (aa_service_name (aa_service (si)), (unsigned int) ms) < 0)
+        aa_strerr_warnu2sys ("remember duration of ", aa_service_name (aa_service (si)));
+}
+
+/* reaps os if it has exited, via its pidfd if any. Returns its pid (wstat then
+ * set as from waitpid()), 0 if still running, or -1 on error */
+static pid_t
+reap (aa_oneshot *os, int *wstat)
+{
+    if (os->fd_pid > 0)
+    {
+        siginfo_t info;
+
+        info.si_pid = 0;
+        if (waitid ((idtype_t) P_PIDFD, (id_t) os->fd_pid, &info, WEXITED | WNOHANG) == 0)
+        {
+            if (info.si_pid == 0)
+                return 0;
+            if (info.si_code == CLD_EXITED)
+                *wstat = (info.si_status & 0xff) << 8;
+            else
+                *wstat = info.si_status | ((info.si_code == CLD_DUMPED) ? 0x80 : 0);
+            return info.si_pid;
+        }
+        /* pidfd_open() (5.3) predates P_PIDFD (5.4) */
+        if (errno != EINVAL)
+            return -1;
+    }
+    return waitpid (os->pid, wstat, WNOHANG);
+}
+
+/* reaps oneshot si if it has exited, i.e. its pidfd was readable or, w/out
+ * one, on SIGCHLD */
+static int
+handle_oneshot (int si, int is_start)
+{
+    pid_t r;
     int wstat;
 
-    r = wait_pids_nohang ((pid_t const *) ga_pid.s, genalloc_len (pid_t, &ga_pid), &wstat);
+    r = reap (aa_oneshot (aa_service (si)), &wstat);
     if (r < 0)
     {
-        if (errno != ECHILD)
-            aa_strerr_warnu1sys ("wait_pids_nohang");
-        return r;
+        aa_strerr_warnu2sys ("wait for ", aa_service_name (aa_service (si)));
+        return -1;
     }
     else if (r == 0)
-        return r;
+        return 0;
 
-    /* get the si; same index in tmp_list except we start at 0 */
-    si = list_get (&aa_tmp_list, r - 1);
-
-    remove_from_list (&aa_tmp_list, si);
-    ga_remove (&ga_pid, sizeof (pid_t), r - 1);
-    if (si == si_password)
-        end_si_password ();
-    if (aa_service (si)->fd_in > 0)
-        close_fd_for (aa_service (si)->fd_in, si);
-    if (aa_service (si)->fd_out > 0)
-        close_fd_for (aa_service (si)->fd_out, si);
-    if (aa_service (si)->fd_progress > 0)
-        close_fd_for (aa_service (si)->fd_progress, si);
+    remove_oneshot (si);
 
     if (WIFEXITED (wstat) && WEXITSTATUS (wstat) == 0)
     {
@@ -736,6 +1186,9 @@ handle_oneshot (int is_start)
         if (aa_service_status_write (svst, aa_service_name (aa_service (si))) < 0)
             aa_strerr_warnu2sys ("write service status file for ", aa_service_name (aa_service (si)));
 
+        if (is_start)
+            save_duration (si);
+
         put_title (1, aa_service_name (aa_service (si)),
                 (is_start) ? "Started" : "Stopped", 1);
         ++nb_done;
@@ -793,30 +1246,23 @@ handle_oneshot (int is_start)
             check_essential (si);
     }
 
-    remove_from_list (&aa_main_list, si);
+    tl_end (si, aa_service (si)->st.event, aa_service (si)->st.code);
+    service_done (si);
     return 1;
 }
 
-int
-handle_longrun (aa_mode mode, uint16_t id, char event)
+/* stops waiting on longrun si */
+static void
+unsubscribe (int si)
 {
-    int si;
-    size_t l = genalloc_len (int, &aa_main_list);
-    size_t i;
-
-    for (i = 0; i < l; ++i)
-        if (aa_service (list_get (&aa_main_list, i))->ft_id == id)
-            break;
-
-    if (i >= l)
-    {
-        char buf[UINT16_FMT];
-        buf[uint16_fmt (buf, id)] = '\0';
-        aa_strerr_warnu2x ("find longrun service for id#", buf);
-        return -1;
-    }
+    if (aa_service (si)->fd_event >= 0)
+        remove_fd_from_iop (aa_service (si)->fd_event);
+    aa_unsubscribe_for (si);
+}
 
-    si = list_get (&aa_main_list, i);
+int
+handle_longrun (aa_mode mode, int si, char event)
+{
     if ((mode & AA_MODE_START) && aa_service (si)->gets_ready)
     {
         if (event == 'u' || event == 'd')
@@ -827,13 +1273,26 @@ handle_longrun (aa_mode mode, uint16_t id, char event)
             aa_bs_flush (AA_OUT, (event == 'u')
                     ? "Started; Getting ready...\n"
                     : "Down; Will restart...\n");
+            if (event == 'u')
+            {
+                struct tl *tl = get_tl (si);
+
+                tain_now_g ();
+                if (tl)
+                    tl->ready = STAMP;
+            }
             return 0;
         }
         /* event == 'U' */
-        aa_unsubscribe_for (id);
     }
 
-    aa_service (si)->ft_id = 0;
+    unsubscribe (si);
+    unset_timer (si);
+    if (mode & AA_MODE_START)
+    {
+        tain_now_g ();
+        save_duration (si);
+    }
     put_title (1, aa_service_name (aa_service (si)),
             (mode & AA_MODE_START) ?
             ((aa_service (si)->gets_ready) ? "Ready" : "Started")
@@ -841,7 +1300,8 @@ handle_longrun (aa_mode mode, uint16_t id, char event)
     ++nb_done;
     --nb_wait_longrun;
 
-    remove_from_list (&aa_main_list, si);
+    tl_end (si, (mode & AA_MODE_START) ? AA_EVT_STARTED : AA_EVT_STOPPED, 0);
+    service_done (si);
     return 1;
 }
 
@@ -889,23 +1349,34 @@ handle_signals (aa_mode mode)
 
             case SIGCHLD:
                 {
-                    for (;;)
+                    size_t i;
+
+                    /* only those w/out a pidfd; going backwards since a
+                     * removal moves the last one in its place */
+                    for (i = set_len (&aa_tmp_list); nb_nopidfd > 0 && i-- > 0; )
                     {
-                        int rr = handle_oneshot (mode & AA_MODE_START);
+                        int si = set_get (&aa_tmp_list, i);
+                        int rr;
+
+                        if (aa_oneshot (aa_service (si))->fd_pid > 0)
+                            continue;
+                        rr = handle_oneshot (si, mode & AA_MODE_START);
                         if (rr > 0)
                             r += rr;
-                        else
-                            break;
                     }
                     break;
                 }
 
             case SIGINT:
-                if (si_active > -1)
+                if (si_active > -1 && (aa_service (si_active)->fd_event >= 0
+                            || is_in_set (&aa_tmp_list, si_active)))
+                {
                     /* set the timeout for the "active" service (i.e. the one
                      * whose name was shown as DRAW_CUR_WAITING) which will in
                      * effect cause it to be timed out instantly */
                     aa_service (si_active)->secs_timeout = 1;
+                    schedule_timeout (si_active);
+                }
                 break;
 
             case SIGTERM:
@@ -926,7 +1397,7 @@ handle_signals (aa_mode mode)
 void
 prepare_cb (int cur, int next, int is_needs, size_t first)
 {
-    size_t l = genalloc_len (int, &aa_tmp_list);
+    size_t l = set_len (&aa_tmp_list);
     size_t i;
 
     if (is_needs)
@@ -938,7 +1409,7 @@ prepare_cb (int cur, int next, int is_needs, size_t first)
         add_err (" to break dependency loop: ");
         for (i = first; i < l; ++i)
         {
-            add_err (aa_service_name (aa_service (list_get (&aa_tmp_list, i))));
+            add_err (aa_service_name (aa_service (set_get (&aa_tmp_list, i))));
             if (i < l - 1)
                 add_err (" -> ");
         }
@@ -953,7 +1424,7 @@ prepare_cb (int cur, int next, int is_needs, size_t first)
         add_warn (" to break loop: ");
         for (i = first; i < l; ++i)
         {
-            add_warn (aa_service_name (aa_service (list_get (&aa_tmp_list, i))));
+            add_warn (aa_service_name (aa_service (set_get (&aa_tmp_list, i))));
             if (i < l - 1)
                 add_warn (" -> ");
         }
@@ -994,19 +1465,31 @@ exec_cb (int si, aa_evt evt, pid_t pid)
         case AA_EVT_STOPPING:
             if (s->st.type == AA_TYPE_ONESHOT)
             {
-                iopause_fd iop;
+                aa_oneshot *os = aa_oneshot (s);
 
-                iop.fd = s->fd_out;
-                iop.events = IOPAUSE_READ;
-                genalloc_append (iopause_fd, &ga_iop, &iop);
-                iop.fd = s->fd_progress;
-                genalloc_append (iopause_fd, &ga_iop, &iop);
+                add_fd_to_iop (os->fd_out, si, EPOLLIN);
+                add_fd_to_iop (os->fd_progress, si, EPOLLIN);
 
-                add_to_list (&aa_tmp_list, si, 0);
-                genalloc_append (pid_t, &ga_pid, &pid);
+                add_to_set (&aa_tmp_list, si);
+                os->pid = pid;
+                os->fd_pid = open_pidfd (pid);
+                if (os->fd_pid > 0)
+                    add_fd_to_iop (os->fd_pid, si, EPOLLIN);
+                else
+                {
+                    if (errno != ENOSYS)
+                        aa_strerr_warnu2sys ("open pidfd for ", aa_service_name (s));
+                    os->fd_pid = -1;
+                    ++nb_nopidfd;
+                }
             }
             else
+            {
+                add_fd_to_iop (s->fd_event, si, EPOLLIN);
                 ++nb_wait_longrun;
+            }
+            schedule_timeout (si);
+            tl_exec (si);
             break;
 
         case AA_EVT_STARTED:
@@ -1014,6 +1497,7 @@ exec_cb (int si, aa_evt evt, pid_t pid)
             put_title (1, aa_service_name (s),
                     (evt == AA_EVT_STARTED) ? "Started" : "Stopped", 1);
             ++nb_done;
+            tl_end (si, evt, 0);
             break;
 
         case AA_EVT_STARTING_FAILED:
@@ -1031,6 +1515,7 @@ exec_cb (int si, aa_evt evt, pid_t pid)
                 }
                 genalloc_append (int, &ga_failed, &si);
                 check_essential (si);
+                tl_end (si, evt, s->st.code);
                 break;
             }
 
@@ -1046,144 +1531,260 @@ exec_cb (int si, aa_evt evt, pid_t pid)
     }
 }
 
-int
-process_timeouts (aa_mode mode, aa_scan_cb scan_cb)
+/* returns a oneshot held back by the jobs limit, or -1 */
+static int
+pop_jobs_waiting (void)
+{
+    int si;
+
+    if (jobs_head >= genalloc_len (int, &ga_jobs_waiting))
+        return -1;
+
+    si = list_get (&ga_jobs_waiting, jobs_head++);
+    if (jobs_head == genalloc_len (int, &ga_jobs_waiting))
+    {
+        jobs_head = 0;
+        genalloc_setlen (int, &ga_jobs_waiting, 0);
+    }
+    return si;
+}
+
+static void
+exec_ready (aa_mode mode, aa_scan_cb scan_cb)
 {
     int si;
-    size_t l;
+
+    for (;;)
+    {
+        struct pool *pool;
+        /* running oneshots are in aa_tmp_list */
+        int has_room = cur_jobs <= 0 || set_len (&aa_tmp_list) < (size_t) cur_jobs;
+
+        si = (has_room) ? pop_jobs_waiting () : -1;
+        if (si < 0)
+            si = pop_waiting ();
+        if (si < 0)
+        {
+            si = aa_pop_ready_service (scan_cb, mode);
+            if (si < 0)
+                break;
+        }
+
+        /* only oneshots count toward the limit, longruns still go */
+        if (!has_room && aa_service (si)->st.type == AA_TYPE_ONESHOT)
+        {
+            genalloc_append (int, &ga_jobs_waiting, &si);
+            continue;
+        }
+
+        /* nothing is running in DRY mode */
+        pool = (mode & AA_MODE_IS_DRY) ? NULL : get_pool (si);
+        if (pool)
+        {
+            if (pool->running >= pool->limit)
+            {
+                genalloc_append (int, &pool->waiting, &si);
+                continue;
+            }
+            ++pool->running;
+        }
+
+        if (aa_exec_service (si, mode) < 0 && pool)
+            --pool->running;
+    }
+}
+
+/* gets the total stall time (in usecs) of the "some" line of each pressure
+ * file */
+static int
+read_psi (uint64_t total[NB_PSI_FILES])
+{
     size_t i;
-    tain ts_timeout;
+
+    for (i = 0; i < NB_PSI_FILES; ++i)
+    {
+        char buf[256];
+        const char *t;
+        ssize_t r;
+
+        r = openreadnclose (psi_files[i], buf, sizeof (buf) - 1);
+        if (r < 0)
+            return -1;
+        buf[r] = '\0';
+        buf[byte_chr (buf, r, '\n')] = '\0';
+        t = strstr (buf, "total=");
+        if (!t || !uint64_scan (t + strlen ("total="), &total[i]))
+            return (errno = EINVAL, -1);
+    }
+
+    return 0;
+}
+
+static void
+init_jobs (void)
+{
+    long nb_cpus;
+
+    cur_jobs = ceil_jobs = (int) max_jobs;
+    if (!adaptive_jobs)
+        return;
+
+    if (read_psi (psi_total) < 0)
+    {
+        aa_strerr_warnu1sys ("read pressure stall information; disabling adaptive jobs");
+        adaptive_jobs = 0;
+        return;
+    }
+    tain_copynow (&psi_stamp);
+
+    nb_cpus = sysconf (_SC_NPROCESSORS_ONLN);
+    if (nb_cpus < 1)
+        nb_cpus = 1;
+    if (ceil_jobs <= 0)
+        ceil_jobs = 4 * nb_cpus;
+    cur_jobs = (nb_cpus < ceil_jobs) ? nb_cpus : ceil_jobs;
+}
+
+/* in adaptive mode, narrows (halves) the limit of running oneshots when the
+ * system is under pressure (cpu, io or memory), else widens it (by one) up to
+ * the max. Returns ms until next check, or -1 */
+static int
+adjust_jobs (aa_mode mode, aa_scan_cb scan_cb)
+{
+    uint64_t total[NB_PSI_FILES];
+    uint64_t stall = 0;
     tain ts;
-    tain tms;
-    int ms = -1;
+    int ms;
+    size_t i;
+
+    if (!adaptive_jobs)
+        return -1;
+
+    tain_sub (&ts, &STAMP, &psi_stamp);
+    ms = tain_to_millisecs (&ts);
+    if (ms >= 0 && ms < PSI_INTERVAL_MS)
+        return PSI_INTERVAL_MS - ms;
+
+    if (read_psi (total) < 0)
+    {
+        aa_strerr_warnu1sys ("read pressure stall information; disabling adaptive jobs");
+        adaptive_jobs = 0;
+        cur_jobs = (int) max_jobs;
+        exec_ready (mode, scan_cb);
+        return -1;
+    }
+
+    /* highest percentage of time (some) tasks were stalled */
+    for (i = 0; i < NB_PSI_FILES; ++i)
+    {
+        uint64_t pct = (ms > 0) ? (total[i] - psi_total[i]) / (10 * (uint64_t) ms) : 0;
+
+        if (pct > stall)
+            stall = pct;
+        psi_total[i] = total[i];
+    }
+    tain_copynow (&psi_stamp);
+
+    if (stall >= PSI_HIGH_PCT)
+        cur_jobs = (cur_jobs > 1) ? cur_jobs / 2 : 1;
+    else if (stall < PSI_LOW_PCT && cur_jobs < ceil_jobs)
+    {
+        ++cur_jobs;
+        exec_ready (mode, scan_cb);
+    }
+
+    return PSI_INTERVAL_MS;
+}
+
+int
+process_timeouts (aa_mode mode, aa_scan_cb scan_cb)
+{
     int scan = 0;
+    int ms = -1;
 
-    l = genalloc_len (int, &aa_tmp_list);
-    for (i = 0; i < l; ++i)
+    /* only expired ones, from the top of the heap */
+    while (nb_timers () > 0 && tain_less (&timer (0)->deadline, &STAMP))
     {
-        si = list_get (&aa_tmp_list, i);
-        /* no limit? */
-        if (aa_service (si)->secs_timeout == 0)
+        struct timer *t = timer (0);
+        int si = t->si;
+        tain ts;
+
+        /* not a timeout, only taking much longer than usual */
+        if (aa_service (si)->overrun == 1)
+        {
+            char buf[UINT_FMT];
+
+            aa_service (si)->overrun = 2;
+            buf[uint_fmt (buf, aa_durations_percentile (aa_service_name (aa_service (si)), 99))] = '\0';
+            put_warn (aa_service_name (aa_service (si)), "Taking far longer than usual (", 0);
+            add_warn ("p99: ");
+            add_warn (buf);
+            add_warn ("ms)");
+            end_warn ();
+            schedule_timeout (si);
             continue;
+        }
 
-        tain_from_millisecs (&ts_timeout, 1000 * aa_service (si)->secs_timeout);
-        tain_add (&ts, &aa_service (si)->ts_exec, &ts_timeout);
-        /* timeout expired? */
-        if (tain_less (&ts, &STAMP))
+        if (aa_service (si)->st.type == AA_TYPE_ONESHOT)
         {
-            /* not yet signaled? */
+            aa_service_status *svst = &aa_service (si)->st;
+
+            /* not yet signaled? SIGKILL in 2 more seconds */
             if (!aa_service (si)->timedout)
             {
-                kill (genalloc_s (pid_t, &ga_pid)[i], SIGTERM);
+                kill (aa_oneshot (aa_service (si))->pid, SIGTERM);
                 aa_service (si)->timedout = 1;
-            }
 
-            tain_addsec (&tms, &ts, 2);
-            if (!tain_less (&tms, &STAMP))
-            {
-                aa_service_status *svst = &aa_service (si)->st;
-
-                kill (genalloc_s (pid_t, &ga_pid)[i], SIGKILL);
-
-                remove_from_list (&aa_tmp_list, si);
-                ga_remove (&ga_pid, sizeof (pid_t), i);
-                if (si == si_password)
-                    end_si_password ();
-                if (aa_service (si)->fd_in > 0)
-                    close_fd_for (aa_service (si)->fd_in, si);
-                if (aa_service (si)->fd_out > 0)
-                    close_fd_for (aa_service (si)->fd_out, si);
-                if (aa_service (si)->fd_progress > 0)
-                    close_fd_for (aa_service (si)->fd_progress, si);
-
-                svst->event = (mode & AA_MODE_START) ? AA_EVT_STARTING_FAILED: AA_EVT_STOPPING_FAILED;
-                svst->code = ERR_TIMEDOUT;
-                tain_copynow (&svst->stamp);
-                aa_service_status_set_msg (svst, "");
-                if (aa_service_status_write (svst, aa_service_name (aa_service (si))) < 0)
-                    aa_strerr_warnu2sys ("write service status file for ", aa_service_name (aa_service (si)));
-
-                put_err_service (aa_service_name (aa_service (si)), ERR_TIMEDOUT, 1);
-                genalloc_append (int, &ga_timedout, &si);
-                if (mode & AA_MODE_START)
-                    check_essential (si);
-
-                remove_from_list (&aa_main_list, si);
-                scan = 1;
+                tain_addsec (&ts, &t->deadline, 2);
+                set_timer (si, &ts);
+                continue;
             }
-            else
-            {
-                int _ms;
 
-                ts = tms;
-                tain_sub (&tms, &ts, &STAMP);
-                _ms = tain_to_millisecs (&tms);
-                if (_ms > 0 && (ms < 0 || _ms < ms))
-                    ms = _ms;
-            }
+            kill (aa_oneshot (aa_service (si))->pid, SIGKILL);
+            remove_oneshot (si);
+
+            svst->event = (mode & AA_MODE_START) ? AA_EVT_STARTING_FAILED: AA_EVT_STOPPING_FAILED;
+            svst->code = ERR_TIMEDOUT;
+            tain_copynow (&svst->stamp);
+            aa_service_status_set_msg (svst, "");
+            if (aa_service_status_write (svst, aa_service_name (aa_service (si))) < 0)
+                aa_strerr_warnu2sys ("write service status file for ", aa_service_name (aa_service (si)));
+            tl_end (si, svst->event, svst->code);
         }
         else
         {
-            int _ms;
-
-            tain_sub (&tms, &ts, &STAMP);
-            _ms = tain_to_millisecs (&tms);
-            if (ms < 0 || _ms < ms)
-                ms = _ms;
+            /* flag it to avoid race: by the time it'll be processed for
+             * dependencies, s6 state could have changed, especially if
+             * this is a readiness timeout, and change doesn't imply
+             * success (service could have gone down), hence the flag */
+            aa_service (si)->timedout = 1;
+            unsubscribe (si);
+            --nb_wait_longrun;
+            unset_timer (si);
+            tl_end (si, (mode & AA_MODE_START) ? AA_EVT_STARTING_FAILED : AA_EVT_STOPPING_FAILED,
+                    ERR_TIMEDOUT);
         }
-    }
-
-    if (nb_wait_longrun > 0)
-    {
-        int j = 0;
 
-        l = genalloc_len (int, &aa_main_list);
-
-        for (i = 0; i < l && j < nb_wait_longrun; ++i)
-            if (aa_service (list_get (&aa_main_list, i))->ft_id > 0)
-            {
-                ++j;
-                si = list_get (&aa_main_list, i);
-                /* no limit? */
-                if (aa_service (si)->secs_timeout == 0)
-                    continue;
-
-                tain_from_millisecs (&ts_timeout, 1000 * aa_service (si)->secs_timeout);
-                tain_add (&ts, &aa_service (si)->ts_exec, &ts_timeout);
-                /* timeout expired? */
-                if (tain_less (&ts, &STAMP))
-                {
-                    /* flag it to avoid race: by the time it'll be processed for
-                     * dependencies, s6 state could have changed, especially if
-                     * this is a readiness timeout, and change doesn't imply
-                     * success (service could have gone down), hence the flag */
-                    aa_service (si)->timedout = 1;
-                    aa_unsubscribe_for (aa_service (si)->ft_id);
-                    aa_service (si)->ft_id = 0;
-                    --nb_wait_longrun;
-
-                    put_err_service (aa_service_name (aa_service (si)), ERR_TIMEDOUT, 1);
-                    genalloc_append (int, &ga_timedout, &si);
-                    if (mode & AA_MODE_START)
-                        check_essential (si);
-
-                    remove_from_list (&aa_main_list, si);
-                    scan = 1;
-                }
-                else
-                {
-                    int _ms;
+        put_err_service (aa_service_name (aa_service (si)), ERR_TIMEDOUT, 1);
+        genalloc_append (int, &ga_timedout, &si);
+        if (mode & AA_MODE_START)
+            check_essential (si);
 
-                    tain_sub (&tms, &ts, &STAMP);
-                    _ms = tain_to_millisecs (&tms);
-                    if (ms < 0 || _ms < ms)
-                        ms = _ms;
-                }
-            }
+        service_done (si);
+        scan = 1;
     }
 
     if (scan)
-        aa_scan_mainlist (scan_cb, mode);
+        exec_ready (mode, scan_cb);
+
+    /* how long until the next one (after exec_ready() might have added some) */
+    if (nb_timers () > 0)
+    {
+        tain ts;
+
+        tain_sub (&ts, &timer (0)->deadline, &STAMP);
+        ms = tain_to_millisecs (&ts);
+    }
 
     return ms;
 }
@@ -1192,27 +1793,19 @@ void
 mainloop (aa_mode mode, aa_scan_cb scan_cb)
 {
     sigset_t set;
-    iopause_fd iop;
-    size_t i;
+    int fd_sp;
 
-    if (!genalloc_ready_tuned (iopause_fd, &ga_iop, 2, 0, 0, 1))
-        aa_strerr_diefu1sys (ERR_IO, "allocate iopause_fd");
+    fd_iop = epoll_create1 (EPOLL_CLOEXEC);
+    if (fd_iop < 0)
+        aa_strerr_diefu1sys (ERR_IO, "create epoll");
 
-    iop.fd = selfpipe_init ();
-    if (iop.fd == -1)
+    fd_sp = selfpipe_init ();
+    if (fd_sp == -1)
         aa_strerr_diefu1sys (ERR_IO, "init selfpipe");
-    iop.events = IOPAUSE_READ;
-    genalloc_append (iopause_fd, &ga_iop, &iop);
-
-    /* ignore SIGINT so it will be blocked for s6-trigr, else a ^C would have
-     * SIGINT resulting in "Broken pipe" errors */
-    sig_ignore (SIGINT);
-    iop.fd = aa_prepare_mainlist (prepare_cb, exec_cb);
-    if (iop.fd < 0)
+    add_fd_to_iop (fd_sp, -1, EPOLLIN);
+
+    if (aa_prepare_mainlist (prepare_cb, exec_cb) < 0)
         aa_strerr_diefu1sys (ERR_IO, "prepare mainlist");
-    else if (iop.fd == 0)
-        iop.fd = -1;
-    genalloc_append (iopause_fd, &ga_iop, &iop);
 
     sigemptyset (&set);
     sigaddset (&set, SIGCHLD);
@@ -1222,124 +1815,126 @@ mainloop (aa_mode mode, aa_scan_cb scan_cb)
     sigaddset (&set, SIGWINCH);
     if (selfpipe_trapset (&set) < 0)
         aa_strerr_diefu1sys (ERR_IO, "trap signals");
+    aa_sigs_trapped = set;
 
-    /* start what we can */
-    for (i = 0; i < genalloc_len (int, &aa_main_list); ++i)
-        if (genalloc_len (int, &aa_service (list_get (&aa_main_list, i))->after) == 0)
-            if (aa_exec_service (list_get (&aa_main_list, i), mode) < 0)
-            {
-                aa_scan_mainlist (scan_cb, mode);
-                break;
-            }
-
-    while (ioloop && (genalloc_len (int, &aa_main_list) > 0))
+    /* no limit in DRY mode, there's nothing running */
+    if (!(mode & AA_MODE_IS_DRY))
     {
-        int nb_iop;
-        int r;
-        int ms1, ms2;
-        tain tms;
+        init_jobs ();
+        aa_timeline_begin ((mode & AA_MODE_START) ? 1 : 0);
+    }
 
-        if (mode & AA_MODE_IS_DRY)
-        {
-            /* in DRY mode, anything w/out after-s should have been "started"
-             * already, so we just remove them... */
-            for (i = 0; i < genalloc_len (int, &aa_main_list); )
-            {
-                int si;
+    /* start what we can; in DRY mode services are done as soon as "started"
+     * so this processes everything */
+    exec_ready (mode, scan_cb);
 
-                si = list_get (&aa_main_list, i);
-                if (genalloc_len (int, &aa_service (si)->after) == 0)
-                    remove_from_list (&aa_main_list, si);
-                else
-                    ++i;
-            }
-
-            /* and we can scan again, to keep processing until we're done */
-            aa_scan_mainlist (scan_cb, mode);
-            continue;
-        }
+    while (ioloop && (set_len (&aa_main_list) > 0))
+    {
+        struct epoll_event evs[IOP_MAX_EVENTS];
+        uint32_t ev_sp = 0;
+        int scan = 0;
+        int nb;
+        int i;
+        int r;
+        int ms1, ms2, ms3;
+        int ms;
 
         ms1 = process_timeouts (mode, scan_cb);
         ms2 = refresh_draw ();
-        tain_from_millisecs (&tms, (ms1 < 0 || ms2 < ms1) ? ms2 : ms1);
-        tain_add (&iol_deadline, &STAMP, &tms);
-
-        nb_iop = genalloc_len (iopause_fd, &ga_iop);
-        r = iopause_g (genalloc_s (iopause_fd, &ga_iop), nb_iop, &iol_deadline);
-        if (r < 0)
-            aa_strerr_diefu1sys (ERR_IO, "iopause");
-        else if (r == 0)
+        ms3 = adjust_jobs (mode, scan_cb);
+        ms = (ms1 < 0 || ms2 < ms1) ? ms2 : ms1;
+        if (ms3 >= 0 && ms3 < ms)
+            ms = ms3;
+
+        /* all statuses from this iteration at once */
+        if (aa_journal_commit () < 0)
+            aa_strerr_warnu1sys ("write " AA_JOURNAL_FILENAME);
+
+        nb = epoll_wait (fd_iop, evs, IOP_MAX_EVENTS, ms);
+        tain_now_g ();
+        if (nb < 0 && errno != EINTR)
+            aa_strerr_diefu1sys (ERR_IO, "epoll_wait");
+        else if (nb <= 0)
         {
-            if (ms1 < 0 || ms2 < ms1)
+            if (nb == 0 && (ms1 < 0 || ms2 < ms1) && ms == ms2)
                 draw |= DRAW_NEED_WAITING;
+            continue;
         }
-        else
-        {
-            iopause_fd *iofd;
-            int scan = 0;
 
-            for (--nb_iop; nb_iop > 1; --nb_iop)
+        /* fds of services first, so their output is in before they're done */
+        for (i = 0; i < nb; ++i)
+        {
+            int fd = iop_fd (evs[i].data.u64);
+            int si = iop_si (evs[i].data.u64);
+
+            if (is_pidfd (fd, si) || is_evfd (fd, si))
+                continue;
+            else if (fd == fd_sp && si < 0)
+                ev_sp = evs[i].events;
+            else if (evs[i].events & IOP_READ)
             {
-                iofd = &genalloc_s (iopause_fd, &ga_iop)[nb_iop];
-                if (iofd->revents & IOPAUSE_READ)
-                {
-                    r = handle_fd (iofd->fd);
-                    if (r < 0)
-                        aa_strerr_warnu1sys ("handle fd");
-                }
-                else if (iofd->revents & IOPAUSE_WRITE)
-                {
-                    r = handle_fdw (iofd->fd);
-                    if (r < 0)
-                        aa_strerr_warnu1sys ("handle fdw");
-                }
-                else if (iofd->revents & IOPAUSE_EXCEPT)
-                    close_fd_for (iofd->fd, -1);
+                r = handle_fd (fd, si);
+                if (r < 0)
+                    aa_strerr_warnu1sys ("handle fd");
+            }
+            else if (evs[i].events & IOP_WRITE)
+            {
+                r = handle_fdw (fd);
+                if (r < 0)
+                    aa_strerr_warnu1sys ("handle fdw");
             }
+            else if (evs[i].events & IOP_EXCEPT)
+                close_fd_for (fd, si);
+        }
 
-            iofd = &genalloc_s (iopause_fd, &ga_iop)[0];
-            if (iofd->revents & IOPAUSE_READ)
-                scan += handle_signals (mode);
-            else if (iofd->revents & IOPAUSE_EXCEPT)
-                aa_strerr_diefu1sys (ERR_IO, "iopause: selfpipe error");
+        /* then oneshots that exited, and events from longruns */
+        for (i = 0; i < nb; ++i)
+        {
+            int fd = iop_fd (evs[i].data.u64);
+            int si = iop_si (evs[i].data.u64);
 
-            iofd = &genalloc_s (iopause_fd, &ga_iop)[1];
-            if (iofd->fd <= 0)
-                goto scan;
-            if (iofd->revents & IOPAUSE_READ)
+            if (is_pidfd (fd, si))
             {
-                for (;;)
-                {
-                    uint16_t id;
-                    char event;
+                r = handle_oneshot (si, mode & AA_MODE_START);
+                if (r > 0)
+                    scan += r;
+            }
+            else if (is_evfd (fd, si))
+            {
+                char event;
 
-                    r = aa_get_longrun_info (&id, &event);
+                /* once done (r == 1) we've unsubscribed, so stop there */
+                while (aa_service (si)->fd_event >= 0
+                        && (r = aa_get_longrun_event (si, mode, &event)) != 0)
+                {
                     if (r < 0)
                     {
-                        aa_strerr_warnu3sys ("get (",
-                                (r == -1) ? "update" : "check",
-                                ") longrun information");
-                        if (r == -1)
-                            break;
-                        else
-                            continue;
-                    }
-                    else if (r == 0)
+                        aa_strerr_warnu2sys ("read events of ", aa_service_name (aa_service (si)));
                         break;
-
-                    r = handle_longrun (mode, id, event);
+                    }
+                    r = handle_longrun (mode, si, event);
                     if (r > 0)
                         scan += r;
                 }
             }
-            else if (iofd->revents & IOPAUSE_EXCEPT)
-                aa_strerr_diefu1sys (ERR_IO, "iopause: longrun pipe error");
-
-scan:
-            if (scan > 0)
-                aa_scan_mainlist (scan_cb, mode);
         }
+
+        if (ev_sp & EPOLLIN)
+            scan += handle_signals (mode);
+        else if (ev_sp & IOP_EXCEPT)
+            aa_strerr_diefu1sys (ERR_IO, "epoll: selfpipe error");
+
+        if (scan > 0)
+            exec_ready (mode, scan_cb);
     }
+    if (!(mode & AA_MODE_IS_DRY))
+        add_timeline ();
+    genalloc_free (struct tl, &ga_tl);
+    genalloc_deepfree (struct pool, &ga_pools, free_pool);
+    genalloc_free (int, &ga_jobs_waiting);
+    genalloc_free (struct timer, &ga_timers);
+    fd_close (fd_iop);
+    fd_iop = -1;
 }
 
 void
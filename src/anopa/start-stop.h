@@ -23,6 +23,7 @@
 #ifndef AA_START_STOP_H
 #define AA_START_STOP_H
 
+#include <stdint.h>
 #include <signal.h>
 #include <sys/types.h>
 #include <skalibs/genalloc.h>
@@ -34,15 +35,19 @@
 #define SECS_BEFORE_WAITING         7
 #define DEFAULT_TIMEOUT_SECS        300
 
+/* adaptive jobs: how often to check pressure stall information, and the
+ * percentages of stalled time to narrow/widen the limit of running oneshots */
+#define PSI_INTERVAL_MS             500
+#define PSI_HIGH_PCT                40
+#define PSI_LOW_PCT                 10
+
 #define ANSI_PREV_LINE              "\x1B[F"
 #define ANSI_CLEAR_AFTER            "\x1B[K"
 #define ANSI_CLEAR_BEFORE           "\x1B[1K"
 #define ANSI_START_LINE             "\x1B[1G"
 
-extern genalloc ga_iop;
+extern int fd_iop;
 extern genalloc ga_progress;
-extern genalloc ga_pid;
-extern tain iol_deadline;
 extern unsigned int draw;
 extern int nb_already;
 extern int nb_done;
@@ -54,6 +59,9 @@ extern int is_utf8;
 extern int ioloop;
 extern int si_password;
 extern int si_active;
+extern unsigned int max_jobs;
+extern int adaptive_jobs;
+extern void (*check_essential) (int si);
 
 enum
 {
@@ -92,14 +100,14 @@ void draw_waiting (int already_drawn);
 void draw_progress_for (int si);
 void clear_draw ();
 void add_name_to_ga (const char *name, genalloc *ga);
-void iol_deadline_addsec (int n);
+void add_fd_to_iop (int fd, int si, uint32_t events);
 void remove_fd_from_iop (int fd);
 void close_fd_for (int fd, int si);
 int handle_fd_out (int si);
 int handle_fd_progress (int si);
 int handle_fd_in (void);
-int handle_fd (int fd);
-int handle_longrun (aa_mode mode, uint16 id, char event);
+int handle_fd (int fd, int si);
+int handle_longrun (aa_mode mode, int si, char event);
 int is_locale_utf8 (void);
 int get_cols (int fd);
 int handle_signals (aa_mode mode);
@@ -25,6 +25,8 @@
 #include <skalibs/buffer.h>
 #include <skalibs/stralloc.h>
 #include <skalibs/skamisc.h>
+#include <skalibs/bytestr.h>
+#include <anopa/output.h>
 #include "util.h"
 
 int
@@ -70,3 +72,39 @@ unslash (char *s)
     if (s[l] == '/')
         s[l] = '\0';
 }
+
+/* machine-readable output: strings are escaped as needed, i.e. for JSON, or
+ * else so that (TSV) fields don't contain any tab or newline */
+void
+put_escaped (const char *s, int json)
+{
+    for ( ; *s; ++s)
+    {
+        const char *esc = NULL;
+        char buf[7];
+
+        if (*s == '\\')
+            esc = "\\\\";
+        else if (*s == '\t')
+            esc = "\\t";
+        else if (*s == '\n')
+            esc = "\\n";
+        else if (json && *s == '"')
+            esc = "\\\"";
+        else if (json && (unsigned char) *s < 0x20)
+        {
+            static const char hex[] = "0123456789abcdef";
+
+            byte_copy (buf, 4, "\\u00");
+            buf[4] = hex[(unsigned char) *s >> 4];
+            buf[5] = hex[*s & 0xf];
+            buf[6] = '\0';
+            esc = buf;
+        }
+
+        if (esc)
+            aa_bs_noflush (AA_OUT, esc);
+        else
+            aa_bb_noflush (AA_OUT, s, 1);
+    }
+}
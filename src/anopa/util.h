@@ -27,5 +27,6 @@ typedef void (*names_cb) (const char *name, void *data);
 
 int process_names_from_stdin (names_cb process_name, void *data);
 void unslash (char *s);
+void put_escaped (const char *s, int json);
 
 #endif /* AA_UTIL_H */
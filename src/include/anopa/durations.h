@@ -0,0 +1,40 @@
+/*
+ * anopa - Copyright (C) 2015-2017 Olivier Brunel
+ *
+ * durations.h
+ * Copyright (C) 2015-2017 Olivier Brunel <jjk@jjacky.com>
+ *
+ * This file is part of anopa.
+ *
+ * anopa is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * anopa is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * anopa. If not, see http://www.gnu.org/licenses/
+ */
+
+#ifndef AA_DURATIONS_H
+#define AA_DURATIONS_H
+
+#define AA_DURATIONS_FILENAME       ".durations"
+/* last durations kept per service, for percentiles */
+#define AA_DURATIONS_SAMPLES        16
+/* each new duration counts for 1/WEIGHT of the EWMA */
+#define AA_DURATIONS_EWMA_WEIGHT    4
+
+extern int          aa_durations_load       (void);
+extern int          aa_durations_write      (void);
+extern void         aa_durations_free       (void);
+extern unsigned int aa_durations_get        (const char *name);
+extern unsigned int aa_durations_nb         (const char *name);
+extern unsigned int aa_durations_percentile (const char *name, unsigned int pct);
+extern int          aa_durations_add        (const char *name, unsigned int msecs);
+
+#endif /* AA_DURATIONS_H */
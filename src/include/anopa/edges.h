@@ -0,0 +1,53 @@
+/*
+ * anopa - Copyright (C) 2015-2017 Olivier Brunel
+ *
+ * edges.h
+ * Copyright (C) 2015-2017 Olivier Brunel <jjk@jjacky.com>
+ *
+ * This file is part of anopa.
+ *
+ * anopa is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * anopa is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * anopa. If not, see http://www.gnu.org/licenses/
+ */
+
+#ifndef AA_EDGES_H
+#define AA_EDGES_H
+
+#include <stddef.h>
+#include <skalibs/genalloc.h>
+
+/* edge lists (needs, wants, after & dependents) of all services are ranges of
+ * one shared pool of ints (service indexes), so a whole transaction needs only
+ * a few allocations, and releasing them is a single free. A list grows in place
+ * if it's the last one in the pool, else it gets moved at its end (w/ room to
+ * grow), its old range being left unused */
+extern genalloc aa_edge_pool; /* int */
+
+typedef struct
+{
+    size_t offset;
+    unsigned int len;
+    unsigned int cap;
+} aa_edges;
+
+#define AA_EDGES_ZERO               { 0, 0, 0 }
+
+#define edges_len(l)                ((l)->len)
+#define edges_get(l, i)             genalloc_s (int, &aa_edge_pool)[(l)->offset + (i)]
+#define is_in_edges(l, si)          (edges_find (l, si) >= 0)
+
+int  edges_find         (aa_edges *l, int si);
+int  add_to_edges       (aa_edges *l, int si, int chk_dupes);
+int  remove_from_edges  (aa_edges *l, int si);
+
+#endif /* AA_EDGES_H */
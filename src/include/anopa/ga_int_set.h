@@ -0,0 +1,50 @@
+/*
+ * anopa - Copyright (C) 2015-2017 Olivier Brunel
+ *
+ * ga_int_set.h
+ * Copyright (C) 2015-2017 Olivier Brunel <jjk@jjacky.com>
+ *
+ * This file is part of anopa.
+ *
+ * anopa is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * anopa is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * anopa. If not, see http://www.gnu.org/licenses/
+ */
+
+#ifndef AA_GA_INT_SET_H
+#define AA_GA_INT_SET_H
+
+#include <sys/types.h>
+#include <skalibs/genalloc.h>
+#include <anopa/ga_int_list.h>
+
+/* set of non-negative ints (i.e. service indexes): membership test, addition
+ * & removal are all O(1). Removing swaps the last value in place, so order is
+ * only preserved when adding/truncating (e.g. to use it as a stack) */
+typedef struct
+{
+    genalloc ga;    /* int: the values */
+    genalloc pos;   /* size_t: indexed by value, 1 + its index in ga, or 0 */
+} ga_int_set;
+
+#define GA_INT_SET_ZERO             { GENALLOC_ZERO, GENALLOC_ZERO }
+
+#define set_len(set)                genalloc_len (int, &(set)->ga)
+#define set_get(set, i)             list_get (&(set)->ga, i)
+
+int  is_in_set          (ga_int_set *set, int val);
+int  add_to_set         (ga_int_set *set, int val);
+int  remove_from_set    (ga_int_set *set, int val);
+void set_truncate       (ga_int_set *set, size_t len);
+void set_free           (ga_int_set *set);
+
+#endif /* AA_GA_INT_SET_H */
@@ -0,0 +1,68 @@
+/*
+ * anopa - Copyright (C) 2015-2017 Olivier Brunel
+ *
+ * graph.h
+ * Copyright (C) 2015-2017 Olivier Brunel <jjk@jjacky.com>
+ *
+ * This file is part of anopa.
+ *
+ * anopa is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * anopa is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * anopa. If not, see http://www.gnu.org/licenses/
+ */
+
+#ifndef AA_GRAPH_H
+#define AA_GRAPH_H
+
+#include <stdint.h>
+
+#define AA_GRAPH_FILENAME           ".graph"
+
+enum
+{
+    AA_GRAPH_LONGRUN        = (1 << 0),
+    AA_GRAPH_GETS_READY     = (1 << 1),
+    AA_GRAPH_HAS_LOG        = (1 << 2),
+    AA_GRAPH_HAS_TIMEOUT    = (1 << 3)
+};
+
+typedef enum
+{
+    AA_GRAPH_NEEDS = 0,
+    AA_GRAPH_WANTS,
+    AA_GRAPH_AFTER,
+    AA_GRAPH_BEFORE,
+    _AA_GRAPH_NB_EDGES
+} aa_graph_edge;
+
+typedef struct
+{
+    const char *name;
+    uint32_t flags;
+    uint32_t secs_timeout;
+    uint32_t first;
+    uint32_t nb[_AA_GRAPH_NB_EDGES];
+    int32_t priority;
+    const char *pool;
+    uint32_t pool_limit;
+    int log; /* gi of its logger, or -1 */
+} aa_graph_service;
+
+extern int          aa_graph_write      (void);
+extern int          aa_graph_load       (void);
+extern void         aa_graph_free       (void);
+extern int          aa_graph_find       (const char *name);
+extern void         aa_graph_get        (int gi, aa_graph_service *gs);
+extern const char  *aa_graph_get_edge   (aa_graph_service *gs, aa_graph_edge edge, uint32_t i);
+extern int          aa_graph_get_edge_gi(aa_graph_service *gs, aa_graph_edge edge, uint32_t i);
+
+#endif /* AA_GRAPH_H */
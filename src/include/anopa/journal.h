@@ -0,0 +1,43 @@
+/*
+ * anopa - Copyright (C) 2015-2017 Olivier Brunel
+ *
+ * journal.h
+ * Copyright (C) 2015-2017 Olivier Brunel <jjk@jjacky.com>
+ *
+ * This file is part of anopa.
+ *
+ * anopa is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * anopa is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * anopa. If not, see http://www.gnu.org/licenses/
+ */
+
+#ifndef AA_JOURNAL_H
+#define AA_JOURNAL_H
+
+#include <anopa/service_status.h>
+
+#define AA_JOURNAL_FILENAME         ".journal"
+/* records kept per service when compacting */
+#define AA_JOURNAL_HISTORY          8
+/* size over which the journal gets compacted when opened, provided that halves
+ * it at least */
+#define AA_JOURNAL_COMPACT_SIZE     (64 << 10)
+
+extern int  aa_journal_open     (int create);
+extern int  aa_journal_append   (aa_service_status *svst, const char *name);
+extern int  aa_journal_commit   (void);
+extern int  aa_journal_close    (void);
+extern int  aa_journal_load     (void);
+extern int  aa_journal_get      (aa_service_status *svst, const char *name, unsigned int n);
+extern void aa_journal_free     (void);
+
+#endif /* AA_JOURNAL_H */
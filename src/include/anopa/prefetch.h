@@ -0,0 +1,35 @@
+/*
+ * anopa - Copyright (C) 2015-2017 Olivier Brunel
+ *
+ * prefetch.h
+ * Copyright (C) 2015-2017 Olivier Brunel <jjk@jjacky.com>
+ *
+ * This file is part of anopa.
+ *
+ * anopa is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * anopa is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * anopa. If not, see http://www.gnu.org/licenses/
+ */
+
+#ifndef AA_PREFETCH_H
+#define AA_PREFETCH_H
+
+#include <anopa/graph.h>
+
+#define AA_PREFETCH_THREADS         8
+
+extern int          aa_prefetch_add     (const char *name);
+extern void         aa_prefetch_run     (unsigned int nb_threads, int no_wants);
+extern int          aa_prefetch_get     (const char *name, aa_graph_service *gs, const char **edges);
+extern void         aa_prefetch_free    (void);
+
+#endif /* AA_PREFETCH_H */
@@ -29,5 +29,6 @@
 typedef int (*aa_sd_it_fn) (direntry *d, void *data);
 
 int aa_scan_dir (stralloc *sa, int files_only, aa_sd_it_fn iterator, void *data);
+int aa_scan_dirat (int fd, const char *path, int files_only, aa_sd_it_fn iterator, void *data);
 
 #endif /* AA_SCAN_DIR_H */
@@ -25,25 +25,35 @@
 
 #include <stdint.h>
 #include <sys/types.h>
-#include <signal.h> /* pid_t */
+#include <signal.h> /* pid_t, sigset_t */
 #include <skalibs/stralloc.h>
 #include <skalibs/genalloc.h>
 #include <skalibs/tai.h>
 #include <anopa/service_status.h>
+#include <anopa/ga_int_set.h>
+#include <anopa/edges.h>
 
 #define AA_START_FILENAME           "start"
 #define AA_STOP_FILENAME            "stop"
 #define AA_GETS_READY_FILENAME      "gets-ready"
+#define AA_PRIORITY_FILENAME        "priority"
+#define AA_POOL_FILENAME            "pool"
 
 extern genalloc aa_services;
+extern genalloc aa_oneshots;
 extern stralloc aa_names;
-extern genalloc aa_main_list;
-extern genalloc aa_tmp_list;
+extern ga_int_set aa_main_list;
+extern ga_int_set aa_tmp_list;
 extern genalloc aa_pid_list;
 extern unsigned int aa_secs_timeout;
+/* signals the caller handles (e.g. via selfpipe), reset in children */
+extern sigset_t aa_sigs_trapped;
 
 #define aa_service(i)               (&((aa_service *) aa_services.s)[i])
 #define aa_service_name(service)    (aa_names.s + (service)->offset_name)
+#define aa_oneshot(service)         (&((aa_oneshot *) aa_oneshots.s)[(service)->oi])
+#define aa_service_pool(service)    (((service)->offset_pool == (size_t) -1) ? NULL \
+                                        : aa_names.s + (service)->offset_pool)
 
 typedef enum
 {
@@ -75,27 +85,46 @@ typedef enum
     AA_LOAD_FAIL
 } aa_ls;
 
+/* what's only needed for a oneshot being exec-ed, so only the ones in flight
+ * have one (see aa_service.oi); slots are reused once they're done */
 typedef struct
 {
-    size_t offset_name;
-    int nb_mark;
-    genalloc needs;
-    genalloc wants;
-    genalloc after;
-    unsigned int secs_timeout;
-    aa_ls ls;
-    aa_service_status st;
-    tain ts_exec;
-    /* longrun */
-    uint16_t ft_id;
-    int gets_ready;
-    /* oneshot */
+    pid_t pid;
+    int fd_pid; /* pidfd notified of its exit, or -1 if not supported */
     int fd_in;
     int fd_out;
     stralloc sa_out;
     int fd_progress;
     int pi;
+} aa_oneshot;
+
+/* hot fields, looked at when processing/scanning services, go first */
+typedef struct
+{
+    aa_ls ls;
+    int nb_mark;
+    int nb_after; /* after-s not yet done */
+    int priority;
+    uint64_t crit; /* length of the critical path from this service, in ms */
+    unsigned int secs_timeout;
+    int ti; /* index of its timeout in the timers heap, or -1 */
+    tain ts_exec;
     int timedout;
+    int overrun; /* 1: its timer is to warn it runs longer than usual; 2: done */
+    int oi; /* index of its aa_oneshot while exec-ed, or -1 */
+    /* longrun */
+    int fd_event; /* our fifo in its eventdir while waiting on it, or -1 */
+    int gets_ready;
+    aa_service_status st;
+    aa_edges needs;
+    aa_edges wants;
+    aa_edges after;
+    aa_edges dependents; /* services w/ this one in their after (or needs) */
+    size_t offset_name;
+    int gi; /* index in the graph, or -1 */
+    int fd_dir; /* cached fd of its servicedir, or -1 */
+    size_t offset_pool; /* name of its pool (in aa_names), or -1 */
+    unsigned int pool_limit;
 } aa_service;
 
 typedef void (*aa_close_fd_fn) (int fd);
@@ -112,9 +141,11 @@ extern int      aa_mark_service (aa_mode mode, int si, int in_main, int no_wants
 extern int      aa_preload_service (int si);
 extern int      aa_ensure_service_loaded (int si, aa_mode mode, int no_wants, aa_autoload_cb al_cb);
 extern int      aa_prepare_mainlist (aa_prepare_cb prepare_cb, aa_exec_cb exec_cb);
-extern void     aa_scan_mainlist (aa_scan_cb scan_cb, aa_mode mode);
+extern void     aa_service_done (int si);
+extern int      aa_pop_ready_service (aa_scan_cb scan_cb, aa_mode mode);
 extern int      aa_exec_service (int si, aa_mode mode);
-extern int      aa_get_longrun_info (uint16_t *id, char *event);
-extern int      aa_unsubscribe_for (uint16_t id);
+extern void     aa_oneshot_release (int si);
+extern int      aa_get_longrun_event (int si, aa_mode mode, char *event);
+extern void     aa_unsubscribe_for (int si);
 
 #endif /* AA_SERVICE_H */
@@ -67,6 +67,7 @@ typedef struct
 extern void aa_service_status_free      (aa_service_status *svst);
 extern int  aa_service_status_read      (aa_service_status *svst, const char *dir);
 extern int  aa_service_status_write     (aa_service_status *svst, const char *dir);
+extern int  aa_service_status_clear     (const char *dir);
 extern int  aa_service_status_set_msg   (aa_service_status *svst, const char *msg);
 extern int  aa_service_status_set_err   (aa_service_status *svst, int err, const char *msg);
 #define aa_service_status_get_msg(svst) \
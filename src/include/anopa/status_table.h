@@ -0,0 +1,42 @@
+/*
+ * anopa - Copyright (C) 2015-2017 Olivier Brunel
+ *
+ * status_table.h
+ * Copyright (C) 2015-2017 Olivier Brunel <jjk@jjacky.com>
+ *
+ * This file is part of anopa.
+ *
+ * anopa is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * anopa is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * anopa. If not, see http://www.gnu.org/licenses/
+ */
+
+#ifndef AA_STATUS_TABLE_H
+#define AA_STATUS_TABLE_H
+
+#include <anopa/service_status.h>
+
+#define AA_STATUS_TABLE_FILENAME    ".statuses"
+/* longest service name (w/ NUL) that can have a slot; others use files only */
+#define AA_STATUS_TABLE_NAME_SIZE   128
+
+/* flags for aa_status_table_open() */
+#define AA_STATUS_TABLE_RDONLY      0
+#define AA_STATUS_TABLE_RDWR        1
+#define AA_STATUS_TABLE_CREATE      2
+
+extern int  aa_status_table_open    (int writable);
+extern int  aa_status_table_get     (aa_service_status *svst, const char *name);
+extern int  aa_status_table_set     (aa_service_status *svst, const char *name);
+extern void aa_status_table_close   (void);
+
+#endif /* AA_STATUS_TABLE_H */
@@ -0,0 +1,59 @@
+/*
+ * anopa - Copyright (C) 2015-2017 Olivier Brunel
+ *
+ * timeline.h
+ * Copyright (C) 2015-2017 Olivier Brunel <jjk@jjacky.com>
+ *
+ * This file is part of anopa.
+ *
+ * anopa is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * anopa is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * anopa. If not, see http://www.gnu.org/licenses/
+ */
+
+#ifndef AA_TIMELINE_H
+#define AA_TIMELINE_H
+
+#include <stddef.h>
+#include <skalibs/tai.h>
+
+#define AA_TIMELINE_FILENAME        ".timeline"
+/* transactions kept in the file */
+#define AA_TIMELINE_KEEP            8
+
+typedef struct
+{
+    size_t offset_name;
+    size_t offset_after; /* deciding dependency, or -1 */
+    tain start; /* exec-ed */
+    tain ready; /* up, for long-runs getting ready (else zero) */
+    tain end;   /* done, whether it succeeded or not */
+    unsigned int event;
+    int code;
+} aa_tl_entry;
+
+extern void         aa_timeline_begin   (int is_start);
+extern int          aa_timeline_add     (const char *name, const char *after,
+                                         tain const *start, tain const *ready,
+                                         tain const *end, unsigned int event, int code);
+extern int          aa_timeline_write   (void);
+extern int          aa_timeline_load    (unsigned int n);
+extern void         aa_timeline_free    (void);
+extern int          aa_timeline_is_start(void);
+extern tain const * aa_timeline_stamp   (void);
+extern size_t       aa_timeline_nb      (void);
+extern aa_tl_entry *aa_timeline_get     (size_t i);
+extern int          aa_timeline_find    (const char *name);
+extern const char * aa_timeline_name    (aa_tl_entry *e);
+extern const char * aa_timeline_after   (aa_tl_entry *e);
+
+#endif /* AA_TIMELINE_H */
@@ -0,0 +1,297 @@
+/*
+ * anopa - Copyright (C) 2015-2017 Olivier Brunel
+ *
+ * durations.c
+ * Copyright (C) 2015-2017 Olivier Brunel <jjk@jjacky.com>
+ *
+ * This file is part of anopa.
+ *
+ * anopa is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * anopa is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * anopa. If not, see http://www.gnu.org/licenses/
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <skalibs/djbunix.h>
+#include <skalibs/bytestr.h>
+#include <skalibs/stralloc.h>
+#include <skalibs/genalloc.h>
+#include <skalibs/types.h>
+#include <anopa/durations.h>
+
+/* File format: magic, then for each service: its EWMA (in milliseconds, 32bit
+ * little-endian), number of samples (32bit), the samples, oldest first (32bit
+ * each), and its (NUL-terminated) name.
+ * Version 1 only had the duration of the last start & the name */
+#define MAGIC               "aadurs\0\002"
+#define MAGIC_V1            "aadurs\0\001"
+
+struct duration
+{
+    size_t offset_name;
+    uint32_t ewma;
+    uint32_t samples[AA_DURATIONS_SAMPLES]; /* ring buffer */
+    unsigned int nb;
+    unsigned int next;
+};
+
+static stralloc sa_names = STRALLOC_ZERO;
+static genalloc ga_durations = GENALLOC_ZERO; /* struct duration, sorted */
+
+#define duration(i)         (&genalloc_s (struct duration, &ga_durations)[i])
+/* k-th oldest sample */
+#define sample(d,k)         ((d)->samples[((d)->next + AA_DURATIONS_SAMPLES - (d)->nb + (k)) \
+                                % AA_DURATIONS_SAMPLES])
+
+void
+aa_durations_free (void)
+{
+    stralloc_free (&sa_names);
+    genalloc_free (struct duration, &ga_durations);
+}
+
+/* returns the index of name, or (as negative - 1) where it should be added */
+static int
+find (const char *name)
+{
+    int l = 0;
+    int r = genalloc_len (struct duration, &ga_durations);
+
+    while (l < r)
+    {
+        int m = l + (r - l) / 2;
+        int c = str_diff (name, sa_names.s + duration (m)->offset_name);
+
+        if (c == 0)
+            return m;
+        else if (c < 0)
+            r = m;
+        else
+            l = m + 1;
+    }
+
+    return -l - 1;
+}
+
+/* returns the index of name, adding it if needed, or -1 on error */
+static int
+find_or_add (const char *name)
+{
+    struct duration d = { .offset_name = sa_names.len, .ewma = 0, .nb = 0, .next = 0 };
+    size_t len = genalloc_len (struct duration, &ga_durations);
+    int i = find (name);
+
+    if (i >= 0)
+        return i;
+
+    i = -i - 1;
+    if (!stralloc_catb (&sa_names, name, strlen (name) + 1)
+            || !genalloc_ready (struct duration, &ga_durations, len + 1))
+        return (errno = ENOMEM, -1);
+    memmove (duration (i + 1), duration (i), (len - i) * sizeof (struct duration));
+    *duration (i) = d;
+    genalloc_setlen (struct duration, &ga_durations, len + 1);
+    return i;
+}
+
+static void
+add_sample (struct duration *d, uint32_t msecs)
+{
+    d->samples[d->next] = msecs;
+    d->next = (d->next + 1) % AA_DURATIONS_SAMPLES;
+    if (d->nb < AA_DURATIONS_SAMPLES)
+        ++d->nb;
+}
+
+/* expected duration, i.e. the EWMA of its starts, or 0 if unknown */
+unsigned int
+aa_durations_get (const char *name)
+{
+    int i = find (name);
+
+    return (i < 0) ? 0 : duration (i)->ewma;
+}
+
+/* number of samples known, up to AA_DURATIONS_SAMPLES */
+unsigned int
+aa_durations_nb (const char *name)
+{
+    int i = find (name);
+
+    return (i < 0) ? 0 : duration (i)->nb;
+}
+
+/* pct-th percentile (nearest-rank) of the last samples, or 0 if unknown */
+unsigned int
+aa_durations_percentile (const char *name, unsigned int pct)
+{
+    uint32_t sorted[AA_DURATIONS_SAMPLES];
+    struct duration *d;
+    unsigned int k;
+    unsigned int j;
+    int i = find (name);
+
+    if (i < 0 || duration (i)->nb == 0)
+        return 0;
+    d = duration (i);
+
+    /* insertion sort, there's only a few */
+    for (k = 0; k < d->nb; ++k)
+    {
+        uint32_t u = sample (d, k);
+
+        for (j = k; j > 0 && sorted[j - 1] > u; --j)
+            sorted[j] = sorted[j - 1];
+        sorted[j] = u;
+    }
+
+    if (pct > 100)
+        pct = 100;
+    k = (pct * d->nb + 99) / 100;
+    return sorted[(k > 0) ? k - 1 : 0];
+}
+
+/* records a new duration of name */
+int
+aa_durations_add (const char *name, unsigned int msecs)
+{
+    struct duration *d;
+    int i = find_or_add (name);
+
+    if (i < 0)
+        return -1;
+    d = duration (i);
+
+    if (d->nb == 0)
+        d->ewma = msecs;
+    else
+        d->ewma = (int64_t) d->ewma
+            + ((int64_t) msecs - (int64_t) d->ewma) / AA_DURATIONS_EWMA_WEIGHT;
+    add_sample (d, msecs);
+    return 0;
+}
+
+/* returns 1 if loaded, 0 if there's none (or it isn't valid), -1 on error.
+ * Must be called from the repodir */
+int
+aa_durations_load (void)
+{
+    stralloc sa = STRALLOC_ZERO;
+    size_t i;
+    int v1;
+
+    aa_durations_free ();
+
+    if (!openslurpclose (&sa, AA_DURATIONS_FILENAME))
+        return (errno == ENOENT) ? 0 : -1;
+
+    v1 = (sa.len >= 8 && !byte_diff (sa.s, 8, MAGIC_V1));
+    if (sa.len < 8 || (!v1 && byte_diff (sa.s, 8, MAGIC)))
+    {
+        stralloc_free (&sa);
+        return 0;
+    }
+
+    for (i = 8; i + 5 <= sa.len; )
+    {
+        uint32_t samples[AA_DURATIONS_SAMPLES];
+        uint32_t ewma;
+        uint32_t nb = 1;
+        const char *name;
+        size_t l;
+        size_t k;
+        int n;
+
+        uint32_unpack (sa.s + i, &ewma);
+        i += 4;
+        if (v1)
+            samples[0] = ewma;
+        else
+        {
+            if (i + 4 > sa.len)
+                break;
+            uint32_unpack (sa.s + i, &nb);
+            i += 4;
+            if (nb > AA_DURATIONS_SAMPLES || i + 4 * nb >= sa.len)
+                break;
+            for (k = 0; k < nb; ++k, i += 4)
+                uint32_unpack (sa.s + i, &samples[k]);
+        }
+
+        name = sa.s + i;
+        l = byte_chr (name, sa.len - i, '\0');
+        if (i + l >= sa.len)
+            break;
+
+        n = find_or_add (name);
+        if (n < 0)
+        {
+            int e = errno;
+
+            stralloc_free (&sa);
+            aa_durations_free ();
+            errno = e;
+            return -1;
+        }
+        duration (n)->ewma = ewma;
+        for (k = 0; k < nb; ++k)
+            add_sample (duration (n), samples[k]);
+        i += l + 1;
+    }
+
+    stralloc_free (&sa);
+    return 1;
+}
+
+/* Must be called from the repodir */
+int
+aa_durations_write (void)
+{
+    stralloc sa = STRALLOC_ZERO;
+    size_t len = genalloc_len (struct duration, &ga_durations);
+    size_t i;
+    mode_t mask;
+    int r;
+    int e;
+
+    if (!stralloc_catb (&sa, MAGIC, 8))
+        return -1;
+    for (i = 0; i < len; ++i)
+    {
+        struct duration *d = duration (i);
+        const char *name = sa_names.s + d->offset_name;
+        char buf[8 + 4 * AA_DURATIONS_SAMPLES];
+        unsigned int k;
+
+        uint32_pack (buf, d->ewma);
+        uint32_pack (buf + 4, d->nb);
+        for (k = 0; k < d->nb; ++k)
+            uint32_pack (buf + 8 + 4 * k, sample (d, k));
+        if (!stralloc_catb (&sa, buf, 8 + 4 * d->nb)
+                || !stralloc_catb (&sa, name, strlen (name) + 1))
+        {
+            stralloc_free (&sa);
+            return -1;
+        }
+    }
+
+    mask = umask (0022);
+    r = (openwritenclose_suffix (AA_DURATIONS_FILENAME, sa.s, sa.len, ".new")) ? 0 : -1;
+    e = errno;
+    umask (mask);
+    stralloc_free (&sa);
+    errno = e;
+    return r;
+}
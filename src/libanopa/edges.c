@@ -0,0 +1,89 @@
+/*
+ * anopa - Copyright (C) 2015-2017 Olivier Brunel
+ *
+ * edges.c
+ * Copyright (C) 2015-2017 Olivier Brunel <jjk@jjacky.com>
+ *
+ * This file is part of anopa.
+ *
+ * anopa is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * anopa is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * anopa. If not, see http://www.gnu.org/licenses/
+ */
+
+#include <string.h>
+#include <errno.h>
+#include <skalibs/genalloc.h>
+#include <anopa/edges.h>
+
+/* room for a list when first added to */
+#define MIN_CAP                 4
+
+#define pool_s(l)               (genalloc_s (int, &aa_edge_pool) + (l)->offset)
+
+int
+edges_find (aa_edges *l, int si)
+{
+    int *s = pool_s (l);
+    unsigned int i;
+
+    for (i = 0; i < l->len; ++i)
+        if (s[i] == si)
+            return i;
+    return -1;
+}
+
+/* returns 1 if added, 0 if already in the list (only checked if chk_dupes), -1
+ * on error (ENOMEM) */
+int
+add_to_edges (aa_edges *l, int si, int chk_dupes)
+{
+    if (chk_dupes && edges_find (l, si) >= 0)
+        return 0;
+
+    if (l->len == l->cap)
+    {
+        size_t len = genalloc_len (int, &aa_edge_pool);
+        unsigned int cap = (l->cap > 0) ? 2 * l->cap : MIN_CAP;
+
+        if (l->cap > 0 && l->offset + l->cap == len)
+        {
+            if (!genalloc_ready (int, &aa_edge_pool, l->offset + cap))
+                return (errno = ENOMEM, -1);
+        }
+        else
+        {
+            if (!genalloc_ready (int, &aa_edge_pool, len + cap))
+                return (errno = ENOMEM, -1);
+            memcpy (genalloc_s (int, &aa_edge_pool) + len, pool_s (l), l->len * sizeof (int));
+            l->offset = len;
+        }
+        genalloc_setlen (int, &aa_edge_pool, l->offset + cap);
+        l->cap = cap;
+    }
+
+    pool_s (l)[l->len++] = si;
+    return 1;
+}
+
+/* returns 1 if removed, 0 if not in the list */
+int
+remove_from_edges (aa_edges *l, int si)
+{
+    int i = edges_find (l, si);
+
+    if (i < 0)
+        return 0;
+    memmove (pool_s (l) + i, pool_s (l) + i + 1, (l->len - i - 1) * sizeof (int));
+    --l->len;
+    return 1;
+}
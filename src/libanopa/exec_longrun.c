@@ -21,40 +21,90 @@
  */
 
 #include <unistd.h>
+#include <fcntl.h>
 #include <strings.h>
 #include <errno.h>
+#include <sys/stat.h>
+#include <skalibs/allreadwrite.h>
 #include <skalibs/djbunix.h>
 #include <skalibs/bytestr.h>
+#include <skalibs/types.h>
 #include <skalibs/tai.h>
 #include <s6/supervise.h>
-#include <s6/ftrigr.h>
 #include <anopa/service.h>
 #include <anopa/err.h>
 #include <anopa/output.h>
 #include "service_internal.h"
 
+/* s6-supervise writes its events to all fifos in its fifodir (eventdir) whose
+ * name starts w/ this prefix; so we add one of ours, and read them directly */
+#define FIFO_PREFIX         "ftrig1"
+#define FIFO_MODE           (S_IRUSR | S_IWUSR | S_IWGRP | S_IWOTH)
+
+/* our fifo, relative to the servicedir: one per process is enough, since we
+ * only ever wait on a service once at a time */
+static void
+fifo_name (char *buf)
+{
+    size_t l = sizeof (S6_SUPERVISE_EVENTDIR "/" FIFO_PREFIX ":@anopa-") - 1;
+
+    byte_copy (buf, l, S6_SUPERVISE_EVENTDIR "/" FIFO_PREFIX ":@anopa-");
+    buf[l + uint_fmt (buf + l, (unsigned int) getpid ())] = '\0';
+}
+
+/* the events that we want (and end waiting, but when getting ready) */
+static const char *
+events_for (aa_service *s, aa_mode mode)
+{
+    return (mode & AA_MODE_START) ? ((s->gets_ready) ? "udU" : "u") : "D";
+}
+
+static int
+subscribe (int si)
+{
+    int fd_dir = _service_dirfd (si);
+    char name[sizeof (S6_SUPERVISE_EVENTDIR "/" FIFO_PREFIX ":@anopa-") + UINT_FMT];
+    int fd;
+
+    if (fd_dir < 0)
+        return -1;
+    fifo_name (name);
+
+    /* a leftover from a previous process w/ the same pid */
+    if (mkfifoat (fd_dir, name, FIFO_MODE) < 0
+            && (errno != EEXIST || unlinkat (fd_dir, name, 0) < 0
+                || mkfifoat (fd_dir, name, FIFO_MODE) < 0))
+        return -1;
+    /* not subject to umask, as s6-supervise might run as another user */
+    if (fchmodat (fd_dir, name, FIFO_MODE, 0) < 0)
+        goto err;
+    /* also open for writing, so it never gets to EOF */
+    fd = openat (fd_dir, name, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0)
+        goto err;
+    aa_service (si)->fd_event = fd;
+    return 0;
+
+err:
+    {
+        int e = errno;
+        unlinkat (fd_dir, name, 0);
+        errno = e;
+    }
+    return -1;
+}
+
 int
 _exec_longrun (int si, aa_mode mode)
 {
     aa_service *s = aa_service (si);
     s6_svstatus_t st6 = S6_SVSTATUS_ZERO;
     size_t l_sn = strlen (aa_service_name (s));
-    char fifodir[l_sn + 1 + sizeof (S6_SUPERVISE_EVENTDIR)];
-    tain deadline;
     int is_start = (mode & AA_MODE_START) ? 1 : 0;
-    const char *event = (is_start) ? ((s->gets_ready) ? "[udU]" : "u") : "D";
     const char *cmd = (is_start) ? "u" : (mode & AA_MODE_STOP_ALL) ? "dx" : "d";
     int already = 0;
 
-    byte_copy (fifodir, l_sn, aa_service_name (s));
-    fifodir[l_sn] = '/';
-    byte_copy (fifodir + l_sn + 1, sizeof (S6_SUPERVISE_EVENTDIR), S6_SUPERVISE_EVENTDIR);
-
-    tain_addsec_g (&deadline, 1);
-    s->ft_id = ftrigr_subscribe_g (&_aa_ft, fifodir, event,
-                                   (*event == '[') ? FTRIGR_REPEAT : 0,
-                                   &deadline);
-    if (s->ft_id == 0)
+    if (subscribe (si) < 0)
     {
         /* this could happen e.g. if the servicedir isn't in scandir, if
          * something failed during aa-enable for example */
@@ -88,19 +138,10 @@ _exec_longrun (int si, aa_mode mode)
 
         if (!is_start || !s->gets_ready || st6.flagready)
         {
-            /* already there: unsubcribe.
-             *
-             * Failure to unsubscribe w/ EINVAL means that the service got where
-             * we wanted *after* we subscribed, and the event was already
-             * treated/is queued up (when non-repeating, i.e. no FTRIGR_REPEAT).
-             * Then, we want to process it later as usual (i.e. keep it & not
-             * set already).
-             */
-            if (aa_unsubscribe_for (s->ft_id) == 0 || errno != EINVAL)
-            {
-                already = 1;
-                s->ft_id = 0;
-            }
+            /* already there: unsubcribe. (Should the event have come in since
+             * we subscribed, it's as good as being already there.) */
+            aa_unsubscribe_for (si);
+            already = 1;
         }
 
         /* make sure our status is correct, and timestamped before s6 */
@@ -162,8 +203,7 @@ _exec_longrun (int si, aa_mode mode)
         r = s6_svc_write (dir, cmd, strlen (cmd));
         if (r <= 0 && !already)
         {
-            aa_unsubscribe_for (s->ft_id);
-            s->ft_id = 0;
+            aa_unsubscribe_for (si);
 
             s->st.event = (is_start) ? AA_EVT_STARTING_FAILED : AA_EVT_STOPPING_FAILED;
             s->st.code = ERR_S6;
@@ -181,18 +221,13 @@ _exec_longrun (int si, aa_mode mode)
     }
 
     {
-        char buf[l_sn + 6];
-
-        byte_copy (buf, l_sn, aa_service_name (s));
-        byte_copy (buf + l_sn, 6, "/down");
+        int fd = _service_dirfd (si);
 
         if (is_start)
-            unlink (buf);
+            unlinkat (fd, "down", 0);
         else
         {
-            int fd;
-
-            fd = open_create (buf);
+            fd = openat (fd, "down", O_WRONLY | O_NONBLOCK | O_CREAT | O_CLOEXEC, 0666);
             if (fd < 0)
                 aa_strerr_warnu2sys ("create down file for ", aa_service_name (s));
             else
@@ -205,8 +240,8 @@ _exec_longrun (int si, aa_mode mode)
         if (_exec_cb)
             _exec_cb (si, (is_start) ? -ERR_ALREADY_UP : -ERR_NOT_UP, 0);
 
-        /* this was not a failure, but we return -1 to trigger a
-         * aa_scan_mainlist() anyways, since the service changed state */
+        /* this was not a failure, but we return -1 so the service is done
+         * (and its dependents processed) right away */
         return -1;
     }
 
@@ -215,41 +250,60 @@ _exec_longrun (int si, aa_mode mode)
     return 0;
 }
 
-static size_t idx = (size_t) -1;
-
+/* reads the next event we want from the fifo of si (to be called until it
+ * returns 0 once it's readable). Returns 1 (event then set), 0 if there's none
+ * (left), or -1 on error */
 int
-aa_get_longrun_info (uint16_t *id, char *event)
+aa_get_longrun_event (int si, aa_mode mode, char *event)
 {
-    int r;
+    aa_service *s = aa_service (si);
+    const char *events = events_for (s, mode);
+    char c;
 
-    if (idx == (size_t) -1)
+    if (s->fd_event < 0)
+        return 0;
+    for (;;)
     {
-        r = ftrigr_update (&_aa_ft);
+        ssize_t r = fd_read (s->fd_event, &c, 1);
+
         if (r < 0)
-            return -1;
+            return (errno == EAGAIN) ? 0 : -1;
         else if (r == 0)
             return 0;
-        idx = 0;
+        if (events[str_chr (events, c)])
+        {
+            *event = c;
+            return 1;
+        }
     }
+}
+
+/* closes & removes our fifo from its eventdir, if any. Must be called from the
+ * repodir */
+void
+_unsubscribe (aa_service *s)
+{
+    size_t l_sn;
 
-    for ( ; idx < genalloc_len (uint16_t, &_aa_ft.list); )
+    if (s->fd_event < 0)
+        return;
+    fd_close (s->fd_event);
+    s->fd_event = -1;
+
+    l_sn = strlen (aa_service_name (s));
     {
-        *id = genalloc_s (uint16_t, &_aa_ft.list)[idx];
-        r = ftrigr_check (&_aa_ft, *id, event);
-        ++idx;
-        if (r != 0)
-            return (r < 0) ? -2 : r;
-    }
+        char buf[l_sn + 1 + sizeof (S6_SUPERVISE_EVENTDIR "/" FIFO_PREFIX ":@anopa-") + UINT_FMT];
 
-    idx = (size_t) -1;
-    return 0;
+        byte_copy (buf, l_sn, aa_service_name (s));
+        buf[l_sn] = '/';
+        fifo_name (buf + l_sn + 1);
+        unlink (buf);
+    }
 }
 
-int
-aa_unsubscribe_for (uint16_t id)
+/* stops waiting on si */
+void
+aa_unsubscribe_for (int si)
 {
-    tain deadline;
-
-    tain_addsec_g (&deadline, 1);
-    return (ftrigr_unsubscribe_g (&_aa_ft, id, &deadline)) ? 0 : -1;
+    _unsubscribe (aa_service (si));
 }
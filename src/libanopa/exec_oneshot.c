@@ -20,15 +20,17 @@
  * anopa. If not, see http://www.gnu.org/licenses/
  */
 
+#define _BSD_SOURCE
+#define _GNU_SOURCE
+
 #include <sys/stat.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <signal.h>
 #include <strings.h>
 #include <errno.h>
-#include <skalibs/allreadwrite.h>
 #include <skalibs/djbunix.h>
 #include <skalibs/sig.h>
-#include <skalibs/selfpipe.h>
 #include <skalibs/bytestr.h>
 #include <skalibs/tai.h>
 #include <skalibs/types.h>
@@ -49,18 +51,22 @@ _exec_oneshot (int si, aa_mode mode)
     struct stat st;
     const char *_err = NULL; /* silence warning */
     int _errno = 0; /* silence warning */
-    int p_int[2];
     int p_in[2];
     int p_out[2];
     int p_prg[2];
+    sigset_t set_old;
+    /* set by the child on failure, as it shares our memory until it execs */
+    volatile char c = 0;
+    volatile int e = 0;
     pid_t pid;
-    char c;
+    int fd;
 
     byte_copy (buf, l_sn, aa_service_name (s));
     byte_copy (buf + l_sn, 1, "/");
     byte_copy (buf + l_sn + 1, l_fn, filename);
 
-    if (stat (buf, &st) < 0)
+    fd = _service_dirfd (si);
+    if (fd < 0 || fstatat (fd, filename, &st, 0) < 0)
     {
         tain_now_g ();
 
@@ -80,8 +86,8 @@ _exec_oneshot (int si, aa_mode mode)
         if (_exec_cb)
             _exec_cb (si, s->st.event, 0);
 
-        /* this was not a failure, but we return -1 to trigger a
-         * aa_scan_mainlist() anyways, since the service changed state */
+        /* this was not a failure, but we return -1 so the service is done
+         * (and its dependents processed) right away */
         return -1;
     }
 
@@ -99,67 +105,36 @@ _exec_oneshot (int si, aa_mode mode)
         return -1;
     }
 
-    if (pipecoe (p_int) < 0)
+    if (_new_oneshot (si) < 0)
     {
         _errno = errno;
-        _err = "set up pipes";
+        _err = "allocate memory";
         goto err;
     }
-    if (pipe (p_in) < 0)
-    {
-        _errno = errno;
-        _err = "set up pipes";
-
-        fd_close (p_int[0]);
-        fd_close (p_int[1]);
 
-        goto err;
-    }
-    else if (ndelay_on (p_in[1]) < 0 || coe (p_in[1]) < 0)
+    /* all fds are close-on-exec, the child's ends are dup-ed in place w/out
+     * it. Non-blocking as ours must be; the child makes its own blocking */
+    if (pipe2 (p_in, O_CLOEXEC | O_NONBLOCK) < 0)
     {
         _errno = errno;
         _err = "set up pipes";
-
-        fd_close (p_int[0]);
-        fd_close (p_int[1]);
-        fd_close (p_in[0]);
-        fd_close (p_in[1]);
-
         goto err;
     }
-    if (pipe (p_out) < 0)
+    if (pipe2 (p_out, O_CLOEXEC | O_NONBLOCK) < 0)
     {
         _errno = errno;
         _err = "set up pipes";
 
-        fd_close (p_int[0]);
-        fd_close (p_int[1]);
         fd_close (p_in[0]);
         fd_close (p_in[1]);
 
         goto err;
     }
-    else if (ndelay_on (p_out[0]) < 0 || coe (p_out[0]) < 0)
-    {
-        _errno = errno;
-        _err = "set up pipes";
-
-        fd_close (p_int[0]);
-        fd_close (p_int[1]);
-        fd_close (p_in[0]);
-        fd_close (p_in[1]);
-        fd_close (p_out[0]);
-        fd_close (p_out[1]);
-
-        goto err;
-    }
-    if (pipe (p_prg) < 0)
+    if (pipe2 (p_prg, O_CLOEXEC | O_NONBLOCK) < 0)
     {
         _errno = errno;
         _err = "set up pipes";
 
-        fd_close (p_int[0]);
-        fd_close (p_int[1]);
         fd_close (p_in[0]);
         fd_close (p_in[1]);
         fd_close (p_out[0]);
@@ -167,174 +142,155 @@ _exec_oneshot (int si, aa_mode mode)
 
         goto err;
     }
-    else if (ndelay_on (p_prg[0]) < 0 || coe (p_prg[0]) < 0)
-    {
-        _errno = errno;
-        _err = "set up pipes";
-
-        fd_close (p_int[0]);
-        fd_close (p_int[1]);
-        fd_close (p_in[0]);
-        fd_close (p_in[1]);
-        fd_close (p_out[0]);
-        fd_close (p_out[1]);
-        fd_close (p_prg[0]);
-        fd_close (p_prg[1]);
 
-        goto err;
-    }
+    /* "./start" since the child will be in the servicedir */
+    buf[l_sn - 1] = '.';
 
-    pid = fork ();
-    if (pid < 0)
+    /* vfork() so the child doesn't need a copy of our memory, and we only
+     * resume once it exec-ed or failed, so no handshake is needed. All signals
+     * are blocked meanwhile, so none of our handlers run in the child before
+     * it reset them */
     {
-        _errno = errno;
-        _err = "fork";
+        sigset_t set;
 
-        fd_close (p_int[1]);
-        fd_close (p_int[0]);
-        fd_close (p_in[0]);
-        fd_close (p_in[1]);
-        fd_close (p_out[1]);
-        fd_close (p_out[0]);
-        fd_close (p_prg[1]);
-        fd_close (p_prg[0]);
-
-        goto err;
+        sigfillset (&set);
+        sigprocmask (SIG_SETMASK, &set, &set_old);
     }
-    else if (pid == 0)
+    pid = vfork ();
+    if (pid == 0)
     {
         char * const argv[] = { filename, NULL };
-        PROG = aa_service_name (s);
-        char buf_e[UINT32_FMT];
-        uint32_t e;
-
-        selfpipe_finish ();
+        struct sigaction sa;
+        sigset_t set;
+        int i;
+
+        sa.sa_handler = SIG_DFL;
+        sa.sa_flags = 0;
+        sigemptyset (&sa.sa_mask);
+        for (i = 1; i < NSIG; ++i)
+            if (sigismember (&aa_sigs_trapped, i) == 1)
+                sigaction (i, &sa, NULL);
         /* Ignore SIGINT to make sure one can ^C to timeout a service without
          * issue. */
         sig_ignore (SIGINT);
-        fd_close (p_int[0]);
-        fd_close (p_in[1]);
-        fd_close (p_out[0]);
-        fd_close (p_prg[0]);
+        sigemptyset (&set);
+        sigprocmask (SIG_SETMASK, &set, NULL);
+        if (_aa_nofile.rlim_cur > 0)
+            setrlimit (RLIMIT_NOFILE, &_aa_nofile);
+
+        /* first, as fd (servicedir) could be one of those we replace */
+        if (fd_chdir (fd) < 0)
+        {
+            e = errno;
+            c = 'c';
+            _exit (ERR_IO);
+        }
+
         fd_close (0);
         fd_close (1);
         fd_close (2);
+        /* its ends back to blocking (2 shares 1's file description) */
         if (fd_move (0, p_in[0]) < 0 || fd_move (1, p_out[1]) < 0
-                || fd_copy (2, 1) < 0 || fd_move (3, p_prg[1]) < 0)
+                || fd_copy (2, 1) < 0 || fd_move (3, p_prg[1]) < 0
+                || fcntl (0, F_SETFL, 0) < 0 || fcntl (1, F_SETFL, 0) < 0
+                || fcntl (3, F_SETFL, 0) < 0)
         {
-            e = (uint32_t) errno;
-            fd_write (p_int[1], "p", 1);
-            uint32_pack (buf_e, e);
-            fd_write (p_int[1], buf_e, UINT32_FMT);
-            aa_strerr_diefu1sys (ERR_IO, "set up pipes");
+            e = errno;
+            c = 'p';
+            _exit (ERR_IO);
         }
 
-        if (chdir (PROG) < 0)
-        {
-            e = (uint32_t) errno;
-            fd_write (p_int[1], "c", 1);
-            uint32_pack (buf_e, e);
-            fd_write (p_int[1], buf_e, UINT32_FMT);
-            aa_strerr_diefu1sys (ERR_IO, "get into service directory");
-        }
-
-        buf[l_sn - 1] = '.';
         execv (buf + l_sn - 1, argv);
         /* if it fails... */
-        e = (uint32_t) errno;
-        fd_write (p_int[1], "e", 1);
-        uint32_pack (buf_e, e);
-        fd_write (p_int[1], buf_e, UINT32_FMT);
-        aa_strerr_dieexec (ERR_IO, filename);
+        e = errno;
+        c = 'e';
+        _exit (ERR_IO);
     }
+    _errno = errno;
+    sigprocmask (SIG_SETMASK, &set_old, NULL);
 
-    fd_close (p_int[1]);
     fd_close (p_in[0]);
     fd_close (p_out[1]);
     fd_close (p_prg[1]);
-    switch (fd_read (p_int[0], &c, 1))
+
+    if (pid < 0)
     {
-        case 0:     /* it worked */
-            {
-                fd_close (p_int[0]);
-                s->fd_in = p_in[1];
-                s->fd_out = p_out[0];
-                s->fd_progress = p_prg[0];
+        _err = "fork";
 
-                tain_now_g ();
+        fd_close (p_in[1]);
+        fd_close (p_out[0]);
+        fd_close (p_prg[0]);
 
-                if (_exec_cb)
-                    _exec_cb (si, s->st.event, pid);
-                return 0;
-            }
+        goto err;
+    }
+    else if (c == 0)    /* it worked */
+    {
+        aa_oneshot (s)->fd_in = p_in[1];
+        aa_oneshot (s)->fd_out = p_out[0];
+        aa_oneshot (s)->fd_progress = p_prg[0];
+
+        tain_now_g ();
+
+        if (_exec_cb)
+            _exec_cb (si, s->st.event, pid);
+        return 0;
+    }
+    else                /* child failed to exec */
+    {
+        char msg[l_fn + 260];
+        size_t p = 0;
+        size_t l;
+
+        tain_now_g ();
+
+        /* it has exited already */
+        waitpid_nointr (pid, NULL, 0);
+        fd_close (p_in[1]);
+        fd_close (p_out[0]);
+        fd_close (p_prg[0]);
+        aa_oneshot_release (si);
+
+        if (c == 'e')
+        {
+            s->st.code = ERR_EXEC;
+            byte_copy (msg, 1, " ");
+            byte_copy (msg + 1, l_fn, filename);
+            p += 1 + l_fn;
+        }
+        else if (c == 'p')
+            s->st.code = ERR_PIPES;
+        else /* 'c' */
+            s->st.code = ERR_CHDIR;
 
-        case 1:     /* child failed to exec */
+        if (e > 0)
+        {
+            if (c == 'e')
             {
-                char msg[l_fn + 260];
-                char buf[UINT32_FMT];
-                uint32_t e = 0;
-                size_t p = 0;
-                size_t l;
-
-                tain_now_g ();
-
-                if (fd_read (p_int[0], buf, UINT32_FMT) == UINT32_FMT)
-                    uint32_unpack (buf, &e);
-                fd_close (p_int[0]);
-                fd_close (p_in[1]);
-                fd_close (p_out[0]);
-                fd_close (p_prg[0]);
-
-                if (c == 'e')
-                {
-                    s->st.code = ERR_EXEC;
-                    byte_copy (msg, 1, " ");
-                    byte_copy (msg + 1, l_fn, filename);
-                    p += 1 + l_fn;
-                }
-                else if (c == 'p')
-                    s->st.code = ERR_PIPES;
-                else /* 'c' */
-                    s->st.code = ERR_CHDIR;
-
-                if (e > 0)
-                {
-                    if (c == 'e')
-                    {
-                        l = 2;
-                        byte_copy (msg + p, l, ": ");
-                        p += l;
-                    }
-                    l = strlen (strerror (e));
-                    if (p + l >= 260)
-                        l = 260 - p - 1;
-                    byte_copy (msg + p, l, strerror (e));
-                    p += l;
-                }
-                byte_copy (msg + p, 1, "");
-
-                s->st.event = (is_start) ? AA_EVT_STARTING_FAILED : AA_EVT_STOPPING_FAILED;
-                tain_copynow (&s->st.stamp);
-                aa_service_status_set_msg (&s->st, msg);
-                if (aa_service_status_write (&s->st, aa_service_name (s)) < 0)
-                    aa_strerr_warnu2sys ("write service status file for ", aa_service_name (s));
-
-                if (_exec_cb)
-                    _exec_cb (si, s->st.event, 0);
-                return -1;
+                l = 2;
+                byte_copy (msg + p, l, ": ");
+                p += l;
             }
+            l = strlen (strerror (e));
+            if (p + l >= 260)
+                l = 260 - p - 1;
+            byte_copy (msg + p, l, strerror (e));
+            p += l;
+        }
+        byte_copy (msg + p, 1, "");
 
-        case -1:    /* internal failure */
-            _errno = errno;
-            _err = "read pipe";
+        s->st.event = (is_start) ? AA_EVT_STARTING_FAILED : AA_EVT_STOPPING_FAILED;
+        tain_copynow (&s->st.stamp);
+        aa_service_status_set_msg (&s->st, msg);
+        if (aa_service_status_write (&s->st, aa_service_name (s)) < 0)
+            aa_strerr_warnu2sys ("write service status file for ", aa_service_name (s));
 
-            fd_close (p_int[0]);
-            fd_close (p_in[1]);
-            fd_close (p_out[0]);
-            fd_close (p_prg[0]);
+        if (_exec_cb)
+            _exec_cb (si, s->st.event, 0);
+        return -1;
     }
 
 err:
+    aa_oneshot_release (si);
     tain_now_g ();
     s->st.event = (is_start) ? AA_EVT_STARTING_FAILED : AA_EVT_STOPPING_FAILED;
     s->st.code = ERR_IO;
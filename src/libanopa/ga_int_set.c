@@ -0,0 +1,98 @@
+/*
+ * anopa - Copyright (C) 2015-2017 Olivier Brunel
+ *
+ * ga_int_set.c
+ * Copyright (C) 2015-2017 Olivier Brunel <jjk@jjacky.com>
+ *
+ * This file is part of anopa.
+ *
+ * anopa is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * anopa is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * anopa. If not, see http://www.gnu.org/licenses/
+ */
+
+#include <string.h>
+#include <skalibs/genalloc.h>
+#include <anopa/ga_int_set.h>
+
+#define pos_of(set, val)        genalloc_s (size_t, &(set)->pos)[val]
+
+int
+is_in_set (ga_int_set *set, int val)
+{
+    return (size_t) val < genalloc_len (size_t, &set->pos) && pos_of (set, val) > 0;
+}
+
+/* returns 1 if added, 0 if already in set, -1 on error (ENOMEM) */
+int
+add_to_set (ga_int_set *set, int val)
+{
+    size_t len = genalloc_len (size_t, &set->pos);
+
+    if (is_in_set (set, val))
+        return 0;
+
+    if ((size_t) val >= len)
+    {
+        size_t n = (size_t) val + 1;
+
+        if (!genalloc_ready (size_t, &set->pos, n))
+            return -1;
+        memset (set->pos.s + set->pos.len, 0, (n - len) * sizeof (size_t));
+        genalloc_setlen (size_t, &set->pos, n);
+    }
+
+    if (!genalloc_append (int, &set->ga, &val))
+        return -1;
+    pos_of (set, val) = genalloc_len (int, &set->ga);
+    return 1;
+}
+
+int
+remove_from_set (ga_int_set *set, int val)
+{
+    size_t i;
+    size_t last;
+
+    if (!is_in_set (set, val))
+        return 0;
+
+    i = pos_of (set, val) - 1;
+    last = genalloc_len (int, &set->ga) - 1;
+    if (i < last)
+    {
+        int moved = set_get (set, last);
+
+        genalloc_s (int, &set->ga)[i] = moved;
+        pos_of (set, moved) = i + 1;
+    }
+    genalloc_setlen (int, &set->ga, last);
+    pos_of (set, val) = 0;
+    return 1;
+}
+
+void
+set_truncate (ga_int_set *set, size_t len)
+{
+    size_t l = genalloc_len (int, &set->ga);
+
+    for ( ; l > len; --l)
+        pos_of (set, set_get (set, l - 1)) = 0;
+    genalloc_setlen (int, &set->ga, l);
+}
+
+void
+set_free (ga_int_set *set)
+{
+    genalloc_free (int, &set->ga);
+    genalloc_free (size_t, &set->pos);
+}
@@ -0,0 +1,668 @@
+/*
+ * anopa - Copyright (C) 2015-2017 Olivier Brunel
+ *
+ * graph.c
+ * Copyright (C) 2015-2017 Olivier Brunel <jjk@jjacky.com>
+ *
+ * This file is part of anopa.
+ *
+ * anopa is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * anopa is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * anopa. If not, see http://www.gnu.org/licenses/
+ */
+
+#define _BSD_SOURCE
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <skalibs/allreadwrite.h>
+#include <skalibs/djbunix.h>
+#include <skalibs/bytestr.h>
+#include <skalibs/stralloc.h>
+#include <skalibs/genalloc.h>
+#include <skalibs/direntry.h>
+#include <skalibs/types.h>
+#include <anopa/err.h>
+#include <anopa/graph.h>
+#include <anopa/scan_dir.h>
+#include <anopa/ga_list.h>
+#include <anopa/service.h>
+#include "service_internal.h"
+
+/* File format (all integers are 32bit little-endian):
+ * - header: magic (8 bytes), generation stamp (64bit digest of the servicedirs
+ *   in the repodir, by name & inode as well as the files the graph is built
+ *   from, + 32bit nb of them), nb of services, nb of names, nb of edges
+ * - services, sorted by name: name id, flags, timeout, index of first edge,
+ *   nb of needs, wants, after & before (edges are contiguous, in that order),
+ *   priority, pool (name id, or NO_ID) & its limit, logger (name id, or NO_ID)
+ * - edges: name ids
+ * - names: offsets in the string pool. Services have id 0 to nb_services - 1,
+ *   names of unknown services referenced from edges follow. Those ids are
+ *   stable for a given graph, so services can be referred to by id (gi) only.
+ * - string pool
+ *
+ * So any servicedir added/removed/renamed (or replaced) in the repodir makes it
+ * stale, while our own files there (statuses, journal, timeline...) being
+ * dot-files, (re)writing them doesn't. Same for edits to a servicedir, through
+ * the inode & mtime of its files & dirs in stamp_files, as well as those of its
+ * logger. (Not the servicedir's own mtime, as status.anopa & down are written
+ * there, by aa-start/aa-stop & s6 alike.)
+ */
+#define MAGIC               "aagraph\005"
+#define HEADER_SIZE         32
+#define SERVICE_SIZE        48
+#define OFF_STAMP           8
+#define OFF_NB_SERVICES     20
+#define OFF_NB_NAMES        24
+#define OFF_NB_EDGES        28
+#define NO_ID               0xffffffff
+
+static const char *map = NULL;
+static size_t map_len = 0;
+static uint32_t nb_services = 0;
+static uint32_t nb_names = 0;
+static const char *services;
+static const char *edges;
+static const char *names;
+static const char *pool;
+
+struct gsvc
+{
+    size_t offset_name;
+    uint32_t flags;
+    uint32_t secs_timeout;
+    size_t first;
+    int32_t priority;
+    size_t offset_pool; /* in sa_names, or -1 */
+    uint32_t pool_limit;
+    uint32_t nb[_AA_GRAPH_NB_EDGES];
+};
+
+static stralloc sa_names = STRALLOC_ZERO;
+static genalloc ga_gsvc = GENALLOC_ZERO; /* struct gsvc */
+static genalloc ga_edges = GENALLOC_ZERO; /* size_t: offset in sa_names */
+static genalloc ga_extra = GENALLOC_ZERO; /* size_t: offset in sa_names */
+
+struct stamp
+{
+    uint64_t digest;
+    uint32_t nb;
+};
+
+/* what the graph is built from in a servicedir, see _read_service_def() */
+static const char * const stamp_files[] = {
+    "run", AA_GETS_READY_FILENAME, "notification-fd",
+    "needs", "wants", "after", "before",
+    "timeout", AA_PRIORITY_FILENAME, AA_POOL_FILENAME
+};
+#define NB_STAMP_FILES      (sizeof (stamp_files) / sizeof (*stamp_files))
+
+/* FNV-1a step for the 8 bytes of u */
+static uint64_t
+fnv_u64 (uint64_t h, uint64_t u)
+{
+    int i;
+
+    for (i = 0; i < 8; ++i, u >>= 8)
+        h = (h ^ (u & 0xff)) * 1099511628211ULL;
+    return h;
+}
+
+/* adds the inode & mtime of each of stamp_files in dir (relative to fd) into
+ * h, or zeros if missing. For dirs the mtime changes when entries are
+ * added/removed. Returns 1 if dir exists, 0 if not, -1 on error */
+static int
+stamp_dir (int fd, const char *dir, uint64_t *h)
+{
+    unsigned int i;
+
+    fd = openat (fd, dir, O_RDONLY | O_DIRECTORY | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0)
+        return (errno == ENOENT || errno == ENOTDIR) ? 0 : -1;
+
+    for (i = 0; i < NB_STAMP_FILES; ++i)
+    {
+        struct stat st;
+
+        if (fstatat (fd, stamp_files[i], &st, 0) < 0)
+        {
+            if (errno != ENOENT && errno != ENOTDIR)
+            {
+                int e = errno;
+
+                fd_close (fd);
+                errno = e;
+                return -1;
+            }
+            st.st_ino = 0;
+            st.st_mtim.tv_sec = st.st_mtim.tv_nsec = 0;
+        }
+        *h = fnv_u64 (*h, (uint64_t) st.st_ino);
+        *h = fnv_u64 (*h, (uint64_t) st.st_mtim.tv_sec);
+        *h = fnv_u64 (*h, (uint64_t) st.st_mtim.tv_nsec);
+    }
+
+    fd_close (fd);
+    return 1;
+}
+
+static int
+it_stamp (direntry *d, void *data)
+{
+    struct stamp *st = data;
+    uint64_t h = 14695981039346656037ULL;
+    const char *s;
+    size_t l;
+
+    if (*d->d_name == '.' || d->d_type != DT_DIR)
+        return 0;
+
+    /* FNV-1a of the name, inode & files; summed so the order of entries is
+     * irrelevant */
+    for (s = d->d_name; *s; ++s)
+        h = (h ^ (unsigned char) *s) * 1099511628211ULL;
+    h = fnv_u64 (h, (uint64_t) d->d_ino);
+    if (stamp_dir (AT_FDCWD, d->d_name, &h) < 0)
+        return -1;
+
+    l = s - d->d_name;
+    {
+        char buf[l + 5];
+
+        byte_copy (buf, l, d->d_name);
+        byte_copy (buf + l, 5, "/log");
+        if (stamp_dir (AT_FDCWD, buf, &h) < 0)
+            return -1;
+    }
+
+    st->digest += h;
+    ++st->nb;
+    return 0;
+}
+
+/* packs the current generation stamp of the repo (from the servicedirs in it,
+ * as seen by it_repo) into s. Must be called from the repodir */
+static int
+get_stamp (char *s)
+{
+    struct stamp st = { 0, 0 };
+
+    if (aa_scan_dirat (AT_FDCWD, ".", 0, it_stamp, &st) < 0)
+        return -1;
+    uint64_pack (s, st.digest);
+    uint32_pack (s + 8, st.nb);
+    return 0;
+}
+
+static uint32_t
+get_u32 (const char *s)
+{
+    uint32_t u;
+
+    uint32_unpack (s, &u);
+    return u;
+}
+
+static const char *
+get_name (uint32_t id)
+{
+    return pool + get_u32 (names + 4 * id);
+}
+
+void
+aa_graph_free (void)
+{
+    if (map)
+        munmap ((void *) map, map_len);
+    map = NULL;
+    map_len = 0;
+    nb_services = nb_names = 0;
+}
+
+/* returns 1 if loaded, 0 if there's no (valid, up-to-date) graph, -1 on error.
+ * Must be called from the repodir */
+int
+aa_graph_load (void)
+{
+    struct stat st;
+    char stamp[12];
+    uint32_t nb_edges;
+    size_t pool_len;
+    size_t i;
+    int fd;
+
+    aa_graph_free ();
+
+    fd = open_read (AA_GRAPH_FILENAME);
+    if (fd < 0)
+        return (errno == ENOENT) ? 0 : -1;
+    if (fstat (fd, &st) < 0)
+    {
+        fd_close (fd);
+        return -1;
+    }
+    if (st.st_size < HEADER_SIZE)
+    {
+        fd_close (fd);
+        return 0;
+    }
+
+    map_len = st.st_size;
+    map = mmap (NULL, map_len, PROT_READ, MAP_PRIVATE, fd, 0);
+    fd_close (fd);
+    if (map == MAP_FAILED)
+    {
+        map = NULL;
+        return -1;
+    }
+
+    if (byte_diff (map, 8, MAGIC))
+        goto stale;
+    if (get_stamp (stamp) < 0)
+    {
+        int e = errno;
+
+        aa_graph_free ();
+        errno = e;
+        return -1;
+    }
+    if (byte_diff (map + OFF_STAMP, 12, stamp))
+        goto stale;
+
+    nb_services = get_u32 (map + OFF_NB_SERVICES);
+    nb_names = get_u32 (map + OFF_NB_NAMES);
+    nb_edges = get_u32 (map + OFF_NB_EDGES);
+    if (nb_services > nb_names
+            || (map_len - HEADER_SIZE) / SERVICE_SIZE < nb_services
+            || (map_len - HEADER_SIZE - nb_services * SERVICE_SIZE) / 4 < (size_t) nb_edges + nb_names)
+        goto stale;
+
+    services = map + HEADER_SIZE;
+    edges = services + nb_services * SERVICE_SIZE;
+    names = edges + 4 * nb_edges;
+    pool = names + 4 * nb_names;
+    pool_len = map_len - (pool - map);
+    if (pool_len == 0 || pool[pool_len - 1] != '\0')
+        goto stale;
+
+    /* make sure it's all sane, so we don't need to check anything later */
+    for (i = 0; i < nb_names; ++i)
+        if (get_u32 (names + 4 * i) >= pool_len)
+            goto stale;
+    for (i = 0; i < nb_edges; ++i)
+        if (get_u32 (edges + 4 * i) >= nb_names)
+            goto stale;
+    for (i = 0; i < nb_services; ++i)
+    {
+        const char *s = services + i * SERVICE_SIZE;
+        uint64_t n = get_u32 (s + 12);
+        int j;
+
+        if (get_u32 (s) != i
+                || (get_u32 (s + 36) != NO_ID && get_u32 (s + 36) >= nb_names)
+                || (get_u32 (s + 44) != NO_ID && get_u32 (s + 44) >= nb_services))
+            goto stale;
+        for (j = 0; j < _AA_GRAPH_NB_EDGES; ++j)
+            n += get_u32 (s + 16 + 4 * j);
+        if (n > nb_edges)
+            goto stale;
+    }
+
+    return 1;
+
+stale:
+    aa_graph_free ();
+    return 0;
+}
+
+int
+aa_graph_find (const char *name)
+{
+    uint32_t l = 0;
+    uint32_t r = nb_services;
+
+    while (l < r)
+    {
+        uint32_t m = l + (r - l) / 2;
+        int c = str_diff (name, get_name (m));
+
+        if (c == 0)
+            return (int) m;
+        else if (c < 0)
+            r = m;
+        else
+            l = m + 1;
+    }
+
+    return -1;
+}
+
+void
+aa_graph_get (int gi, aa_graph_service *gs)
+{
+    const char *s = services + gi * SERVICE_SIZE;
+    int i;
+
+    gs->name = get_name (gi);
+    gs->flags = get_u32 (s + 4);
+    gs->secs_timeout = get_u32 (s + 8);
+    gs->first = get_u32 (s + 12);
+    for (i = 0; i < _AA_GRAPH_NB_EDGES; ++i)
+        gs->nb[i] = get_u32 (s + 16 + 4 * i);
+    gs->priority = (int32_t) get_u32 (s + 32);
+    gs->pool = (get_u32 (s + 36) == NO_ID) ? NULL : get_name (get_u32 (s + 36));
+    gs->pool_limit = get_u32 (s + 40);
+    gs->log = (get_u32 (s + 44) == NO_ID) ? -1 : (int) get_u32 (s + 44);
+}
+
+static uint32_t
+get_edge_id (aa_graph_service *gs, aa_graph_edge edge, uint32_t i)
+{
+    uint32_t n = gs->first + i;
+    int j;
+
+    for (j = 0; j < edge; ++j)
+        n += gs->nb[j];
+    return get_u32 (edges + 4 * n);
+}
+
+const char *
+aa_graph_get_edge (aa_graph_service *gs, aa_graph_edge edge, uint32_t i)
+{
+    return get_name (get_edge_id (gs, edge, i));
+}
+
+/* returns the gi of the service the edge is to, or -1 if it isn't one */
+int
+aa_graph_get_edge_gi (aa_graph_service *gs, aa_graph_edge edge, uint32_t i)
+{
+    uint32_t id = get_edge_id (gs, edge, i);
+
+    return (id < nb_services) ? (int) id : -1;
+}
+
+/* writing */
+
+static size_t
+add_name (const char *name)
+{
+    size_t offset = sa_names.len;
+
+    if (!stralloc_catb (&sa_names, name, strlen (name) + 1))
+        return (size_t) -1;
+    return offset;
+}
+
+/* adds the service (as read from its servicedir) to the graph; or not, if
+ * there's anything wrong w/ it, so loading it will report that as usual */
+static int
+add_service (const char *name, struct service_def *def)
+{
+    struct gsvc gsvc = { .offset_pool = (size_t) -1 };
+    size_t l_names = sa_names.len;
+    size_t l_edges = genalloc_len (size_t, &ga_edges);
+    const char *s;
+    int i;
+
+    if (_read_service_def (name, def) < 0)
+        return -1;
+
+    gsvc.flags = def->flags;
+    gsvc.secs_timeout = def->secs_timeout;
+    gsvc.priority = def->priority;
+    gsvc.first = l_edges;
+    for (s = def->sa.s, i = 0; i < _AA_GRAPH_NB_EDGES; ++i)
+    {
+        uint32_t j;
+
+        for (j = 0; j < def->nb[i]; ++j, s += strlen (s) + 1)
+        {
+            size_t offset = add_name (s);
+
+            if (offset == (size_t) -1 || !genalloc_append (size_t, &ga_edges, &offset))
+                goto err;
+        }
+        gsvc.nb[i] = def->nb[i];
+    }
+    if (def->offset_pool != (size_t) -1)
+    {
+        gsvc.offset_pool = add_name (def->sa.s + def->offset_pool);
+        if (gsvc.offset_pool == (size_t) -1)
+            goto err;
+        gsvc.pool_limit = def->pool_limit;
+    }
+
+    gsvc.offset_name = add_name (name);
+    if (gsvc.offset_name == (size_t) -1 || !genalloc_append (struct gsvc, &ga_gsvc, &gsvc))
+        goto err;
+    return 0;
+
+err:
+    sa_names.len = l_names;
+    genalloc_setlen (size_t, &ga_edges, l_edges);
+    return -1;
+}
+
+static int
+it_repo (direntry *d, void *data)
+{
+    size_t l = strlen (d->d_name);
+    char buf[l + 5];
+    struct stat st;
+
+    if (*d->d_name == '.' || d->d_type != DT_DIR)
+        return 0;
+
+    add_service (d->d_name, data);
+
+    byte_copy (buf, l, d->d_name);
+    byte_copy (buf + l, 5, "/log");
+    if (stat (buf, &st) == 0 && S_ISDIR (st.st_mode))
+        add_service (buf, data);
+
+    return 0;
+}
+
+static int
+cmp_gsvc (const void *v1, const void *v2)
+{
+    const struct gsvc *g1 = v1;
+    const struct gsvc *g2 = v2;
+
+    return str_diff (sa_names.s + g1->offset_name, sa_names.s + g2->offset_name);
+}
+
+static int
+cmp_name (const void *v1, const void *v2)
+{
+    const char *name = v1;
+    const struct gsvc *g = v2;
+
+    return str_diff (name, sa_names.s + g->offset_name);
+}
+
+/* ids: services (sorted) first, then other names in order of first use */
+static int
+get_id (size_t offset, uint32_t *id)
+{
+    const char *name = sa_names.s + offset;
+    struct gsvc *gsvc = genalloc_s (struct gsvc, &ga_gsvc);
+    size_t nb = genalloc_len (struct gsvc, &ga_gsvc);
+    size_t n = genalloc_len (size_t, &ga_extra);
+    struct gsvc *g;
+    size_t i;
+
+    g = bsearch (name, gsvc, nb, sizeof (struct gsvc), cmp_name);
+    if (g)
+    {
+        *id = g - gsvc;
+        return 0;
+    }
+
+    for (i = 0; i < n; ++i)
+        if (str_equal (name, sa_names.s + ga_get (size_t, &ga_extra, i)))
+            break;
+    if (i == n && !genalloc_append (size_t, &ga_extra, &offset))
+        return -1;
+    *id = nb + i;
+    return 0;
+}
+
+/* id of the logger of service i, or NO_ID */
+static uint32_t
+get_log_id (size_t i)
+{
+    struct gsvc *gsvc = genalloc_s (struct gsvc, &ga_gsvc);
+    const char *name = sa_names.s + gsvc[i].offset_name;
+    size_t l = strlen (name);
+    char buf[l + 5];
+    struct gsvc *g;
+
+    if (!(gsvc[i].flags & AA_GRAPH_HAS_LOG))
+        return NO_ID;
+    byte_copy (buf, l, name);
+    byte_copy (buf + l, 5, "/log");
+    g = bsearch (buf, gsvc, genalloc_len (struct gsvc, &ga_gsvc), sizeof (struct gsvc), cmp_name);
+    return (g) ? (uint32_t) (g - gsvc) : NO_ID;
+}
+
+static int
+cat_u32 (stralloc *sa, uint32_t u)
+{
+    char buf[4];
+
+    uint32_pack (buf, u);
+    return stralloc_catb (sa, buf, 4);
+}
+
+/* (re)writes the graph of all servicedirs in the repo. Must be called from the
+ * repodir */
+int
+aa_graph_write (void)
+{
+    stralloc sa = STRALLOC_ZERO;
+    stralloc sa_pool = STRALLOC_ZERO;
+    struct service_def def = SERVICE_DEF_ZERO;
+    struct gsvc *gsvc;
+    size_t nb;
+    size_t i;
+    int r = -1;
+    int e;
+
+    sa_names.len = 0;
+    genalloc_setlen (struct gsvc, &ga_gsvc, 0);
+    genalloc_setlen (size_t, &ga_edges, 0);
+    genalloc_setlen (size_t, &ga_extra, 0);
+
+    if (!stralloc_catb (&sa, ".", 2))
+        goto end;
+    r = aa_scan_dir (&sa, 0, it_repo, &def);
+    stralloc_free (&def.sa);
+    if (r < 0)
+        goto end;
+    r = -1;
+    sa.len = 0;
+
+    nb = genalloc_len (struct gsvc, &ga_gsvc);
+    gsvc = genalloc_s (struct gsvc, &ga_gsvc);
+    qsort (gsvc, nb, sizeof (struct gsvc), cmp_gsvc);
+
+    {
+        char stamp[12];
+
+        if (get_stamp (stamp) < 0)
+            goto end;
+        if (!stralloc_catb (&sa, MAGIC, 8) || !stralloc_catb (&sa, stamp, 12))
+            goto end;
+    }
+    if (!cat_u32 (&sa, nb) || !cat_u32 (&sa, 0) /* nb_names, set below */
+            || !cat_u32 (&sa, genalloc_len (size_t, &ga_edges)))
+        goto end;
+
+    for (i = 0; i < nb; ++i)
+    {
+        int j;
+
+        if (!cat_u32 (&sa, i) || !cat_u32 (&sa, gsvc[i].flags)
+                || !cat_u32 (&sa, gsvc[i].secs_timeout) || !cat_u32 (&sa, gsvc[i].first))
+            goto end;
+        for (j = 0; j < _AA_GRAPH_NB_EDGES; ++j)
+            if (!cat_u32 (&sa, gsvc[i].nb[j]))
+                goto end;
+        if (!cat_u32 (&sa, (uint32_t) gsvc[i].priority))
+            goto end;
+        if (gsvc[i].offset_pool == (size_t) -1)
+        {
+            if (!cat_u32 (&sa, NO_ID) || !cat_u32 (&sa, 0))
+                goto end;
+        }
+        else
+        {
+            uint32_t id;
+
+            if (get_id (gsvc[i].offset_pool, &id) < 0
+                    || !cat_u32 (&sa, id) || !cat_u32 (&sa, gsvc[i].pool_limit))
+                goto end;
+        }
+        if (!cat_u32 (&sa, get_log_id (i)))
+            goto end;
+    }
+
+    for (i = 0; i < genalloc_len (size_t, &ga_edges); ++i)
+    {
+        uint32_t id;
+
+        if (get_id (ga_get (size_t, &ga_edges, i), &id) < 0 || !cat_u32 (&sa, id))
+            goto end;
+    }
+
+    for (i = 0; i < nb + genalloc_len (size_t, &ga_extra); ++i)
+    {
+        const char *name = sa_names.s + ((i < nb) ? gsvc[i].offset_name
+                : ga_get (size_t, &ga_extra, i - nb));
+
+        if (!cat_u32 (&sa, sa_pool.len)
+                || !stralloc_catb (&sa_pool, name, strlen (name) + 1))
+            goto end;
+    }
+    uint32_pack (sa.s + OFF_NB_NAMES, nb + genalloc_len (size_t, &ga_extra));
+    if (!stralloc_catb (&sa, sa_pool.s, sa_pool.len))
+        goto end;
+
+    {
+        mode_t mask;
+
+        mask = umask (0022);
+        r = (openwritenclose_suffix (AA_GRAPH_FILENAME, sa.s, sa.len, ".new")) ? 0 : -1;
+        e = errno;
+        umask (mask);
+        errno = e;
+    }
+
+end:
+    e = errno;
+    stralloc_free (&sa);
+    stralloc_free (&sa_pool);
+    genalloc_free (size_t, &ga_extra);
+    stralloc_free (&sa_names);
+    genalloc_free (struct gsvc, &ga_gsvc);
+    genalloc_free (size_t, &ga_edges);
+    errno = e;
+    return r;
+}
@@ -0,0 +1,354 @@
+/*
+ * anopa - Copyright (C) 2015-2017 Olivier Brunel
+ *
+ * journal.c
+ * Copyright (C) 2015-2017 Olivier Brunel <jjk@jjacky.com>
+ *
+ * This file is part of anopa.
+ *
+ * anopa is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * anopa is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * anopa. If not, see http://www.gnu.org/licenses/
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <skalibs/allreadwrite.h>
+#include <skalibs/djbunix.h>
+#include <skalibs/bytestr.h>
+#include <skalibs/stralloc.h>
+#include <skalibs/genalloc.h>
+#include <skalibs/types.h>
+#include <skalibs/tai.h>
+#include <anopa/service_status.h>
+#include <anopa/journal.h>
+
+/* File format: magic, then records appended one after the other, each made of
+ * its length (32bit little-endian), the status as in status.anopa (stamp, event
+ * and code), then the service name and message (both NUL-terminated) */
+#define MAGIC               "aajrnl\0\001"
+#define RECORD_FIXED_SIZE   (4 + AA_SVST_FIXED_SIZE)
+#define RECORD_MIN_SIZE     (RECORD_FIXED_SIZE + 3)
+
+static int fd_journal = -1;
+static stralloc sa_pending = STRALLOC_ZERO; /* records not yet committed */
+static stralloc sa_journal = STRALLOC_ZERO; /* as loaded */
+static genalloc ga_records = GENALLOC_ZERO; /* size_t: offsets in sa_journal,
+                                               sorted by name then offset */
+
+#define record(i)           genalloc_s (size_t, &ga_records)[i]
+#define record_name(off)    (sa_journal.s + (off) + RECORD_FIXED_SIZE)
+
+static int
+cmp_records (const void *_r1, const void *_r2)
+{
+    size_t r1 = *(const size_t *) _r1;
+    size_t r2 = *(const size_t *) _r2;
+    int c;
+
+    c = str_diff (record_name (r1), record_name (r2));
+    if (c)
+        return c;
+    return (r1 < r2) ? -1 : (r1 > r2);
+}
+
+static int
+cmp_offsets (const void *_r1, const void *_r2)
+{
+    size_t r1 = *(const size_t *) _r1;
+    size_t r2 = *(const size_t *) _r2;
+
+    return (r1 < r2) ? -1 : (r1 > r2);
+}
+
+void
+aa_journal_free (void)
+{
+    stralloc_free (&sa_journal);
+    genalloc_free (size_t, &ga_records);
+}
+
+/* returns 1 if loaded, 0 if there's none (or it isn't valid), -1 on error.
+ * Must be called from the repodir */
+int
+aa_journal_load (void)
+{
+    size_t i;
+
+    aa_journal_free ();
+
+    if (!openslurpclose (&sa_journal, AA_JOURNAL_FILENAME))
+        return (errno == ENOENT) ? 0 : -1;
+
+    if (sa_journal.len < 8 || byte_diff (sa_journal.s, 8, MAGIC))
+    {
+        aa_journal_free ();
+        return 0;
+    }
+
+    /* a record cut short (e.g. crash while appending) ends it */
+    for (i = 8; i + RECORD_MIN_SIZE <= sa_journal.len; )
+    {
+        uint32_t len;
+        size_t l;
+
+        uint32_unpack (sa_journal.s + i, &len);
+        if (len < RECORD_MIN_SIZE || len > sa_journal.len - i
+                || sa_journal.s[i + len - 1] != '\0')
+            break;
+        l = byte_chr (record_name (i), len - RECORD_FIXED_SIZE, '\0');
+        if (l == 0 || l + 1 >= len - RECORD_FIXED_SIZE)
+            break;
+
+        if (!genalloc_append (size_t, &ga_records, &i))
+        {
+            int e = errno;
+
+            aa_journal_free ();
+            errno = e;
+            return -1;
+        }
+        i += len;
+    }
+
+    qsort (ga_records.s, genalloc_len (size_t, &ga_records), sizeof (size_t), cmp_records);
+    return 1;
+}
+
+/* gets the n-th most recent record of name (0 being its latest) into svst.
+ * Returns 0, or -1 (errno ENOENT if there's none) */
+int
+aa_journal_get (aa_service_status *svst, const char *name, unsigned int n)
+{
+    size_t l = 0;
+    size_t r = genalloc_len (size_t, &ga_records);
+    size_t off;
+    const char *msg;
+    uint32_t u;
+
+    /* past the last record of name */
+    while (l < r)
+    {
+        size_t m = l + (r - l) / 2;
+
+        if (str_diff (record_name (record (m)), name) <= 0)
+            l = m + 1;
+        else
+            r = m;
+    }
+    if (l <= n || !str_equal (record_name (record (l - 1 - n)), name))
+        return (errno = ENOENT, -1);
+
+    off = record (l - 1 - n);
+    msg = record_name (off) + strlen (record_name (off)) + 1;
+    svst->sa.len = 0;
+    if (!stralloc_catb (&svst->sa, sa_journal.s + off + 4, AA_SVST_FIXED_SIZE)
+            || !stralloc_catb (&svst->sa, msg, strlen (msg) + 1))
+        return -1;
+
+    tain_unpack (svst->sa.s, &svst->stamp);
+    uint32_unpack (svst->sa.s + 12, &u);
+    svst->event = (unsigned int) u;
+    uint32_unpack (svst->sa.s + 16, &u);
+    svst->code = (int) u;
+
+    return 0;
+}
+
+/* whether the i-th record (as sorted) is one of the last AA_JOURNAL_HISTORY of
+ * its service, i.e. is kept when compacting */
+static int
+is_kept (size_t i)
+{
+    size_t len = genalloc_len (size_t, &ga_records);
+
+    return i + AA_JOURNAL_HISTORY >= len
+        || !str_equal (record_name (record (i)),
+                       record_name (record (i + AA_JOURNAL_HISTORY)));
+}
+
+/* size the journal would be once compacted */
+static size_t
+compacted_size (void)
+{
+    size_t size = 8;
+    size_t i;
+
+    for (i = 0; i < genalloc_len (size_t, &ga_records); ++i)
+        if (is_kept (i))
+        {
+            uint32_t l;
+
+            uint32_unpack (sa_journal.s + record (i), &l);
+            size += l;
+        }
+    return size;
+}
+
+/* rewrites the journal w/ only the last AA_JOURNAL_HISTORY records of each
+ * service, and reopens it */
+static int
+compact (void)
+{
+    stralloc sa = STRALLOC_ZERO;
+    genalloc ga = GENALLOC_ZERO; /* size_t: offsets of records to keep */
+    size_t len = genalloc_len (size_t, &ga_records);
+    size_t i;
+    mode_t mask;
+    int fd;
+    int r = -1;
+    int e;
+
+    for (i = 0; i < len; ++i)
+        if (is_kept (i) && !genalloc_append (size_t, &ga, &record (i)))
+            goto err;
+    qsort (ga.s, genalloc_len (size_t, &ga), sizeof (size_t), cmp_offsets);
+
+    if (!stralloc_catb (&sa, MAGIC, 8))
+        goto err;
+    for (i = 0; i < genalloc_len (size_t, &ga); ++i)
+    {
+        size_t off = genalloc_s (size_t, &ga)[i];
+        uint32_t l;
+
+        uint32_unpack (sa_journal.s + off, &l);
+        if (!stralloc_catb (&sa, sa_journal.s + off, l))
+            goto err;
+    }
+
+    mask = umask (0022);
+    r = (openwritenclose_suffix (AA_JOURNAL_FILENAME, sa.s, sa.len, ".new")) ? 0 : -1;
+    umask (mask);
+    if (r == 0)
+    {
+        fd = open (AA_JOURNAL_FILENAME, O_WRONLY | O_APPEND | O_CLOEXEC);
+        if (fd < 0)
+            r = -1;
+        else
+        {
+            fd_close (fd_journal);
+            fd_journal = fd;
+        }
+    }
+
+err:
+    e = errno;
+    stralloc_free (&sa);
+    genalloc_free (size_t, &ga);
+    errno = e;
+    return r;
+}
+
+/* opens the journal to append records to, creating it if create is set. It is
+ * loaded as well, and compacted when needed.
+ * Returns 1 if it is to be used, 0 if not (there's none), -1 on error.
+ * Must be called from the repodir */
+int
+aa_journal_open (int create)
+{
+    int r;
+    int e;
+
+    fd_journal = open (AA_JOURNAL_FILENAME,
+            O_WRONLY | O_APPEND | O_CLOEXEC | ((create) ? O_CREAT : 0), 0644);
+    if (fd_journal < 0)
+        return (!create && errno == ENOENT) ? 0 : -1;
+
+    r = aa_journal_load ();
+    if (r < 0)
+        goto err;
+    /* new (or invalid), else grown too big: twice its compacted size, so it
+     * isn't rewritten on every open once that alone is over the limit */
+    if ((r == 0 || (sa_journal.len > AA_JOURNAL_COMPACT_SIZE
+                    && sa_journal.len / 2 > compacted_size ()))
+            && (compact () < 0 || aa_journal_load () <= 0))
+        goto err;
+
+    return 1;
+
+err:
+    e = errno;
+    fd_close (fd_journal);
+    fd_journal = -1;
+    errno = e;
+    return -1;
+}
+
+/* queues a record w/ the status of name, written on next commit.
+ * Returns 1 if queued, 0 if there's no journal in use, -1 on error */
+int
+aa_journal_append (aa_service_status *svst, const char *name)
+{
+    char buf[RECORD_FIXED_SIZE];
+    const char *msg = aa_service_status_get_msg (svst);
+    size_t l_name = strlen (name) + 1;
+    size_t l_msg;
+    size_t len = sa_pending.len;
+
+    if (fd_journal < 0)
+        return 0;
+
+    if (!msg)
+        msg = "";
+    l_msg = strlen (msg) + 1;
+
+    uint32_pack (buf, (uint32_t) (RECORD_FIXED_SIZE + l_name + l_msg));
+    tain_pack (buf + 4, &svst->stamp);
+    uint32_pack (buf + 16, (uint32_t) svst->event);
+    uint32_pack (buf + 20, (uint32_t) svst->code);
+    if (!stralloc_catb (&sa_pending, buf, RECORD_FIXED_SIZE)
+            || !stralloc_catb (&sa_pending, name, l_name)
+            || !stralloc_catb (&sa_pending, msg, l_msg))
+    {
+        sa_pending.len = len;
+        return -1;
+    }
+
+    return 1;
+}
+
+/* writes all queued records at once, then syncs (group commit) */
+int
+aa_journal_commit (void)
+{
+    if (fd_journal < 0 || sa_pending.len == 0)
+        return 0;
+
+    if (allwrite (fd_journal, sa_pending.s, sa_pending.len) < sa_pending.len
+            || fsync (fd_journal) < 0)
+        return -1;
+
+    sa_pending.len = 0;
+    return 0;
+}
+
+int
+aa_journal_close (void)
+{
+    int r;
+    int e;
+
+    r = aa_journal_commit ();
+    e = errno;
+    if (fd_journal >= 0)
+        fd_close (fd_journal);
+    fd_journal = -1;
+    stralloc_free (&sa_pending);
+    aa_journal_free ();
+    errno = e;
+    return r;
+}
@@ -0,0 +1,197 @@
+/*
+ * anopa - Copyright (C) 2015-2017 Olivier Brunel
+ *
+ * prefetch.c
+ * Copyright (C) 2015-2017 Olivier Brunel <jjk@jjacky.com>
+ *
+ * This file is part of anopa.
+ *
+ * anopa is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * anopa is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * anopa. If not, see http://www.gnu.org/licenses/
+ */
+
+#include <stdint.h>
+#include <skalibs/bytestr.h>
+#include <skalibs/stralloc.h>
+#include <skalibs/genalloc.h>
+#include <anopa/graph.h>
+#include <anopa/prefetch.h>
+#include "service_internal.h"
+
+/* Loading services is serial & recursive: a servicedir is only read once its
+ * dependent's was, so all that I/O is waited on one at a time. Instead,
+ * aa_prefetch_run() (prefetch_run.c, so only it needs threads) reads service
+ * definitions beforehand, starting from the names given to aa_prefetch_add()
+ * and following needs, wants & loggers.
+ * Loading then uses those the same way it uses the graph. Services that
+ * couldn't be read cleanly aren't used, so reading them (and reporting any
+ * errors/warnings) happens when loading, as usual.
+ */
+
+#define HASH_MIN_SIZE       64
+
+struct pf
+{
+    size_t offset_name; /* in sa_names */
+    int ok;
+    struct service_def def;
+};
+
+static stralloc sa_names = STRALLOC_ZERO;
+static genalloc ga_pf = GENALLOC_ZERO; /* struct pf, in order of adding */
+static genalloc ga_hash = GENALLOC_ZERO; /* int: index in ga_pf, or -1 */
+
+#define pf_get(n)       (&genalloc_s (struct pf, &ga_pf)[n])
+
+static int
+hash_find (const char *name)
+{
+    size_t size = genalloc_len (int, &ga_hash);
+    size_t i;
+
+    if (size == 0)
+        return -1;
+
+    for (i = _hash_name (name) & (size - 1); ; i = (i + 1) & (size - 1))
+    {
+        int n = genalloc_s (int, &ga_hash)[i];
+
+        if (n < 0 || str_equal (name, sa_names.s + pf_get (n)->offset_name))
+            return n;
+    }
+}
+
+static void
+hash_put (int n)
+{
+    size_t size = genalloc_len (int, &ga_hash);
+    size_t i;
+
+    i = _hash_name (sa_names.s + pf_get (n)->offset_name) & (size - 1);
+    while (genalloc_s (int, &ga_hash)[i] >= 0)
+        i = (i + 1) & (size - 1);
+    genalloc_s (int, &ga_hash)[i] = n;
+}
+
+/* queues name to be read, unless already known. Not thread-safe: workers must
+ * hold their lock. On failure, it simply won't be prefetched */
+int
+_prefetch_add (const char *name)
+{
+    struct pf pf = { .ok = 0, .def = SERVICE_DEF_ZERO };
+    size_t nb = genalloc_len (struct pf, &ga_pf);
+    size_t size = genalloc_len (int, &ga_hash);
+
+    if (!_is_valid_service_name (name, strlen (name)) || hash_find (name) >= 0)
+        return 0;
+
+    /* keep the hash table at most half full */
+    if (2 * (nb + 1) > size)
+    {
+        size_t i;
+
+        size = (size) ? 2 * size : HASH_MIN_SIZE;
+        if (!genalloc_ready (int, &ga_hash, size))
+            return -1;
+        genalloc_setlen (int, &ga_hash, size);
+        for (i = 0; i < size; ++i)
+            genalloc_s (int, &ga_hash)[i] = -1;
+        for (i = 0; i < nb; ++i)
+            hash_put (i);
+    }
+
+    pf.offset_name = sa_names.len;
+    if (!stralloc_catb (&sa_names, name, strlen (name) + 1))
+        return -1;
+    if (!genalloc_append (struct pf, &ga_pf, &pf))
+    {
+        sa_names.len = pf.offset_name;
+        return -1;
+    }
+    hash_put (nb);
+    return 0;
+}
+
+int
+aa_prefetch_add (const char *name)
+{
+    return _prefetch_add (name);
+}
+
+size_t
+_prefetch_nb (void)
+{
+    return genalloc_len (struct pf, &ga_pf);
+}
+
+const char *
+_prefetch_name (size_t n)
+{
+    return sa_names.s + pf_get (n)->offset_name;
+}
+
+/* takes ownership of def */
+void
+_prefetch_set (size_t n, struct service_def *def)
+{
+    pf_get (n)->ok = 1;
+    pf_get (n)->def = *def;
+}
+
+/* only valid once aa_prefetch_run() returned. Returns 1 if name was prefetched
+ * (gs then filled, edges pointing to the names of all its edges, in order),
+ * else 0 */
+int
+aa_prefetch_get (const char *name, aa_graph_service *gs, const char **edges)
+{
+    struct pf *pf;
+    int n;
+    int i;
+
+    n = hash_find (name);
+    if (n < 0 || !pf_get (n)->ok)
+        return 0;
+
+    pf = pf_get (n);
+    if (gs)
+    {
+        gs->name = sa_names.s + pf->offset_name;
+        gs->flags = pf->def.flags;
+        gs->secs_timeout = pf->def.secs_timeout;
+        gs->first = 0;
+        for (i = 0; i < _AA_GRAPH_NB_EDGES; ++i)
+            gs->nb[i] = pf->def.nb[i];
+        gs->priority = pf->def.priority;
+        gs->pool = (pf->def.offset_pool == (size_t) -1) ? NULL
+            : pf->def.sa.s + pf->def.offset_pool;
+        gs->pool_limit = pf->def.pool_limit;
+        gs->log = -1;
+    }
+    if (edges)
+        *edges = pf->def.sa.s;
+    return 1;
+}
+
+static void
+free_pf (struct pf *pf)
+{
+    stralloc_free (&pf->def.sa);
+}
+
+void
+aa_prefetch_free (void)
+{
+    genalloc_deepfree (struct pf, &ga_pf, free_pf);
+    genalloc_free (int, &ga_hash);
+    stralloc_free (&sa_names);
+}
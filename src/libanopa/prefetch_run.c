@@ -0,0 +1,126 @@
+/*
+ * anopa - Copyright (C) 2015-2017 Olivier Brunel
+ *
+ * prefetch_run.c
+ * Copyright (C) 2015-2017 Olivier Brunel <jjk@jjacky.com>
+ *
+ * This file is part of anopa.
+ *
+ * anopa is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * anopa is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * anopa. If not, see http://www.gnu.org/licenses/
+ */
+
+#include <stdint.h>
+#include <pthread.h>
+#include <skalibs/bytestr.h>
+#include <skalibs/stralloc.h>
+#include <anopa/graph.h>
+#include <anopa/prefetch.h>
+#include "service_internal.h"
+
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static size_t next = 0; /* first queued one not yet read */
+static unsigned int busy = 0; /* nb of workers reading one */
+static int with_wants = 1;
+
+static void
+add_deps (const char *name, struct service_def *def)
+{
+    const char *s = def->sa.s;
+    uint32_t i;
+
+    for (i = 0; i < def->nb[AA_GRAPH_NEEDS]; ++i, s += strlen (s) + 1)
+        _prefetch_add (s);
+    for (i = 0; with_wants && i < def->nb[AA_GRAPH_WANTS]; ++i, s += strlen (s) + 1)
+        _prefetch_add (s);
+
+    if (def->flags & AA_GRAPH_HAS_LOG)
+    {
+        size_t l = strlen (name);
+        char buf[l + 5];
+
+        byte_copy (buf, l, name);
+        byte_copy (buf + l, 5, "/log");
+        _prefetch_add (buf);
+    }
+}
+
+static void *
+worker (void *data)
+{
+    stralloc sa = STRALLOC_ZERO;
+
+    (void) data;
+    pthread_mutex_lock (&mutex);
+    for (;;)
+    {
+        struct service_def def = SERVICE_DEF_ZERO;
+        size_t n;
+        int ok;
+
+        if (next >= _prefetch_nb ())
+        {
+            /* nothing left to read, nor anyone who could queue more */
+            if (busy == 0)
+                break;
+            pthread_cond_wait (&cond, &mutex);
+            continue;
+        }
+
+        n = next++;
+        ++busy;
+        /* names could be moved by another worker once we unlock */
+        sa.len = 0;
+        ok = stralloc_cats (&sa, _prefetch_name (n)) && stralloc_0 (&sa);
+        pthread_mutex_unlock (&mutex);
+
+        if (ok)
+            ok = _read_service_def (sa.s, &def) == 0;
+
+        pthread_mutex_lock (&mutex);
+        --busy;
+        if (ok)
+        {
+            _prefetch_set (n, &def);
+            add_deps (sa.s, &def);
+        }
+        else
+            stralloc_free (&def.sa);
+        pthread_cond_broadcast (&cond);
+    }
+    pthread_cond_broadcast (&cond);
+    pthread_mutex_unlock (&mutex);
+
+    stralloc_free (&sa);
+    return NULL;
+}
+
+/* reads all queued services (& their dependencies), returning once done. Must
+ * be called from the repodir */
+void
+aa_prefetch_run (unsigned int nb_threads, int no_wants)
+{
+    pthread_t tid[nb_threads];
+    unsigned int n;
+
+    with_wants = !no_wants;
+    for (n = 0; n < nb_threads; ++n)
+        if (pthread_create (&tid[n], NULL, worker, NULL) != 0)
+            break;
+    /* couldn't get any thread: nothing gets prefetched, services will just be
+     * read when loading them */
+    while (n > 0)
+        pthread_join (tid[--n], NULL);
+}
+
@@ -24,25 +24,33 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <fcntl.h>
 #include <errno.h>
+#include <skalibs/djbunix.h>
 #include <skalibs/direntry.h>
 #include <skalibs/stralloc.h>
 #include <anopa/err.h>
 #include <anopa/scan_dir.h>
 
 
-/* breaking the rule here: we get a stralloc* but we don't own it, it's just so
- * we can use it if needed to stat() */
+/* scan directory path, relative to fd (or AT_FDCWD); entries of unknown type
+ * are checked via fstatat() on the directory's own fd */
 int
-aa_scan_dir (stralloc *sa, int files_only, aa_sd_it_fn iterator, void *data)
+aa_scan_dirat (int fd, const char *path, int files_only, aa_sd_it_fn iterator, void *data)
 {
     DIR *dir;
     int e = 0;
     int r = 0;
 
-    dir = opendir (sa->s);
+    fd = openat (fd, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+        return -ERR_IO;
+    dir = fdopendir (fd);
     if (!dir)
+    {
+        fd_close (fd);
         return -ERR_IO;
+    }
 
     for (;;)
     {
@@ -61,16 +69,8 @@ aa_scan_dir (stralloc *sa, int files_only, aa_sd_it_fn iterator, void *data)
         if (d->d_type == DT_UNKNOWN)
         {
             struct stat st;
-            size_t l;
-            int rr;
 
-            l = sa->len;
-            sa->s[l - 1] = '/';
-            stralloc_catb (sa, d->d_name, strlen (d->d_name) + 1);
-            rr = stat (sa->s, &st);
-            sa->len = l;
-            sa->s[l - 1] = '\0';
-            if (rr != 0)
+            if (fstatat (fd, d->d_name, &st, 0) != 0)
                 continue;
             if (S_ISREG (st.st_mode))
                 d->d_type = DT_REG;
@@ -99,3 +99,11 @@ aa_scan_dir (stralloc *sa, int files_only, aa_sd_it_fn iterator, void *data)
     }
     return r;
 }
+
+/* breaking the rule here: we get a stralloc* but we don't own it; callers
+ * usually do, to build paths from within their iterator */
+int
+aa_scan_dir (stralloc *sa, int files_only, aa_sd_it_fn iterator, void *data)
+{
+    return aa_scan_dirat (AT_FDCWD, sa->s, files_only, iterator, data);
+}
@@ -20,8 +20,10 @@
  * anopa. If not, see http://www.gnu.org/licenses/
  */
 
+#include <stdint.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <errno.h>
 #include <skalibs/djbunix.h> /* fd_close() */
 #include <skalibs/stralloc.h>
@@ -31,30 +33,74 @@
 #include <skalibs/types.h>
 #include <skalibs/tai.h>
 #include <s6/supervise.h>
-#include <s6/ftrigr.h>
 #include <anopa/service.h>
 #include <anopa/ga_int_list.h>
 #include <anopa/scan_dir.h>
 #include <anopa/err.h>
 #include <anopa/output.h>
+#include <anopa/graph.h>
+#include <anopa/prefetch.h>
+#include <anopa/durations.h>
 #include "service_internal.h"
 
 #define NOTIFICATION_FILENAME       "notification-fd"
+#define HASH_MIN_SIZE               64
+#define DIRFD_CACHE_SIZE            256
 
 static aa_close_fd_fn close_fd;
 
+/* services w/ a cached fd_dir, in order of opening (FIFO); once full, the
+ * oldest one gets closed to make room, so we stay well within RLIMIT_NOFILE */
+static int dirfd_cache[DIRFD_CACHE_SIZE];
+static unsigned int dirfd_nb = 0;
+static unsigned int dirfd_head = 0;
+
+/* queues for the scheduler: services ready to be exec-ed (i.e. all their
+ * after-s are done), a binary heap so the one with the highest priority, then
+ * longest critical path goes first (ties in order of arrival); and services
+ * done whose dependents are yet to be processed (FIFO) */
+struct ready
+{
+    int si;
+    unsigned int seq;
+};
+static genalloc ga_ready = GENALLOC_ZERO; /* struct ready */
+static unsigned int ready_seq = 0;
+static genalloc ga_done = GENALLOC_ZERO;
+static size_t done_head = 0;
+
+/* slots of aa_oneshots not in use (always ready to hold them all, so releasing
+ * one can't fail) */
+static genalloc ga_free_oneshots = GENALLOC_ZERO; /* int */
+
+/* si of services from the graph, by gi (or -1 if not loaded); edges read from
+ * the graph are resolved through it, only loading new ones by name */
+static genalloc ga_gi = GENALLOC_ZERO; /* int */
+
 static void
 free_service (aa_service *s)
 {
-    genalloc_free (int, &s->needs);
-    genalloc_free (int, &s->wants);
-    genalloc_free (int, &s->after);
+    _unsubscribe (s);
     aa_service_status_free (&s->st);
-    if (s->fd_out > 0)
-        close_fd (s->fd_out);
-    if (s->fd_progress > 0)
-        close_fd (s->fd_progress);
-    stralloc_free (&s->sa_out);
+    if (s->fd_dir >= 0)
+        fd_close (s->fd_dir);
+    if (s->oi >= 0)
+    {
+        aa_oneshot *os = aa_oneshot (s);
+
+        if (os->fd_out > 0)
+            close_fd (os->fd_out);
+        if (os->fd_pid > 0)
+            close_fd (os->fd_pid);
+        if (os->fd_progress > 0)
+            close_fd (os->fd_progress);
+    }
+}
+
+static void
+free_oneshot (aa_oneshot *os)
+{
+    stralloc_free (&os->sa_out);
 }
 
 void
@@ -65,6 +111,63 @@ aa_free_services (aa_close_fd_fn _close_fd)
     else
         close_fd = (aa_close_fd_fn) fd_close;
     genalloc_deepfree (aa_service, &aa_services, free_service);
+    genalloc_deepfree (aa_oneshot, &aa_oneshots, free_oneshot);
+    genalloc_free (int, &ga_free_oneshots);
+    genalloc_free (int, &ga_gi);
+    genalloc_free (int, &aa_edge_pool);
+    genalloc_free (int, &_aa_hash);
+    genalloc_free (struct ready, &ga_ready);
+    genalloc_free (int, &ga_done);
+    ready_seq = 0;
+    done_head = 0;
+    dirfd_nb = dirfd_head = 0;
+}
+
+/* gets si a slot for its oneshot state, reusing one if possible */
+int
+_new_oneshot (int si)
+{
+    aa_oneshot os = {
+        .pid = 0,
+        .fd_pid = -1,
+        .fd_in = -1,
+        .fd_out = -1,
+        .sa_out = STRALLOC_ZERO,
+        .fd_progress = -1,
+        .pi = -1
+    };
+    aa_service *s = aa_service (si);
+    size_t l = genalloc_len (int, &ga_free_oneshots);
+
+    if (l > 0)
+    {
+        s->oi = list_get (&ga_free_oneshots, l - 1);
+        genalloc_setlen (int, &ga_free_oneshots, l - 1);
+        /* keep its buffer */
+        os.sa_out = aa_oneshot (s)->sa_out;
+        os.sa_out.len = 0;
+        *aa_oneshot (s) = os;
+        return 0;
+    }
+
+    l = genalloc_len (aa_oneshot, &aa_oneshots) + 1;
+    if (!genalloc_ready (int, &ga_free_oneshots, l)
+            || !genalloc_append (aa_oneshot, &aa_oneshots, &os))
+        return (errno = ENOMEM, -1);
+    s->oi = l - 1;
+    return 0;
+}
+
+/* once the oneshot is done (and all its fds closed), its slot can be reused */
+void
+aa_oneshot_release (int si)
+{
+    aa_service *s = aa_service (si);
+
+    if (s->oi < 0)
+        return;
+    genalloc_append (int, &ga_free_oneshots, &s->oi);
+    s->oi = -1;
 }
 
 size_t
@@ -76,95 +179,244 @@ aa_add_name (const char *name)
     return offset;
 }
 
+uint32_t
+_hash_name (const char *name)
+{
+    /* FNV-1a */
+    uint32_t h = 2166136261U;
+
+    for ( ; *name; ++name)
+        h = (h ^ (unsigned char) *name) * 16777619U;
+    return h;
+}
+
 static int
-get_new_service (const char *name)
+hash_find (const char *name)
+{
+    size_t size = genalloc_len (int, &_aa_hash);
+    size_t i;
+
+    if (size == 0)
+        return -1;
+
+    for (i = _hash_name (name) & (size - 1); ; i = (i + 1) & (size - 1))
+    {
+        int si = list_get (&_aa_hash, i);
+
+        if (si < 0 || str_equal (name, aa_service_name (aa_service (si))))
+            return si;
+    }
+}
+
+static void
+hash_put (int si)
+{
+    size_t size = genalloc_len (int, &_aa_hash);
+    size_t i;
+
+    i = _hash_name (aa_service_name (aa_service (si))) & (size - 1);
+    while (list_get (&_aa_hash, i) >= 0)
+        i = (i + 1) & (size - 1);
+    genalloc_s (int, &_aa_hash)[i] = si;
+}
+
+/* makes sure there's room for one more service in the hash table (kept at most
+ * half full), growing (and rehashing all services) if needed */
+static int
+hash_ready (void)
+{
+    size_t nb = genalloc_len (aa_service, &aa_services);
+    size_t size = genalloc_len (int, &_aa_hash);
+    size_t i;
+
+    if (2 * (nb + 1) <= size)
+        return 1;
+
+    size = (size) ? 2 * size : HASH_MIN_SIZE;
+    if (!genalloc_ready (int, &_aa_hash, size))
+        return 0;
+    genalloc_setlen (int, &_aa_hash, size);
+    for (i = 0; i < size; ++i)
+        genalloc_s (int, &_aa_hash)[i] = -1;
+    for (i = 0; i < nb; ++i)
+        hash_put (i);
+
+    return 1;
+}
+
+static int
+open_dir (const char *name)
+{
+    return openat (AT_FDCWD, name, O_RDONLY | O_DIRECTORY | O_NONBLOCK | O_CLOEXEC);
+}
+
+static void
+cache_dirfd (int si, int fd)
+{
+    if (dirfd_nb < DIRFD_CACHE_SIZE)
+        dirfd_cache[dirfd_nb++] = si;
+    else
+    {
+        aa_service *old = aa_service (dirfd_cache[dirfd_head]);
+
+        fd_close (old->fd_dir);
+        old->fd_dir = -1;
+        dirfd_cache[dirfd_head] = si;
+        dirfd_head = (dirfd_head + 1) % DIRFD_CACHE_SIZE;
+    }
+    aa_service (si)->fd_dir = fd;
+}
+
+/* returns the fd of the servicedir of si (opened if needed), or -1. Since it
+ * might get closed to make room for another one, it should only be used right
+ * away, never kept across calls that could load other services */
+int
+_service_dirfd (int si)
+{
+    int fd;
+
+    if (aa_service (si)->fd_dir >= 0)
+        return aa_service (si)->fd_dir;
+
+    fd = open_dir (aa_service_name (aa_service (si)));
+    if (fd < 0)
+        return -1;
+    cache_dirfd (si, fd);
+    return fd;
+}
+
+/* makes sure gi can be set in ga_gi */
+static int
+gi_ready (int gi)
+{
+    size_t len = genalloc_len (int, &ga_gi);
+    size_t i;
+
+    if ((size_t) gi < len)
+        return 1;
+    if (!genalloc_ready (int, &ga_gi, gi + 1))
+        return 0;
+    for (i = len; i <= (size_t) gi; ++i)
+        genalloc_s (int, &ga_gi)[i] = -1;
+    genalloc_setlen (int, &ga_gi, gi + 1);
+    return 1;
+}
+
+/* gi: its id in the graph if known, else -1 to look it up */
+static int
+get_new_service (const char *name, int gi)
 {
     aa_service s = {
         .nb_mark = 0,
-        .needs = GENALLOC_ZERO,
-        .wants = GENALLOC_ZERO,
-        .after = GENALLOC_ZERO,
+        .needs = AA_EDGES_ZERO,
+        .wants = AA_EDGES_ZERO,
+        .after = AA_EDGES_ZERO,
+        .dependents = AA_EDGES_ZERO,
+        .fd_dir = -1,
+        .nb_after = 0,
+        .priority = 0,
+        .offset_pool = (size_t) -1,
+        .pool_limit = 0,
+        .crit = 0,
         .ls = AA_LOAD_NOT,
         .st.event = AA_EVT_NONE,
         .st.sa = STRALLOC_ZERO,
         .st.type = AA_TYPE_UNKNOWN,
-        .ft_id = 0,
-        .sa_out = STRALLOC_ZERO,
-        .pi = -1
+        .ti = -1,
+        .oi = -1,
+        .fd_event = -1
     };
-    struct stat st;
+    int fd = -1;
+    int si;
 
     if (!_is_valid_service_name (name, strlen (name)))
         return -ERR_INVALID_NAME;
 
-    if (stat (name, &st) < 0)
+    /* if it's in the graph or was prefetched, we know it exists; else opening
+     * its servicedir tells us, and we keep the fd for the lookups to follow */
+    s.gi = (gi >= 0) ? gi : aa_graph_find (name);
+    if (s.gi < 0 && !aa_prefetch_get (name, NULL, NULL))
     {
-        if (errno == ENOENT)
-            return -ERR_UNKNOWN;
-        else
-            return -ERR_IO;
+        fd = open_dir (name);
+        if (fd < 0)
+            return (errno == ENOENT) ? -ERR_UNKNOWN : -ERR_IO;
     }
-    else if (!S_ISDIR (st.st_mode))
-        return (errno = ENOTDIR, -ERR_IO);
 
+    if (!hash_ready () || (s.gi >= 0 && !gi_ready (s.gi)))
+        goto nomem;
     s.offset_name = aa_add_name (name);
     if (s.offset_name == (size_t) -1)
-        return (errno = ENOMEM, -ERR_UNKNOWN);
-    genalloc_append (aa_service, &aa_services, &s);
-    return genalloc_len (aa_service, &aa_services) - 1;
+        goto nomem;
+    if (!genalloc_append (aa_service, &aa_services, &s))
+        goto nomem;
+    si = genalloc_len (aa_service, &aa_services) - 1;
+    hash_put (si);
+    if (s.gi >= 0)
+        genalloc_s (int, &ga_gi)[s.gi] = si;
+    if (fd >= 0)
+        cache_dirfd (si, fd);
+    return si;
+
+nomem:
+    if (fd >= 0)
+        fd_close (fd);
+    return (errno = ENOMEM, -ERR_UNKNOWN);
 }
 
 static int
-get_from_list (genalloc *list, const char *name)
-{
-    size_t l = genalloc_len (int, list);
-    size_t i;
-
-    for (i = 0; i < l; ++i)
-        if (!str_diff (name, aa_service_name (aa_service (list_get (list, i)))))
-            return list_get (list, i);
-
-    return -1;
-}
-
-int
-aa_get_service (const char *name, int *si, int new_in_main)
+get_service (const char *name, int gi, int *si, int new_in_main)
 {
-    *si = get_from_list (&aa_main_list, name);
-    if (*si >= 0)
-        return AA_SERVICE_FROM_MAIN;
-
-    *si = get_from_list (&aa_tmp_list, name);
+    /* all services ever loaded are in the hash table, and those from the graph
+     * also in ga_gi; those not in the main list are in the tmp one */
+    if (gi >= 0)
+        *si = ((size_t) gi < genalloc_len (int, &ga_gi)) ? list_get (&ga_gi, gi) : -1;
+    else
+        *si = hash_find (name);
     if (*si >= 0)
-        return AA_SERVICE_FROM_TMP;
+        return (is_in_set (&aa_main_list, *si)) ? AA_SERVICE_FROM_MAIN : AA_SERVICE_FROM_TMP;
 
-    *si = get_new_service (name);
+    *si = get_new_service (name, gi);
     if (*si < 0)
         return *si;
 
     if (new_in_main)
     {
-        add_to_list (&aa_main_list, *si, 0);
+        add_to_set (&aa_main_list, *si);
         return AA_SERVICE_FROM_MAIN;
     }
     else
     {
-        add_to_list (&aa_tmp_list, *si, 0);
+        add_to_set (&aa_tmp_list, *si);
         return AA_SERVICE_FROM_TMP;
     }
 }
 
+int
+aa_get_service (const char *name, int *si, int new_in_main)
+{
+    return get_service (name, -1, si, new_in_main);
+}
+
+/* same as aa_get_service(), using the gi from it_data if known (i.e. the name
+ * comes from an edge in the graph) */
+int
+_get_service (const char *name, struct it_data *it_data, int *si, int new_in_main)
+{
+    return get_service (name, it_data->gi, si, new_in_main);
+}
+
 static int
-contains_fd (const char *filename)
+contains_fd (int si)
 {
     char buf[UINT_FMT + 1];
     ssize_t r;
 
-    r = openreadnclose_nb (filename, buf, UINT_FMT);
+    r = _readat (_service_dirfd (si), NOTIFICATION_FILENAME, buf, UINT_FMT);
     if (r < 0)
     {
         if (errno != ENOENT)
-            aa_strerr_warnu2sys ("open ", filename);
+            aa_strerr_warnu4sys ("open ", aa_service_name (aa_service (si)),
+                    "/", NOTIFICATION_FILENAME);
         return 0;
     }
 
@@ -174,7 +426,8 @@ contains_fd (const char *filename)
         buf[byte_chr (buf, i, '\n')] = '\0';
         if (!uint0_scan (buf, &i))
         {
-            aa_strerr_warn2x ("invalid ", filename);
+            aa_strerr_warn4x ("invalid ", aa_service_name (aa_service (si)),
+                    "/", NOTIFICATION_FILENAME);
             return 0;
         }
     }
@@ -182,17 +435,17 @@ contains_fd (const char *filename)
     return 1;
 }
 
-int
-aa_preload_service (int si)
+static int
+preload_from_fs (int si)
 {
     aa_service_status *svst = &aa_service (si)->st;
-    size_t l_sn = strlen (aa_service_name (aa_service (si)));
-    char buf[l_sn + 1 + sizeof (NOTIFICATION_FILENAME)];
+    int fd;
 
-    byte_copy (buf, l_sn, aa_service_name (aa_service (si)));
-    byte_copy (buf + l_sn, 5, "/run");
+    fd = _service_dirfd (si);
+    if (fd < 0)
+        return -ERR_IO;
 
-    if (access (buf, F_OK) < 0)
+    if (faccessat (fd, "run", F_OK, 0) < 0)
     {
         if (errno != ENOENT)
             return -ERR_IO;
@@ -204,29 +457,314 @@ aa_preload_service (int si)
         svst->type = AA_TYPE_LONGRUN;
         aa_service (si)->gets_ready = 0;
 
-        byte_copy (buf + l_sn, 1 + sizeof (AA_GETS_READY_FILENAME), "/" AA_GETS_READY_FILENAME);
-        if (access (buf, F_OK) == 0)
+        if (faccessat (fd, AA_GETS_READY_FILENAME, F_OK, 0) == 0)
             aa_service (si)->gets_ready = 1;
+        else if (faccessat (fd, NOTIFICATION_FILENAME, F_OK, 0) == 0 && contains_fd (si))
+            aa_service (si)->gets_ready = 1;
+    }
+
+    return 0;
+}
+
+int
+aa_preload_service (int si)
+{
+    aa_graph_service gs;
+
+    if (aa_service (si)->gi >= 0)
+        aa_graph_get (aa_service (si)->gi, &gs);
+    else if (!aa_prefetch_get (aa_service_name (aa_service (si)), &gs, NULL))
+        return preload_from_fs (si);
+
+    aa_service (si)->st.type = (gs.flags & AA_GRAPH_LONGRUN) ? AA_TYPE_LONGRUN : AA_TYPE_ONESHOT;
+    aa_service (si)->gets_ready = !!(gs.flags & AA_GRAPH_GETS_READY);
+    return 0;
+}
+
+static void
+set_timeout (int si, aa_mode mode, int has_timeout, unsigned int secs)
+{
+    if (!has_timeout)
+        secs = aa_secs_timeout;
+    /* in STOP_ALL the default is also a maximum */
+    else if ((mode & AA_MODE_STOP_ALL) && (secs > aa_secs_timeout || secs == 0))
+        secs = aa_secs_timeout;
+    aa_service (si)->secs_timeout = secs;
+}
+
+/* pool file: its name, optionally followed by the max number of its services
+ * to be exec-ed at once (defaults to 1); only the first line is used.
+ * Returns 0 (name is then NUL-terminated in s), or -1 if invalid */
+int
+_parse_pool (char *s, const char **name, unsigned int *limit)
+{
+    size_t l;
+
+    s[str_chr (s, '\n')] = '\0';
+    l = str_chr (s, ' ');
+    if (l == 0)
+        return -1;
+    *name = s;
+    *limit = 1;
+    if (s[l] != '\0')
+    {
+        s[l] = '\0';
+        for (s += l + 1; *s == ' '; ++s)
+            ;
+        if (*s != '\0' && (!uint0_scan (s, limit) || *limit == 0))
+            return -1;
+    }
+
+    return 0;
+}
+
+static int
+set_pool (int si, const char *name, unsigned int limit)
+{
+    size_t offset = aa_add_name (name);
+
+    if (offset == (size_t) -1)
+        return (errno = ENOMEM, -1);
+    aa_service (si)->offset_pool = offset;
+    aa_service (si)->pool_limit = limit;
+    return 0;
+}
+
+static int
+load_from_fs (int si, aa_mode mode, int no_wants, struct it_data *it_data)
+{
+    const char *name = aa_service_name (aa_service (si));
+    size_t l_sn = strlen (name);
+    int r;
+
+    /* all lookups are done relative to the servicedir's fd, which we ask for
+     * every time as loading other services (from iterators) can close it */
+
+    /* special case: for a longrun that's not a logger, we check if it has one,
+     * and if so auto-add needs & after on said logger */
+    if (aa_service (si)->st.type == AA_TYPE_LONGRUN
+            /* because the only slashes allowed in a service name are for
+             * loggers, i.e. xxxx/log */
+            && (l_sn < 5 || name[l_sn - 4] != '/'))
+    {
+        r = faccessat (_service_dirfd (si), "log/run", F_OK, 0);
+        if (r < 0 && (errno != ENOTDIR && errno != ENOENT))
+            return -ERR_IO;
+
+        if (r == 0)
+        {
+            char buf[l_sn + 5];
+
+            byte_copy (buf, l_sn, name);
+            byte_copy (buf + l_sn, 5, "/log");
+            if (mode & AA_MODE_START)
+                r = _name_start_needs (buf, it_data);
+            else
+                r = _name_stop_needs (buf, it_data);
+            if (r < 0)
+                return r;
+        }
+    }
+
+    r = aa_scan_dirat (_service_dirfd (si), "needs", 1,
+            (mode & AA_MODE_START) ? _it_start_needs : _it_stop_needs,
+            it_data);
+    /* we can get ERR_IO either from aa_scan_dirat() itself, or from the iterator
+     * function. But since we haven't checked that the directory (needs) does
+     * exist, ERR_IO w/ ENOENT simply means it doesn't, and isn't an error.
+     * This works because there's no ENOENT from aa_get_service(), since that
+     * won't be an ERR_IO but an ERR_UNKNOWN */
+    if (r < 0 && (r != -ERR_IO || errno != ENOENT))
+        return r;
+
+    if ((mode & AA_MODE_START) && !no_wants)
+    {
+        r = aa_scan_dirat (_service_dirfd (si), "wants", 1, _it_start_wants, it_data);
+        if (r < 0 && (r != -ERR_IO || errno != ENOENT))
+            return r;
+    }
+    r = aa_scan_dirat (_service_dirfd (si), "after", 1,
+            (mode & AA_MODE_START) ? _it_start_after : _it_stop_after,
+            it_data);
+    if (r < 0 && (r != -ERR_IO || errno != ENOENT))
+        return r;
+
+    r = aa_scan_dirat (_service_dirfd (si), "before", 1,
+            (mode & AA_MODE_START) ? _it_start_before : _it_stop_before,
+            it_data);
+    if (r < 0 && (r != -ERR_IO || errno != ENOENT))
+        return r;
+
+    {
+        char buf[UINT_FMT + 1];
+        ssize_t rr;
+
+        rr = _readat (_service_dirfd (si), "timeout", buf, UINT_FMT);
+        if (rr < 0 && errno != ENOENT)
+            aa_strerr_warnu3x ("read timeout for ", aa_service_name (aa_service (si)), "; using default");
+
+        if (rr >= 0)
+        {
+            unsigned int i = rr;
+
+            buf[byte_chr (buf, i, '\n')] = '\0';
+            if (!uint0_scan (buf, &i))
+            {
+                aa_strerr_warn3x ("invalid timeout for ", aa_service_name (aa_service (si)), "; using default");
+                set_timeout (si, mode, 0, 0);
+            }
+            else
+                set_timeout (si, mode, 1, i);
+        }
+        else
+            set_timeout (si, mode, 0, 0);
+    }
+
+    {
+        char buf[INT_FMT + 1];
+        ssize_t rr;
+
+        rr = _readat (_service_dirfd (si), AA_PRIORITY_FILENAME, buf, INT_FMT);
+        if (rr < 0 && errno != ENOENT)
+            aa_strerr_warnu3x ("read priority for ", aa_service_name (aa_service (si)), "; using default");
+
+        aa_service (si)->priority = 0;
+        if (rr >= 0)
+        {
+            int i;
+
+            buf[byte_chr (buf, rr, '\n')] = '\0';
+            if (!int0_scan (buf, &i))
+                aa_strerr_warn3x ("invalid priority for ", aa_service_name (aa_service (si)), "; using default");
+            else
+                aa_service (si)->priority = i;
+        }
+    }
+
+    {
+        char buf[256];
+        ssize_t rr;
+
+        rr = _readat (_service_dirfd (si), AA_POOL_FILENAME, buf, sizeof (buf) - 1);
+        if (rr < 0 && errno != ENOENT)
+            aa_strerr_warnu3x ("read pool for ", aa_service_name (aa_service (si)), "; ignoring");
+        else if (rr >= 0)
+        {
+            const char *pool;
+            unsigned int limit;
+
+            buf[rr] = '\0';
+            if (_parse_pool (buf, &pool, &limit) < 0)
+                aa_strerr_warn3x ("invalid pool for ", aa_service_name (aa_service (si)), "; ignoring");
+            else if (set_pool (si, pool, limit) < 0)
+                return -ERR_IO;
+        }
+    }
+
+    return 0;
+}
+
+/* edges: names of all edges of a prefetched service, or NULL for one from the
+ * graph */
+static int
+replay_edges (aa_graph_service *gs, aa_graph_edge edge, const char *edges,
+              int (*name_fn) (const char *name, struct it_data *it_data),
+              struct it_data *it_data)
+{
+    uint32_t i;
+    int j;
+
+    if (edges)
+        for (j = 0; j < edge; ++j)
+            for (i = 0; i < gs->nb[j]; ++i)
+                edges += strlen (edges) + 1;
+
+    for (i = 0; i < gs->nb[edge]; ++i)
+    {
+        const char *name;
+        int r;
+
+        if (edges)
+        {
+            name = edges;
+            edges += strlen (edges) + 1;
+        }
         else
         {
-            byte_copy (buf + l_sn, 1 + sizeof (NOTIFICATION_FILENAME), "/" NOTIFICATION_FILENAME);
-            if (access (buf, F_OK) == 0 && contains_fd (buf))
-                aa_service (si)->gets_ready = 1;
+            name = aa_graph_get_edge (gs, edge, i);
+            it_data->gi = aa_graph_get_edge_gi (gs, edge, i);
         }
+
+        r = name_fn (name, it_data);
+        it_data->gi = -1;
+        /* same as aa_scan_dir() stopping on error from the iterator */
+        if (r < 0)
+            return (r != -ERR_IO || errno != ENOENT) ? r : 0;
     }
 
     return 0;
 }
 
+/* from the graph, or a prefetched definition (edges then non-NULL) */
+static int
+load_from_def (int si, aa_mode mode, int no_wants, struct it_data *it_data,
+               aa_graph_service *gs, const char *edges)
+{
+    int r;
+
+    /* same special case as in load_from_fs() for loggers */
+    if (gs->flags & AA_GRAPH_HAS_LOG)
+    {
+        size_t l_sn = strlen (gs->name);
+        char buf[l_sn + 5];
+
+        byte_copy (buf, l_sn, gs->name);
+        byte_copy (buf + l_sn, 5, "/log");
+        it_data->gi = gs->log;
+        if (mode & AA_MODE_START)
+            r = _name_start_needs (buf, it_data);
+        else
+            r = _name_stop_needs (buf, it_data);
+        it_data->gi = -1;
+        if (r < 0)
+            return r;
+    }
+
+    r = replay_edges (gs, AA_GRAPH_NEEDS, edges,
+            (mode & AA_MODE_START) ? _name_start_needs : _name_stop_needs, it_data);
+    if (r < 0)
+        return r;
+    if ((mode & AA_MODE_START) && !no_wants)
+    {
+        r = replay_edges (gs, AA_GRAPH_WANTS, edges, _name_start_wants, it_data);
+        if (r < 0)
+            return r;
+    }
+    r = replay_edges (gs, AA_GRAPH_AFTER, edges,
+            (mode & AA_MODE_START) ? _name_start_after : _name_stop_after, it_data);
+    if (r < 0)
+        return r;
+    r = replay_edges (gs, AA_GRAPH_BEFORE, edges,
+            (mode & AA_MODE_START) ? _name_start_before : _name_stop_before, it_data);
+    if (r < 0)
+        return r;
+
+    set_timeout (si, mode, !!(gs->flags & AA_GRAPH_HAS_TIMEOUT), gs->secs_timeout);
+    aa_service (si)->priority = gs->priority;
+    if (gs->pool && set_pool (si, gs->pool, gs->pool_limit) < 0)
+        return -ERR_IO;
+    return 0;
+}
+
 int
 aa_ensure_service_loaded (int si, aa_mode mode, int no_wants, aa_autoload_cb al_cb)
 {
-    stralloc sa = STRALLOC_ZERO;
     struct it_data it_data = {
         .mode = mode,
         .si = si,
         .no_wants = no_wants,
-        .al_cb = al_cb
+        .al_cb = al_cb,
+        .gi = -1
     };
     int r;
 
@@ -319,248 +857,477 @@ aa_ensure_service_loaded (int si, aa_mode mode, int no_wants, aa_autoload_cb al_
 
     aa_service (si)->ls = AA_LOAD_ING;
 
-    stralloc_cats (&sa, aa_service_name (aa_service (si)));
-
-    /* special case: for a longrun that's not a logger, we check if it has one,
-     * and if so auto-add needs & after on said logger */
-    if (aa_service (si)->st.type == AA_TYPE_LONGRUN
-            /* because sa.s is the service name, and the only slashes allowed
-             * are for loggers, i.e. xxxx/log */
-            && (sa.len < 5 || sa.s[sa.len - 4] != '/'))
     {
-        stralloc_catb (&sa, "/log/run", strlen ("/log/run") + 1);
-        r = access (sa.s, F_OK);
-        if (r < 0 && (errno != ENOTDIR && errno != ENOENT))
-            goto err;
+        aa_graph_service gs;
+        const char *edges = NULL;
 
-        if (r == 0)
+        if (aa_service (si)->gi >= 0)
         {
-            sa.s[sa.len - 5] = '\0';
-            if (mode & AA_MODE_START)
-                r = _name_start_needs (sa.s, &it_data);
-            else
-                r = _name_stop_needs (sa.s, &it_data);
-            if (r < 0)
-                goto err;
+            aa_graph_get (aa_service (si)->gi, &gs);
+            r = load_from_def (si, mode, no_wants, &it_data, &gs, NULL);
         }
+        else if (aa_prefetch_get (aa_service_name (aa_service (si)), &gs, &edges))
+            r = load_from_def (si, mode, no_wants, &it_data, &gs, edges);
+        else
+            r = load_from_fs (si, mode, no_wants, &it_data);
+    }
+    if (r < 0)
+        goto err;
+
+    aa_service (si)->ls = AA_LOAD_DONE;
+    tain_now_g ();
+    return 0;
+
+err:
+    aa_service (si)->ls = AA_LOAD_FAIL;
+    tain_now_g ();
+    return r;
+}
 
-        sa.len -= strlen ("/log/run") + 1;
+static void
+queue_push (genalloc *queue, int si)
+{
+    genalloc_append (int, queue, &si);
+}
+
+static int
+queue_pop (genalloc *queue, size_t *head)
+{
+    int si;
+
+    if (*head >= genalloc_len (int, queue))
+        return -1;
+
+    si = list_get (queue, (*head)++);
+    if (*head == genalloc_len (int, queue))
+    {
+        *head = 0;
+        genalloc_setlen (int, queue, 0);
     }
+    return si;
+}
 
-    stralloc_catb (&sa, "/needs", strlen ("/needs") + 1);
-    r = aa_scan_dir (&sa, 1,
-            (mode & AA_MODE_START) ? _it_start_needs : _it_stop_needs,
-            &it_data);
-    /* we can get ERR_IO either from aa_scan_dir() itself, or from the iterator
-     * function. But since we haven't checked that the directory (needs) does
-     * exist, ERR_IO w/ ENOENT simply means it doesn't, and isn't an error.
-     * This works because there's no ENOENT from aa_get_service(), since that
-     * won't be an ERR_IO but an ERR_UNKNOWN */
-    if (r < 0 && (r != -ERR_IO || errno != ENOENT))
-        goto err;
+static int
+ready_before (const struct ready *r1, const struct ready *r2)
+{
+    aa_service *s1 = aa_service (r1->si);
+    aa_service *s2 = aa_service (r2->si);
+
+    if (s1->priority != s2->priority)
+        return s1->priority > s2->priority;
+    if (s1->crit != s2->crit)
+        return s1->crit > s2->crit;
+    return r1->seq < r2->seq;
+}
 
-    sa.len -= strlen ("needs") + 1;
-    if ((mode & AA_MODE_START) && !no_wants)
+static void
+ready_push (int si)
+{
+    struct ready r = { .si = si, .seq = ready_seq++ };
+    struct ready *heap;
+    size_t i;
+
+    if (!genalloc_append (struct ready, &ga_ready, &r))
+        return;
+
+    heap = genalloc_s (struct ready, &ga_ready);
+    for (i = genalloc_len (struct ready, &ga_ready) - 1; i > 0; )
     {
-        stralloc_catb (&sa, "wants", strlen ("wants") + 1);
-        r = aa_scan_dir (&sa, 1, _it_start_wants, &it_data);
-        if (r < 0 && (r != -ERR_IO || errno != ENOENT))
-            goto err;
+        size_t p = (i - 1) / 2;
 
-        sa.len -= strlen ("wants") + 1;
+        if (!ready_before (&r, &heap[p]))
+            break;
+        heap[i] = heap[p];
+        i = p;
     }
-    stralloc_catb (&sa, "after", strlen ("after") + 1);
-    r = aa_scan_dir (&sa, 1,
-            (mode & AA_MODE_START) ? _it_start_after : _it_stop_after,
-            &it_data);
-    if (r < 0 && (r != -ERR_IO || errno != ENOENT))
-        goto err;
+    heap[i] = r;
+}
 
-    sa.len -= strlen ("after") + 1;
-    stralloc_catb (&sa, "before", strlen ("before") + 1);
-    r = aa_scan_dir (&sa, 1,
-            (mode & AA_MODE_START) ? _it_start_before : _it_stop_before,
-            &it_data);
-    if (r < 0 && (r != -ERR_IO || errno != ENOENT))
-        goto err;
+static int
+ready_pop (void)
+{
+    struct ready *heap = genalloc_s (struct ready, &ga_ready);
+    size_t len = genalloc_len (struct ready, &ga_ready);
+    struct ready last;
+    size_t i;
+    int si;
+
+    if (len == 0)
+        return -1;
 
+    si = heap[0].si;
+    last = heap[--len];
+    genalloc_setlen (struct ready, &ga_ready, len);
+    for (i = 0; 2 * i + 1 < len; )
     {
-        char buf[UINT_FMT + 1];
-        ssize_t rr;
+        size_t c = 2 * i + 1;
 
-        sa.len -= strlen ("before") + 1;
-        stralloc_catb (&sa, "timeout", strlen ("timeout") + 1);
+        if (c + 1 < len && ready_before (&heap[c + 1], &heap[c]))
+            ++c;
+        if (!ready_before (&heap[c], &last))
+            break;
+        heap[i] = heap[c];
+        i = c;
+    }
+    if (len > 0)
+        heap[i] = last;
 
-        rr = openreadnclose_nb (sa.s, buf, UINT_FMT);
-        if (rr < 0 && errno != ENOENT)
-            aa_strerr_warnu3x ("read timeout for ", aa_service_name (aa_service (si)), "; using default");
+    return si;
+}
 
-        if (rr >= 0)
-        {
-            unsigned int i = rr;
+/* per service state when preparing the main list (indexed by si, only used
+ * for services in the main list) */
+struct node
+{
+    int index;      /* DFS order, or -1 if not yet visited */
+    int low;        /* lowest index reachable (Tarjan) */
+    int on_stack;
+    int scc;        /* si of the root of its SCC, or -1 */
+    int done;       /* when breaking loops: fully explored */
+    int nb_left;    /* dependents whose critical path isn't yet known */
+};
+
+/* DFS stack frame: service & index of the next after to process */
+struct frame
+{
+    int si;
+    size_t next;
+};
 
-            buf[byte_chr (buf, i, '\n')] = '\0';
-            if (!uint0_scan (buf, &i))
-            {
-                aa_strerr_warn3x ("invalid timeout for ", aa_service_name (aa_service (si)), "; using default");
-                aa_service (si)->secs_timeout = aa_secs_timeout;
-            }
-            /* in STOP_ALL the default is also a maximum */
-            else if ((mode & AA_MODE_STOP_ALL)
-                    && (aa_service (si)->secs_timeout > aa_secs_timeout
-                        || aa_service (si)->secs_timeout == 0))
-                aa_service (si)->secs_timeout = aa_secs_timeout;
+static genalloc ga_nodes = GENALLOC_ZERO; /* struct node */
+static genalloc ga_frames = GENALLOC_ZERO; /* struct frame */
+static genalloc ga_stack = GENALLOC_ZERO; /* int: Tarjan's stack */
+
+#define node(si)        (&genalloc_s (struct node, &ga_nodes)[si])
+#define frame_top()     (&genalloc_s (struct frame, &ga_frames)[genalloc_len (struct frame, &ga_frames) - 1])
+
+static void
+push_frame (int si)
+{
+    struct frame frame = { .si = si, .next = 0 };
+
+    genalloc_append (struct frame, &ga_frames, &frame);
+}
+
+/* breaks the loop closed by an after from the last service on the path
+ * (aa_tmp_list) to next, which is on the path. Returns 1 if the link removed
+ * isn't that last one, i.e. the DFS must be started over */
+static int
+break_loop (int next, aa_prepare_cb prepare_cb)
+{
+    size_t l = set_len (&aa_tmp_list);
+    size_t first;
+    size_t j;
+
+    for (first = l - 1; set_get (&aa_tmp_list, first) != next; --first)
+        ;
+    /* can't use add_to_set() since next is (obviously) in it already, and we
+     * need it at the end to get the loop */
+    genalloc_append (int, &aa_tmp_list.ga, &next);
+
+    for (j = first; j < l; ++j)
+    {
+        int cur = set_get (&aa_tmp_list, j);
+        int nxt = set_get (&aa_tmp_list, j + 1);
+
+        /* remove the first after link that's not a need as well */
+        if (!is_in_edges (&aa_service (cur)->needs, nxt))
+        {
+            remove_from_edges (&aa_service (cur)->after, nxt);
+            if (prepare_cb)
+                prepare_cb (cur, nxt, 0, first);
+            break;
         }
-        else
-            aa_service (si)->secs_timeout = aa_secs_timeout;
     }
 
-    stralloc_free (&sa);
-    aa_service (si)->ls = AA_LOAD_DONE;
-    tain_now_g ();
-    return 0;
+    /* this is actually a loop of needs */
+    if (j >= l)
+    {
+        int cur = set_get (&aa_tmp_list, l - 1);
+
+        /* we'll remove the last one (both needs & after) on the loop, so the
+         * further one away from the explicitly asked to start service, so it
+         * might break it less... though that really doesn't mean much, plus it
+         * might also have been explicitly asked as well. Either way, major
+         * config error, fix it user! */
+        remove_from_edges (&aa_service (cur)->needs, next);
+        remove_from_edges (&aa_service (cur)->after, next);
+        if (prepare_cb)
+            prepare_cb (cur, next, 1, first);
+        j = l - 1;
+    }
 
-err:
-    aa_service (si)->ls = AA_LOAD_FAIL;
-    stralloc_free (&sa);
-    tain_now_g ();
-    return r;
+    genalloc_setlen (int, &aa_tmp_list.ga, l);
+    return j < l - 1;
 }
 
-static int
-check_afters (int si, int *sli, int *has_longrun)
+/* breaks every loop within an SCC (scc[0] being its root) via a DFS, where
+ * aa_tmp_list is used as path, so it holds the loop for prepare_cb */
+static void
+break_loops (const int *scc, size_t nb, aa_prepare_cb prepare_cb)
 {
-    aa_service *s = aa_service (si);
-    size_t org = genalloc_len (int, &aa_tmp_list);
     size_t i;
 
-    if (s->ls == AA_LOAD_DONE_CHECKED)
-        return 0;
+again:
+    for (i = 0; i < nb; ++i)
+        node (scc[i])->done = 0;
 
-    if (!add_to_list (&aa_tmp_list, si, 1))
+    for (i = 0; i < nb; ++i)
     {
-        *sli = si;
-        return -1;
+        if (node (scc[i])->done)
+            continue;
+
+        add_to_set (&aa_tmp_list, scc[i]);
+        push_frame (scc[i]);
+        while (genalloc_len (struct frame, &ga_frames) > 0)
+        {
+            struct frame *frame = frame_top ();
+            aa_service *s = aa_service (frame->si);
+            int sai;
+
+            if (frame->next >= edges_len (&s->after))
+            {
+                node (frame->si)->done = 1;
+                set_truncate (&aa_tmp_list, set_len (&aa_tmp_list) - 1);
+                genalloc_setlen (struct frame, &ga_frames, genalloc_len (struct frame, &ga_frames) - 1);
+                continue;
+            }
+
+            sai = edges_get (&s->after, frame->next);
+            if (node (sai)->scc != node (scc[0])->scc || node (sai)->done)
+                ++frame->next;
+            else if (is_in_set (&aa_tmp_list, sai))
+            {
+                /* the link to sai was removed, so no need to move to the next
+                 * one. But if another link was, start over */
+                if (break_loop (sai, prepare_cb))
+                {
+                    set_truncate (&aa_tmp_list, 0);
+                    genalloc_setlen (struct frame, &ga_frames, 0);
+                    goto again;
+                }
+            }
+            else
+            {
+                ++frame->next;
+                add_to_set (&aa_tmp_list, sai);
+                push_frame (sai);
+            }
+        }
     }
+}
 
-    for (i = 0; i < genalloc_len (int, &s->after); )
+/* Tarjan's algorithm, iterative. Every SCC found with more than one service (or
+ * a service after itself) has its loops broken right away: all its members
+ * are done (i.e. their edges won't be looked at anymore) */
+static void
+find_sccs (int root, int *index, aa_prepare_cb prepare_cb)
+{
+    node (root)->index = node (root)->low = (*index)++;
+    node (root)->on_stack = 1;
+    genalloc_append (int, &ga_stack, &root);
+    push_frame (root);
+
+    while (genalloc_len (struct frame, &ga_frames) > 0)
     {
-        int sai;
+        struct frame *frame = frame_top ();
+        aa_service *s = aa_service (frame->si);
+        int si = frame->si;
 
-        sai = list_get (&s->after, i);
-        if ((aa_service (sai)->ls != AA_LOAD_DONE
-                    && aa_service (sai)->ls != AA_LOAD_DONE_CHECKED)
-                || !is_in_list (&aa_main_list, sai))
+        if (frame->next < edges_len (&s->after))
         {
-            remove_from_list (&s->after, sai);
+            int sai = edges_get (&s->after, frame->next++);
+
+            if (node (sai)->index < 0)
+            {
+                node (sai)->index = node (sai)->low = (*index)++;
+                node (sai)->on_stack = 1;
+                genalloc_append (int, &ga_stack, &sai);
+                push_frame (sai);
+            }
+            else if (node (sai)->on_stack && node (sai)->index < node (si)->low)
+                node (si)->low = node (sai)->index;
             continue;
         }
 
-        if (check_afters (sai, sli, has_longrun) < 0)
-            return -1;
-        ++i;
-    }
+        genalloc_setlen (struct frame, &ga_frames, genalloc_len (struct frame, &ga_frames) - 1);
+        if (genalloc_len (struct frame, &ga_frames) > 0
+                && node (si)->low < node (frame_top ()->si)->low)
+            node (frame_top ()->si)->low = node (si)->low;
 
-    if (s->st.type == AA_TYPE_LONGRUN && !*has_longrun)
-        *has_longrun = 1;
+        if (node (si)->low == node (si)->index)
+        {
+            size_t l = genalloc_len (int, &ga_stack);
+            size_t first;
+            size_t i;
 
-    genalloc_setlen (int, &aa_tmp_list, org);
-    s->ls = AA_LOAD_DONE_CHECKED;
+            for (first = l - 1; list_get (&ga_stack, first) != si; --first)
+                ;
+            for (i = first; i < l; ++i)
+            {
+                node (list_get (&ga_stack, i))->on_stack = 0;
+                node (list_get (&ga_stack, i))->scc = si;
+            }
 
-    return 0;
+            if (l - first > 1 || is_in_edges (&s->after, si))
+            {
+                /* ga_frames is empty'd by break_loops(), so save it */
+                genalloc frames = ga_frames;
+
+                ga_frames = (genalloc) GENALLOC_ZERO;
+                break_loops (genalloc_s (int, &ga_stack) + first, l - first, prepare_cb);
+                genalloc_free (struct frame, &ga_frames);
+                ga_frames = frames;
+            }
+            genalloc_setlen (int, &ga_stack, first);
+        }
+    }
 }
 
 int
 aa_prepare_mainlist (aa_prepare_cb prepare_cb, aa_exec_cb exec_cb)
 {
     int has_longrun = 0;
+    int index = 0;
+    size_t nb = genalloc_len (aa_service, &aa_services);
     size_t i;
 
     _exec_cb = exec_cb;
-    aa_tmp_list.len = 0;
-
-    /* scan main_list to remove unneeded afters and check for loops */
-    for (i = 0; i < genalloc_len (int, &aa_main_list); )
-    {
-        int si;
-        int sli;
-
-        si = list_get (&aa_main_list, i);
-
-        /* check the after-s of the service, recursively. It will remove any
-         * after that's not loaded or in the main list, i.e. that won't be
-         * started.
-         * It also constructs a list going down, to find any loop (e.g. a after
-         * b after a), placing it in aa_tmp_list. Should be noted that the list
-         * might be "a,b,c,d" with sli set to c if the loop is actually c->d->c
-         * but was found from b which was itself after a; hence we need to find
-         * the "real" start of the loop.
-         */
-        if (check_afters (si, &sli, &has_longrun) < 0)
+    set_truncate (&aa_tmp_list, 0);
+
+    if (!genalloc_ready (struct node, &ga_nodes, nb))
+        return (errno = ENOMEM, -1);
+    genalloc_setlen (struct node, &ga_nodes, nb);
+
+    /* remove after-s that aren't loaded or in the main list, i.e. that won't
+     * be started */
+    for (i = 0; i < set_len (&aa_main_list); ++i)
+    {
+        int si = set_get (&aa_main_list, i);
+        aa_service *s = aa_service (si);
+        size_t j;
+
+        for (j = 0; j < edges_len (&s->after); )
         {
-            size_t l;
-            size_t j;
-            size_t found = 0;
+            int sai = edges_get (&s->after, j);
 
-            add_to_list (&aa_tmp_list, sli, 0);
-            l = genalloc_len (int, &aa_tmp_list);
-            for (j = 0; j < l - 1; ++j)
-            {
-                int cur;
-                int next;
+            if ((aa_service (sai)->ls != AA_LOAD_DONE
+                        && aa_service (sai)->ls != AA_LOAD_DONE_CHECKED)
+                    || !is_in_set (&aa_main_list, sai))
+                remove_from_edges (&s->after, sai);
+            else
+                ++j;
+        }
 
-                cur = list_get (&aa_tmp_list, j);
-                if (!found && cur == sli)
-                    found = j + 1;
-                if (!found)
-                    continue;
+        if (s->st.type == AA_TYPE_LONGRUN)
+            has_longrun = 1;
+        s->ls = AA_LOAD_DONE_CHECKED;
+        node (si)->index = node (si)->scc = -1;
+        node (si)->on_stack = 0;
+        node (si)->nb_left = 0;
+    }
 
-                next = list_get (&aa_tmp_list, j + 1);
-                /* remove the first after link that's not a need as well */
-                if (!is_in_list (&aa_service (cur)->needs, next))
-                {
-                    remove_from_list (&aa_service (cur)->after, next);
-                    if (prepare_cb)
-                        prepare_cb (cur, next, 0, found - 1);
-                    break;
-                }
-            }
+    /* find all loops (SCCs) in one pass, and break them */
+    for (i = 0; i < set_len (&aa_main_list); ++i)
+    {
+        int si = set_get (&aa_main_list, i);
 
-            /* this is actually a loop of needs */
-            if (j >= l - 1)
-            {
-                int cur;
-                int next;
-
-                /* we'll remove the last one (both needs & after) on the loop,
-                 * so the further one away from the explicitly asked to start
-                 * service, so it might break it less... though that really
-                 * doesn't mean much, plus it might also have been explicitly
-                 * asked as well. Either way, major config error, fix it user! */
-                cur = list_get (&aa_tmp_list, l - 2);
-                next = list_get (&aa_tmp_list, l - 1);
-
-                remove_from_list (&aa_service (cur)->needs, next);
-                remove_from_list (&aa_service (cur)->after, next);
-                if (prepare_cb)
-                    prepare_cb (cur, next, 1, found - 1);
-            }
+        if (node (si)->index < 0)
+            find_sccs (si, &index, prepare_cb);
+    }
+
+    genalloc_free (struct frame, &ga_frames);
+    set_truncate (&aa_tmp_list, 0);
+
+    /* set up the scheduler: count after-s & fill the reverse edges, queueing
+     * whatever can be exec-ed right away */
+    for (i = 0; i < set_len (&aa_main_list); ++i)
+    {
+        int si = set_get (&aa_main_list, i);
+        aa_service *s = aa_service (si);
+        size_t j;
+
+        s->nb_after = edges_len (&s->after);
+        for (j = 0; j < (size_t) s->nb_after; ++j)
+        {
+            int sai = edges_get (&s->after, j);
+
+            add_to_edges (&aa_service (sai)->dependents, si, 0);
+            ++node (sai)->nb_left;
         }
-        else
-            ++i;
 
-       aa_tmp_list.len = 0;
+        /* needs that aren't in the main list were removed from after-s, but
+         * must still be checked; so we treat them as just done */
+        for (j = 0; j < edges_len (&s->needs); ++j)
+        {
+            int sni = edges_get (&s->needs, j);
+
+            if (is_in_set (&aa_main_list, sni))
+                continue;
+            if (edges_len (&aa_service (sni)->dependents) == 0)
+                queue_push (&ga_done, sni);
+            add_to_edges (&aa_service (sni)->dependents, si, 1);
+        }
     }
 
-    if (has_longrun)
+    /* critical path of each service, i.e. the longest chain of services to be
+     * exec-ed after it, each weighted by its last known duration. Computed
+     * from the end, since we now have no more loops */
+    genalloc_setlen (int, &ga_stack, 0);
+    for (i = 0; i < set_len (&aa_main_list); ++i)
     {
-        tain deadline;
+        int si = set_get (&aa_main_list, i);
 
-        tain_addsec_g (&deadline, 1);
-        if (!ftrigr_startf_g (&_aa_ft, &deadline))
-            return -1;
-        else
-            return ftrigr_fd (&_aa_ft);
+        if (node (si)->nb_left == 0)
+            genalloc_append (int, &ga_stack, &si);
+    }
+    while (genalloc_len (int, &ga_stack) > 0)
+    {
+        size_t l = genalloc_len (int, &ga_stack) - 1;
+        int si = list_get (&ga_stack, l);
+        aa_service *s = aa_service (si);
+        uint64_t crit = 0;
+        size_t j;
+
+        genalloc_setlen (int, &ga_stack, l);
+        for (j = 0; j < edges_len (&s->dependents); ++j)
+        {
+            aa_service *sd = aa_service (edges_get (&s->dependents, j));
+
+            if (sd->crit > crit)
+                crit = sd->crit;
+        }
+        s->crit = crit + aa_durations_get (aa_service_name (s)) + 1;
+
+        for (j = 0; j < edges_len (&s->after); ++j)
+        {
+            int sai = edges_get (&s->after, j);
+
+            if (--node (sai)->nb_left == 0)
+                genalloc_append (int, &ga_stack, &sai);
+        }
+    }
+
+    for (i = 0; i < set_len (&aa_main_list); ++i)
+        if (aa_service (set_get (&aa_main_list, i))->nb_after == 0)
+            ready_push (set_get (&aa_main_list, i));
+
+    genalloc_free (struct node, &ga_nodes);
+    genalloc_free (int, &ga_stack);
+
+    /* we keep a fifo open for each longrun we wait on, so make sure we can
+     * have as many as possible (oneshots get the original limit back) */
+    if (has_longrun && _aa_nofile.rlim_cur == 0)
+    {
+        struct rlimit rl;
+
+        if (getrlimit (RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max)
+        {
+            _aa_nofile = rl;
+            rl.rlim_cur = rl.rlim_max;
+            if (setrlimit (RLIMIT_NOFILE, &rl) < 0)
+                _aa_nofile.rlim_cur = 0;
+        }
     }
 
     return 0;
@@ -611,88 +1378,69 @@ service_is_ok (aa_mode mode, aa_service *s)
 }
 
 void
-aa_scan_mainlist (aa_scan_cb scan_cb, aa_mode mode)
+aa_service_done (int si)
 {
-    size_t i;
+    if (remove_from_set (&aa_main_list, si))
+        queue_push (&ga_done, si);
+}
 
-    for (i = 0; i < genalloc_len (int, &aa_main_list); )
-    {
-        aa_service *s;
-        int si;
-        size_t j;
+int
+aa_pop_ready_service (aa_scan_cb scan_cb, aa_mode mode)
+{
+    int si;
 
-        si = list_get (&aa_main_list, i);
-        s = aa_service (si);
+    /* process the dependents of services done: that might fail some (which
+     * are then done as well, so their own dependents get processed in turn),
+     * and/or make some ready */
+    while ((si = queue_pop (&ga_done, &done_head)) >= 0)
+    {
+        aa_service *s = aa_service (si);
+        int is_ok = -1;
+        size_t i;
 
-        for (j = 0; j < genalloc_len (int, &s->needs); )
+        for (i = 0; i < edges_len (&s->dependents); ++i)
         {
-            int sni;
-            aa_service_status *svst;
+            int sdi = edges_get (&s->dependents, i);
+            aa_service *sd = aa_service (sdi);
 
-            sni = list_get (&s->needs, j);
-            if (is_in_list (&aa_main_list, sni))
-            {
-                ++j;
+            if (!is_in_set (&aa_main_list, sdi))
                 continue;
-            }
 
-            if (service_is_ok (mode, aa_service (sni)))
+            if (is_in_edges (&sd->needs, si))
             {
-                remove_from_list (&s->needs, sni);
-                remove_from_list (&s->after, sni);
-                continue;
-            }
+                if (is_ok < 0)
+                    is_ok = service_is_ok (mode, s);
 
-            svst = &s->st;
-            svst->event = (mode & AA_MODE_START) ? AA_EVT_STARTING_FAILED: AA_EVT_STOPPING_FAILED;
-            svst->code = ERR_DEPEND;
-            tain_copynow (&svst->stamp);
-            aa_service_status_set_msg (svst, aa_service_name (aa_service (sni)));
-            if (aa_service_status_write (svst, aa_service_name (s)) < 0)
-                aa_strerr_warnu2sys ("write service status file for ", aa_service_name (s));
+                if (!is_ok)
+                {
+                    aa_service_status *svst = &sd->st;
 
-            remove_from_list (&aa_main_list, si);
+                    svst->event = (mode & AA_MODE_START) ? AA_EVT_STARTING_FAILED: AA_EVT_STOPPING_FAILED;
+                    svst->code = ERR_DEPEND;
+                    tain_copynow (&svst->stamp);
+                    aa_service_status_set_msg (svst, aa_service_name (s));
+                    if (aa_service_status_write (svst, aa_service_name (sd)) < 0)
+                        aa_strerr_warnu2sys ("write service status file for ", aa_service_name (sd));
 
-            if (scan_cb)
-                scan_cb (si, sni);
+                    aa_service_done (sdi);
 
-            si = -1;
-            break;
-        }
-        if (si < 0)
-        {
-            i = 0;
-            continue;
-        }
-
-        for (j = 0; j < genalloc_len (int, &s->after); )
-        {
-            int sai;
+                    if (scan_cb)
+                        scan_cb (sdi, si);
+                    continue;
+                }
+            }
 
-            sai = list_get (&s->after, j);
-            if (is_in_list (&aa_main_list, sai))
-                ++j;
-            else
-                remove_from_list (&s->after, sai);
+            if (is_in_edges (&sd->after, si) && --sd->nb_after == 0)
+                ready_push (sdi);
         }
+    }
 
-        if (genalloc_len (int, &s->after) == 0
-                && (
-                    /* either we're in DRY mode (i.e. we should start it) */
-                    (mode & AA_MODE_IS_DRY)
-                    ||
-                    /* or make sure it's in the right state */
-                    (((mode & AA_MODE_START) && s->st.event != AA_EVT_STARTING)
-                     || ((mode & (AA_MODE_STOP | AA_MODE_STOP_ALL))
-                         && s->st.event != AA_EVT_STOPPING))
-                    )
-                && aa_exec_service (si, mode) < 0)
-            /* failed to exec service, was removed from main_list, so we need to
-             * rescan from top */
-            i = -1;
+    /* a service can only have been queued once, but could have failed since */
+    while ((si = ready_pop ()) >= 0)
+        if (is_in_set (&aa_main_list, si))
+            return si;
 
-        ++i;
-    }
+    return -1;
 }
 
 int
@@ -715,8 +1463,11 @@ aa_exec_service (int si, aa_mode mode)
             r = _exec_longrun (si, mode);
 
         if (r < 0)
-            remove_from_list (&aa_main_list, si);
+            aa_service_done (si);
     }
+    else
+        /* nothing to wait for */
+        aa_service_done (si);
 
     return r;
 }
@@ -0,0 +1,222 @@
+/*
+ * anopa - Copyright (C) 2015-2017 Olivier Brunel
+ *
+ * service_def.c
+ * Copyright (C) 2015-2017 Olivier Brunel <jjk@jjacky.com>
+ *
+ * This file is part of anopa.
+ *
+ * anopa is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * anopa is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * anopa. If not, see http://www.gnu.org/licenses/
+ */
+
+#define _BSD_SOURCE
+
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <skalibs/allreadwrite.h>
+#include <skalibs/djbunix.h>
+#include <skalibs/bytestr.h>
+#include <skalibs/stralloc.h>
+#include <skalibs/direntry.h>
+#include <skalibs/types.h>
+#include <anopa/err.h>
+#include <anopa/graph.h>
+#include <anopa/scan_dir.h>
+#include <anopa/service.h>
+#include "service_internal.h"
+
+#define NOTIFICATION_FILENAME       "notification-fd"
+
+/* same as openreadnclose_nb() but relative to fd */
+ssize_t
+_readat (int fd, const char *file, char *s, size_t n)
+{
+    size_t r;
+    int e;
+
+    if (fd < 0)
+        return -1;
+    fd = openat (fd, file, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    errno = 0;
+    r = allread (fd, s, n);
+    e = errno;
+    fd_close (fd);
+    /* a short read is EOF (EPIPE) unless there was an error */
+    if (r < n && e && e != EPIPE)
+        return (errno = e, -1);
+    return r;
+}
+
+struct it_def
+{
+    struct service_def *def;
+    uint32_t *nb;
+};
+
+static int
+it_edge (direntry *d, void *data)
+{
+    struct it_def *it = data;
+
+    if (!stralloc_catb (&it->def->sa, d->d_name, strlen (d->d_name) + 1))
+        return -1;
+    ++*it->nb;
+    return 0;
+}
+
+static int
+contains_fd (int fd)
+{
+    char buf[UINT_FMT + 1];
+    ssize_t r;
+    unsigned int u;
+
+    r = _readat (fd, NOTIFICATION_FILENAME, buf, UINT_FMT);
+    if (r < 0)
+        return (errno == ENOENT) ? 0 : -1;
+
+    buf[byte_chr (buf, r, '\n')] = '\0';
+    return (uint0_scan (buf, &u)) ? 1 : -1;
+}
+
+/* reads the servicedir the same way aa_preload_service() &
+ * aa_ensure_service_loaded() would. Anything that would trigger an error or a
+ * warning there is a failure (-1), so it is left to them & still happens.
+ * Only uses its arguments & fds of its own, so it can be used from threads */
+int
+_read_service_def (const char *name, struct service_def *def)
+{
+    static const char * const dirs[_AA_GRAPH_NB_EDGES] = { "needs", "wants", "after", "before" };
+    size_t l_sn = strlen (name);
+    int fd;
+    int i;
+    int r;
+
+    def->flags = def->secs_timeout = def->pool_limit = 0;
+    def->priority = 0;
+    def->offset_pool = (size_t) -1;
+    def->sa.len = 0;
+
+    fd = openat (AT_FDCWD, name, O_RDONLY | O_DIRECTORY | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+
+    if (faccessat (fd, "run", F_OK, 0) == 0)
+    {
+        def->flags |= AA_GRAPH_LONGRUN;
+
+        if (faccessat (fd, AA_GETS_READY_FILENAME, F_OK, 0) == 0)
+            def->flags |= AA_GRAPH_GETS_READY;
+        else
+        {
+            r = contains_fd (fd);
+            if (r < 0)
+                goto err;
+            else if (r > 0)
+                def->flags |= AA_GRAPH_GETS_READY;
+        }
+
+        /* not a logger? (the only slashes allowed are for loggers) */
+        if (l_sn < 5 || name[l_sn - 4] != '/')
+        {
+            r = faccessat (fd, "log/run", F_OK, 0);
+            if (r < 0 && errno != ENOTDIR && errno != ENOENT)
+                goto err;
+            else if (r == 0)
+                def->flags |= AA_GRAPH_HAS_LOG;
+        }
+    }
+    else if (errno != ENOENT)
+        goto err;
+
+    for (i = 0; i < _AA_GRAPH_NB_EDGES; ++i)
+    {
+        struct it_def it = { def, &def->nb[i] };
+
+        def->nb[i] = 0;
+        r = aa_scan_dirat (fd, dirs[i], 1, it_edge, &it);
+        if (r < 0 && (r != -ERR_IO || errno != ENOENT))
+            goto err;
+    }
+
+    {
+        char buf[UINT_FMT + 1];
+        ssize_t rr;
+
+        rr = _readat (fd, "timeout", buf, UINT_FMT);
+        if (rr < 0 && errno != ENOENT)
+            goto err;
+        else if (rr >= 0)
+        {
+            unsigned int u;
+
+            buf[byte_chr (buf, rr, '\n')] = '\0';
+            if (!uint0_scan (buf, &u))
+                goto err;
+            def->flags |= AA_GRAPH_HAS_TIMEOUT;
+            def->secs_timeout = u;
+        }
+    }
+
+    {
+        char buf[INT_FMT + 1];
+        ssize_t rr;
+
+        rr = _readat (fd, AA_PRIORITY_FILENAME, buf, INT_FMT);
+        if (rr < 0 && errno != ENOENT)
+            goto err;
+        else if (rr >= 0)
+        {
+            int prio;
+
+            buf[byte_chr (buf, rr, '\n')] = '\0';
+            if (!int0_scan (buf, &prio))
+                goto err;
+            def->priority = prio;
+        }
+    }
+
+    {
+        char buf[256];
+        ssize_t rr;
+
+        rr = _readat (fd, AA_POOL_FILENAME, buf, sizeof (buf) - 1);
+        if (rr < 0 && errno != ENOENT)
+            goto err;
+        else if (rr >= 0)
+        {
+            const char *pool;
+
+            buf[rr] = '\0';
+            if (_parse_pool (buf, &pool, &def->pool_limit) < 0)
+                goto err;
+            def->offset_pool = def->sa.len;
+            if (!stralloc_catb (&def->sa, pool, strlen (pool) + 1))
+                goto err;
+        }
+    }
+
+    fd_close (fd);
+    return 0;
+
+err:
+    r = errno;
+    fd_close (fd);
+    errno = r;
+    return -1;
+}
@@ -23,12 +23,16 @@
 #ifndef AA_SERVICE_INTERNAL_H
 #define AA_SERVICE_INTERNAL_H
 
+#include <stdint.h>
+#include <sys/resource.h>
 #include <skalibs/direntry.h>
-#include <s6/ftrigr.h>
+#include <skalibs/stralloc.h>
 #include <anopa/service.h>
+#include <anopa/graph.h>
 
-extern ftrigr_t _aa_ft;
 extern aa_exec_cb _exec_cb;
+extern struct rlimit _aa_nofile; /* original limit, if raised (rlim_cur > 0) */
+extern genalloc _aa_hash;
 
 struct it_data
 {
@@ -36,22 +40,54 @@ struct it_data
     int si;
     int no_wants;
     aa_autoload_cb al_cb;
+    int gi; /* of the name processed, when known (from the graph), else -1 */
 };
 
+/* a service's definition, as read from its servicedir */
+struct service_def
+{
+    uint32_t flags;
+    uint32_t secs_timeout;
+    int32_t priority;
+    uint32_t pool_limit;
+    size_t offset_pool; /* in sa, or -1 */
+    uint32_t nb[_AA_GRAPH_NB_EDGES];
+    stralloc sa; /* names from all edges (in order), and pool */
+};
+#define SERVICE_DEF_ZERO { .offset_pool = (size_t) -1, .sa = STRALLOC_ZERO }
+
 extern int _is_valid_service_name (const char *name, size_t len);
+extern int _service_dirfd (int si);
+extern int _get_service (const char *name, struct it_data *it_data, int *si, int new_in_main);
+extern int _new_oneshot (int si);
+extern uint32_t _hash_name (const char *name);
+extern ssize_t _readat (int fd, const char *file, char *s, size_t n);
+extern int _read_service_def (const char *name, struct service_def *def);
+
+extern int _prefetch_add (const char *name);
+extern size_t _prefetch_nb (void);
+extern const char *_prefetch_name (size_t n);
+extern void _prefetch_set (size_t n, struct service_def *def);
+extern int _parse_pool (char *s, const char **name, unsigned int *limit);
 
 extern int _name_start_needs (const char *name, struct it_data *it_data);
 extern int _it_start_needs  (direntry *d, void *data);
+extern int _name_start_wants (const char *name, struct it_data *it_data);
 extern int _it_start_wants  (direntry *d, void *data);
+extern int _name_start_after (const char *name, struct it_data *it_data);
 extern int _it_start_after  (direntry *d, void *data);
+extern int _name_start_before (const char *name, struct it_data *it_data);
 extern int _it_start_before (direntry *d, void *data);
 
 extern int _name_stop_needs (const char *name, struct it_data *it_data);
 extern int _it_stop_needs   (direntry *d, void *data);
+extern int _name_stop_after (const char *name, struct it_data *it_data);
 extern int _it_stop_after   (direntry *d, void *data);
+extern int _name_stop_before (const char *name, struct it_data *it_data);
 extern int _it_stop_before  (direntry *d, void *data);
 
 extern int _exec_oneshot (int si, aa_mode mode);
 extern int _exec_longrun (int si, aa_mode mode);
+extern void _unsubscribe (aa_service *s);
 
 #endif /* AA_SERVICE_INTERNAL_H */
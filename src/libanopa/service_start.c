@@ -23,7 +23,7 @@
 #include <skalibs/direntry.h>
 #include <skalibs/bytestr.h>
 #include <anopa/service.h>
-#include <anopa/ga_int_list.h>
+#include <anopa/edges.h>
 #include <anopa/err.h>
 #include <anopa/output.h>
 #include <anopa/service_status.h>
@@ -38,13 +38,13 @@ aa_unmark_service (int si)
     if (--s->nb_mark > 0)
         return;
 
-    for (i = 0; i < genalloc_len (int, &s->needs); ++i)
-        aa_unmark_service (list_get (&s->needs, i));
-    for (i = 0; i < genalloc_len (int, &s->wants); ++i)
-        aa_unmark_service (list_get (&s->wants, i));
+    for (i = 0; i < edges_len (&s->needs); ++i)
+        aa_unmark_service (edges_get (&s->needs, i));
+    for (i = 0; i < edges_len (&s->wants); ++i)
+        aa_unmark_service (edges_get (&s->wants, i));
 
-    add_to_list (&aa_tmp_list, si, 0);
-    remove_from_list (&aa_main_list, si);
+    add_to_set (&aa_tmp_list, si);
+    remove_from_set (&aa_main_list, si);
 }
 
 int
@@ -57,16 +57,16 @@ aa_mark_service (aa_mode mode, int si, int in_main, int no_wants, aa_autoload_cb
     {
         if (in_main)
         {
-            add_to_list (&aa_tmp_list, si, 0);
-            remove_from_list (&aa_main_list, si);
+            add_to_set (&aa_tmp_list, si);
+            remove_from_set (&aa_main_list, si);
         }
         return r;
     }
 
     if (!in_main)
     {
-        add_to_list (&aa_main_list, si, 0);
-        remove_from_list (&aa_tmp_list, si);
+        add_to_set (&aa_main_list, si);
+        remove_from_set (&aa_tmp_list, si);
     }
 
     aa_service (si)->nb_mark++;
@@ -81,7 +81,7 @@ _name_start_needs (const char *name, struct it_data *it_data)
     int r;
 
     tain_now_g ();
-    type = aa_get_service (name, &sni, 1);
+    type = _get_service (name, it_data, &sni, 1);
     if (type < 0)
         r = type;
     else
@@ -92,11 +92,11 @@ _name_start_needs (const char *name, struct it_data *it_data)
     else if (r < 0)
     {
         aa_service *s = aa_service (it_data->si);
-        size_t l = genalloc_len (int, &s->needs);
+        size_t l = edges_len (&s->needs);
         size_t i;
 
         for (i = 0; i < l; ++i)
-            aa_unmark_service (list_get (&s->needs, i));
+            aa_unmark_service (edges_get (&s->needs, i));
 
         if (!(it_data->mode & AA_MODE_IS_DRY))
         {
@@ -118,8 +118,8 @@ _name_start_needs (const char *name, struct it_data *it_data)
 
     if (r == 0)
     {
-        add_to_list (&aa_service (it_data->si)->needs, sni, 0);
-        add_to_list (&aa_service (it_data->si)->after, sni, 1);
+        add_to_edges (&aa_service (it_data->si)->needs, sni, 0);
+        add_to_edges (&aa_service (it_data->si)->after, sni, 1);
     }
 
     if (it_data->al_cb)
@@ -135,15 +135,14 @@ _it_start_needs (direntry *d, void *data)
 }
 
 int
-_it_start_wants (direntry *d, void *data)
+_name_start_wants (const char *name, struct it_data *it_data)
 {
-    struct it_data *it_data = data;
     int type;
     int swi;
     int r;
 
     tain_now_g ();
-    type = aa_get_service (d->d_name, &swi, 1);
+    type = _get_service (name, it_data, &swi, 1);
     if (type < 0)
         r = type;
     else
@@ -153,42 +152,58 @@ _it_start_wants (direntry *d, void *data)
         return 0;
 
     if (r == 0)
-        add_to_list (&aa_service (it_data->si)->wants, swi, 0);
+        add_to_edges (&aa_service (it_data->si)->wants, swi, 0);
 
     if (it_data->al_cb)
-        it_data->al_cb (it_data->si, AA_AUTOLOAD_WANTS, d->d_name, -r);
+        it_data->al_cb (it_data->si, AA_AUTOLOAD_WANTS, name, -r);
 
     return r;
 }
 
 int
-_it_start_after (direntry *d, void *data)
+_it_start_wants (direntry *d, void *data)
+{
+    return _name_start_wants (d->d_name, (struct it_data *) data);
+}
+
+int
+_name_start_after (const char *name, struct it_data *it_data)
 {
-    struct it_data *it_data = data;
     int sai;
     int r;
 
     tain_now_g ();
-    r = aa_get_service (d->d_name, &sai, 0);
+    r = _get_service (name, it_data, &sai, 0);
     if (r < 0)
         return 0;
 
-    add_to_list (&aa_service (it_data->si)->after, sai, 1);
+    add_to_edges (&aa_service (it_data->si)->after, sai, 1);
     return 0;
 }
 
 int
-_it_start_before (direntry *d, void *data)
+_it_start_after (direntry *d, void *data)
+{
+    return _name_start_after (d->d_name, (struct it_data *) data);
+}
+
+int
+_name_start_before (const char *name, struct it_data *it_data)
 {
-    struct it_data *it_data = data;
     int sbi;
     int r;
 
     tain_now_g ();
-    r = aa_get_service (d->d_name, &sbi, 0);
+    r = _get_service (name, it_data, &sbi, 0);
     if (r < 0)
         return 0;
 
-    add_to_list (&aa_service (sbi)->after, it_data->si, 1);
+    add_to_edges (&aa_service (sbi)->after, it_data->si, 1);
     return 0;
 }
+
+int
+_it_start_before (direntry *d, void *data)
+{
+    return _name_start_before (d->d_name, (struct it_data *) data);
+}
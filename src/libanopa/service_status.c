@@ -21,6 +21,8 @@
  */
 
 #include <errno.h>
+#include <unistd.h>
+#include <stdio.h> /* rename() */
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <skalibs/allreadwrite.h>
@@ -29,6 +31,8 @@
 #include <skalibs/types.h>
 #include <skalibs/tai.h>
 #include <anopa/service_status.h>
+#include <anopa/journal.h>
+#include <anopa/status_table.h>
 
 
 void
@@ -37,15 +41,17 @@ aa_service_status_free (aa_service_status *svst)
     stralloc_free (&svst->sa);
 }
 
-int
-aa_service_status_read (aa_service_status *svst, const char *dir)
+static int
+read_file (aa_service_status *svst, const char *dir)
 {
     size_t len = strlen (dir);
     char file[len + 1 + sizeof (AA_SVST_FILENAME)];
     uint32_t u;
 
     /* most cases should be w/out a message, so we'll only need FIXED_SIZE and
-     * one extra byte to NUL-terminate the (empty) message */
+     * one extra byte to NUL-terminate the (empty) message. It is read in
+     * after whatever sa holds, e.g. when re-read (aa-status --watch) */
+    svst->sa.len = 0;
     if (!stralloc_ready_tuned (&svst->sa, AA_SVST_FIXED_SIZE + 1, 0, 0, 1))
         return -1;
 
@@ -77,11 +83,47 @@ aa_service_status_read (aa_service_status *svst, const char *dir)
     return 0;
 }
 
+int
+aa_service_status_read (aa_service_status *svst, const char *dir)
+{
+    aa_service_status st = { .sa = STRALLOC_ZERO };
+    int r;
+
+    /* the table always has the latest, when in use */
+    r = aa_status_table_get (svst, dir);
+    if (r >= 0)
+    {
+        tain_now_g ();
+        return (r > 0 && svst->event != AA_EVT_NONE) ? 0 : (errno = ENOENT, -1);
+    }
+
+    r = read_file (svst, dir);
+    /* the journal (if loaded) might have something more recent */
+    if ((r == 0 || errno == ENOENT) && aa_journal_get (&st, dir, 0) == 0
+            && (r < 0 || !tain_less (&st.stamp, &svst->stamp)))
+    {
+        stralloc_free (&svst->sa);
+        svst->sa = st.sa;
+        svst->stamp = st.stamp;
+        svst->event = st.event;
+        svst->code = st.code;
+        r = 0;
+    }
+    else
+        stralloc_free (&st.sa);
+
+    /* cleared, see aa_service_status_clear() */
+    if (r == 0 && svst->event == AA_EVT_NONE)
+        return (errno = ENOENT, -1);
+    return r;
+}
+
 int
 aa_service_status_write (aa_service_status *svst, const char *dir)
 {
     size_t len = strlen (dir);
     char file[len + 1 + sizeof (AA_SVST_FILENAME)];
+    char tmp[len + 1 + sizeof (AA_SVST_FILENAME ".new")];
     mode_t mask;
     int r;
     int e;
@@ -95,19 +137,57 @@ aa_service_status_write (aa_service_status *svst, const char *dir)
     if (svst->sa.len < AA_SVST_FIXED_SIZE)
         svst->sa.len = AA_SVST_FIXED_SIZE;
 
+    /* w/ a journal it'll be written on next commit */
+    r = aa_journal_append (svst, dir);
+    if (r != 0)
+    {
+        /* on error the table is dropped, readers going back to the files */
+        if (r > 0)
+            aa_status_table_set (svst, dir);
+        return (r < 0) ? -1 : 0;
+    }
+
     byte_copy (file, len, dir);
     byte_copy (file + len, 1 + sizeof (AA_SVST_FILENAME), "/" AA_SVST_FILENAME);
+    byte_copy (tmp, len, dir);
+    byte_copy (tmp + len, 1 + sizeof (AA_SVST_FILENAME ".new"), "/" AA_SVST_FILENAME ".new");
 
+    /* the table is updated before the file is renamed into place, so anyone
+     * woken up by the rename (aa-status --watch) does find the new status */
     mask = umask (0033);
-    if (!openwritenclose_suffix (file, svst->sa.s,
-                svst->sa.len + ((svst->sa.len > AA_SVST_FIXED_SIZE) ? -1 : 0), ".new"))
+    if (!openwritenclose_unsafe (tmp, svst->sa.s,
+                svst->sa.len + ((svst->sa.len > AA_SVST_FIXED_SIZE) ? -1 : 0)))
         r = -1;
     else
-        r = 0;
+    {
+        aa_status_table_set (svst, dir);
+        r = rename (tmp, file);
+    }
     e = errno;
     umask (mask);
+    if (r < 0)
+        unlink (tmp);
+
+    tain_now_g ();
+    errno = e;
+    return r;
+}
+
+/* records that dir has no status (anymore), e.g. after its servicedir was
+ * (re)created, so whatever was left over from before (status table, journal)
+ * isn't used for it */
+int
+aa_service_status_clear (const char *dir)
+{
+    aa_service_status svst = { .event = AA_EVT_NONE, .code = 0, .sa = STRALLOC_ZERO };
+    int r;
+    int e;
 
     tain_now_g ();
+    tain_copynow (&svst.stamp);
+    r = aa_service_status_write (&svst, dir);
+    e = errno;
+    stralloc_free (&svst.sa);
     errno = e;
     return r;
 }
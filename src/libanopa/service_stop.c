@@ -22,7 +22,7 @@
 
 #include <skalibs/direntry.h>
 #include <anopa/service.h>
-#include <anopa/ga_int_list.h>
+#include <anopa/edges.h>
 #include "service_internal.h"
 
 int
@@ -32,15 +32,15 @@ _name_stop_needs (const char *name, struct it_data *it_data)
     int r;
 
     tain_now_g ();
-    r = aa_get_service (name, &sni, 0);
+    r = _get_service (name, it_data, &sni, 0);
     if (r < 0)
         return 0;
 
     if (it_data->al_cb)
         it_data->al_cb (sni, AA_AUTOLOAD_NEEDS, aa_service_name (aa_service (it_data->si)), 0);
 
-    add_to_list (&aa_service (sni)->needs, it_data->si, 0);
-    add_to_list (&aa_service (sni)->after, it_data->si, 1);
+    add_to_edges (&aa_service (sni)->needs, it_data->si, 0);
+    add_to_edges (&aa_service (sni)->after, it_data->si, 1);
     return 0;
 }
 
@@ -51,33 +51,43 @@ _it_stop_needs (direntry *d, void *data)
 }
 
 int
-_it_stop_after (direntry *d, void *data)
+_name_stop_after (const char *name, struct it_data *it_data)
 {
-    struct it_data *it_data = data;
     int sai;
     int r;
 
     tain_now_g ();
-    r = aa_get_service (d->d_name, &sai, 0);
+    r = _get_service (name, it_data, &sai, 0);
     if (r < 0)
         return 0;
 
-    add_to_list (&aa_service (sai)->after, it_data->si, 1);
+    add_to_edges (&aa_service (sai)->after, it_data->si, 1);
     return 0;
 }
 
 int
-_it_stop_before (direntry *d, void *data)
+_it_stop_after (direntry *d, void *data)
+{
+    return _name_stop_after (d->d_name, (struct it_data *) data);
+}
+
+int
+_name_stop_before (const char *name, struct it_data *it_data)
 {
-    struct it_data *it_data = data;
     int sbi;
     int r;
 
     tain_now_g ();
-    r = aa_get_service (d->d_name, &sbi, 0);
+    r = _get_service (name, it_data, &sbi, 0);
     if (r < 0)
         return 0;
 
-    add_to_list (&aa_service (it_data->si)->after, sbi, 1);
+    add_to_edges (&aa_service (it_data->si)->after, sbi, 1);
     return 0;
 }
+
+int
+_it_stop_before (direntry *d, void *data)
+{
+    return _name_stop_before (d->d_name, (struct it_data *) data);
+}
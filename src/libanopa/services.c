@@ -20,16 +20,22 @@
  * anopa. If not, see http://www.gnu.org/licenses/
  */
 
+#include <sys/resource.h>
 #include <skalibs/stralloc.h>
 #include <skalibs/genalloc.h>
-#include <s6/ftrigr.h>
+#include <anopa/ga_int_set.h>
 #include <anopa/service.h>
 
 genalloc aa_services    = GENALLOC_ZERO;
+genalloc aa_oneshots    = GENALLOC_ZERO;
 stralloc aa_names       = STRALLOC_ZERO;
-genalloc aa_main_list   = GENALLOC_ZERO;
-genalloc aa_tmp_list    = GENALLOC_ZERO;
+genalloc aa_edge_pool   = GENALLOC_ZERO; /* int */
+ga_int_set aa_main_list = GA_INT_SET_ZERO;
+ga_int_set aa_tmp_list  = GA_INT_SET_ZERO;
 unsigned int aa_secs_timeout = 0;
+sigset_t aa_sigs_trapped;
 
-ftrigr_t _aa_ft         = FTRIGR_ZERO;
+genalloc _aa_hash       = GENALLOC_ZERO; /* int: si, or -1 for empty slots */
+
+struct rlimit _aa_nofile = { 0, 0 };
 aa_exec_cb _exec_cb     = NULL;
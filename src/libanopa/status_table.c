@@ -0,0 +1,527 @@
+/*
+ * anopa - Copyright (C) 2015-2017 Olivier Brunel
+ *
+ * status_table.c
+ * Copyright (C) 2015-2017 Olivier Brunel <jjk@jjacky.com>
+ *
+ * This file is part of anopa.
+ *
+ * anopa is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * anopa is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * anopa. If not, see http://www.gnu.org/licenses/
+ */
+
+#define _BSD_SOURCE
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <skalibs/djbunix.h>
+#include <skalibs/bytestr.h>
+#include <skalibs/direntry.h>
+#include <skalibs/stralloc.h>
+#include <skalibs/types.h>
+#include <skalibs/tai.h>
+#include <anopa/scan_dir.h>
+#include <anopa/service_status.h>
+#include <anopa/status_table.h>
+#include "service_internal.h"
+
+/* The status table holds the (latest) status of every service of the repo,
+ * one fixed-size slot each, so it can be mmap()ed and read w/out any I/O.
+ * Slots are found by hashing the name (open addressing, linear probing) and
+ * never removed; the table is rebuilt twice as big when getting 3/4 full.
+ *
+ * Writers update it in place, under an flock() on the file; readers don't
+ * lock: a slot's seq is odd while it is being written, and they retry until
+ * they get a stable copy. When rebuilt (or dropped after an error) the old
+ * table is flagged dead, for anyone still using it to reopen it.
+ *
+ * It only mirrors the status files/journal: if it can't be used, one can
+ * always go back to those.
+ */
+
+#define MAGIC           "aastat\0\001"
+#define HEADER_SIZE     64
+#define MIN_SLOTS       1024
+/* how many times a reader retries on a slot being written, before assuming
+ * its writer died and going back to the status file */
+#define MAX_RETRIES     1000
+
+struct header
+{
+    char magic[8];
+    uint32_t nb_slots;
+    uint32_t nb_used;
+    volatile uint32_t dead;
+};
+
+struct slot
+{
+    volatile uint32_t seq;
+    volatile uint32_t used;
+    char name[AA_STATUS_TABLE_NAME_SIZE];
+    char st[AA_SVST_FIXED_SIZE];
+    char msg[AA_SVST_MAX_MSG_SIZE + 1];
+};
+
+static int fd_table = -1;
+static int table_flags = 0;
+static int checked = 0;
+static char *map = NULL;
+static size_t map_len = 0;
+
+#define header(m)       ((struct header *) (m))
+#define get_slot(m,i)   ((struct slot *) ((m) + HEADER_SIZE) + (i))
+#define table_size(n)   (HEADER_SIZE + (size_t) (n) * sizeof (struct slot))
+
+/* returns the slot of name, or the (unused) one where it would go; NULL if
+ * the table is full */
+static struct slot *
+find_slot (char *m, const char *name)
+{
+    uint32_t size = header (m)->nb_slots;
+    uint32_t i;
+    uint32_t n;
+
+    for (n = 0, i = _hash_name (name) & (size - 1); n < size; ++n, i = (i + 1) & (size - 1))
+    {
+        struct slot *slot = get_slot (m, i);
+
+        if (!slot->used)
+            return slot;
+        /* name is set before used */
+        __sync_synchronize ();
+        if (str_equal (slot->name, name))
+            return slot;
+    }
+    return NULL;
+}
+
+/* returns the slot of name, adding it if needed; NULL (ENOSPC) if the table
+ * needs to grow first */
+static struct slot *
+new_slot (char *m, const char *name)
+{
+    struct slot *slot;
+
+    slot = find_slot (m, name);
+    if (slot && slot->used)
+        return slot;
+    if (!slot || 4 * (header (m)->nb_used + 1) > 3 * header (m)->nb_slots)
+        return (errno = ENOSPC, NULL);
+
+    byte_copy (slot->name, strlen (name) + 1, name);
+    __sync_synchronize ();
+    slot->used = 1;
+    header (m)->nb_used++;
+    return slot;
+}
+
+static void
+write_slot (struct slot *slot, const char *st, const char *msg)
+{
+    size_t l = (msg) ? strlen (msg) : 0;
+
+    if (l > AA_SVST_MAX_MSG_SIZE)
+        l = AA_SVST_MAX_MSG_SIZE;
+
+    /* might already be odd, if a writer died halfway through */
+    slot->seq |= 1;
+    __sync_synchronize ();
+    byte_copy (slot->st, AA_SVST_FIXED_SIZE, st);
+    byte_copy (slot->msg, l, msg);
+    slot->msg[l] = '\0';
+    __sync_synchronize ();
+    slot->seq++;
+}
+
+static int
+map_table (int fd, int writable)
+{
+    struct stat st;
+    char *m;
+
+    if (fstat (fd, &st) < 0)
+        return -1;
+    if (st.st_size < HEADER_SIZE)
+        return 0;
+
+    m = mmap (NULL, st.st_size, PROT_READ | ((writable) ? PROT_WRITE : 0),
+            MAP_SHARED, fd, 0);
+    if (m == MAP_FAILED)
+        return -1;
+    if (byte_diff (m, 8, MAGIC) || header (m)->dead
+            || header (m)->nb_slots == 0
+            || (header (m)->nb_slots & (header (m)->nb_slots - 1))
+            || (size_t) st.st_size != table_size (header (m)->nb_slots))
+    {
+        munmap (m, st.st_size);
+        return 0;
+    }
+
+    map = m;
+    map_len = st.st_size;
+    return 1;
+}
+
+static int
+it_count (direntry *d, void *data)
+{
+    if (d->d_type == DT_DIR && d->d_name[0] != '.')
+        ++*(uint32_t *) data;
+    return 0;
+}
+
+static int
+it_scan (direntry *d, void *data)
+{
+    aa_service_status svst = { .sa = STRALLOC_ZERO };
+    size_t len = strlen (d->d_name);
+    char name[len + 5];
+    int i;
+    int r = 0;
+
+    if (d->d_type != DT_DIR || d->d_name[0] == '.'
+            || len + 4 >= AA_STATUS_TABLE_NAME_SIZE)
+        return 0;
+
+    byte_copy (name, len, d->d_name);
+    byte_copy (name + len, 5, "/log");
+    /* the service, then its logger (if any) */
+    for (i = 0; i < 2 && r == 0; ++i)
+    {
+        struct slot *slot;
+
+        name[len] = (i == 0) ? '\0' : '/';
+        if (aa_service_status_read (&svst, name) < 0)
+            continue;
+        slot = new_slot ((char *) data, name);
+        if (!slot)
+            r = -1;
+        else
+            write_slot (slot, svst.sa.s, aa_service_status_get_msg (&svst));
+    }
+
+    stralloc_free (&svst.sa);
+    return r;
+}
+
+/* creates a new table of (at least) nb_slots, filled from the current one if
+ * any, else from the status files (and journal). It is then put in place of
+ * the current one, locked; w/out one and if create is set, only if no one else
+ * did meanwhile (EEXIST).
+ * It is built under a name of its own, as there might be concurrent builds.
+ * Must be called from the repodir */
+static int
+build (uint32_t nb_slots, int create)
+{
+    char tmp[sizeof (AA_STATUS_TABLE_FILENAME ".new.") + UINT_FMT];
+    char *m = NULL;
+    size_t len;
+    int fd;
+    int e;
+
+    byte_copy (tmp, sizeof (AA_STATUS_TABLE_FILENAME ".new.") - 1,
+            AA_STATUS_TABLE_FILENAME ".new.");
+    tmp[sizeof (AA_STATUS_TABLE_FILENAME ".new.") - 1
+        + uint_fmt (tmp + sizeof (AA_STATUS_TABLE_FILENAME ".new.") - 1,
+                (unsigned int) getpid ())] = '\0';
+
+    fd = open (tmp, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (fd < 0 && errno == EEXIST)
+    {
+        /* left over by a process that died, w/ the same pid as ours */
+        unlink (tmp);
+        fd = open (tmp, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    }
+    if (fd < 0)
+        return -1;
+
+    for (;;)
+    {
+        len = table_size (nb_slots);
+        if (ftruncate (fd, 0) < 0 || ftruncate (fd, len) < 0)
+            goto err;
+        m = mmap (NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (m == MAP_FAILED)
+        {
+            m = NULL;
+            goto err;
+        }
+        byte_copy (m, 8, MAGIC);
+        header (m)->nb_slots = nb_slots;
+
+        if (map)
+        {
+            uint32_t i;
+
+            for (i = 0; i < header (map)->nb_slots; ++i)
+            {
+                struct slot *old = get_slot (map, i);
+                struct slot *slot;
+
+                if (!old->used)
+                    continue;
+                slot = new_slot (m, old->name);
+                if (!slot)
+                    break;
+                byte_copy (slot->st, AA_SVST_FIXED_SIZE, old->st);
+                byte_copy (slot->msg, AA_SVST_MAX_MSG_SIZE + 1, old->msg);
+            }
+            if (i == header (map)->nb_slots)
+                break;
+        }
+        else if (aa_scan_dirat (AT_FDCWD, ".", 0, it_scan, m) >= 0)
+            break;
+
+        if (errno != ENOSPC)
+            goto err;
+        munmap (m, len);
+        m = NULL;
+        nb_slots <<= 1;
+    }
+
+    if (flock (fd, LOCK_EX) < 0)
+        goto err;
+    if (create)
+    {
+        if (link (tmp, AA_STATUS_TABLE_FILENAME) < 0)
+            goto err;
+        unlink (tmp);
+    }
+    else if (rename (tmp, AA_STATUS_TABLE_FILENAME) < 0)
+        goto err;
+
+    if (map)
+    {
+        header (map)->dead = 1;
+        aa_status_table_close ();
+    }
+    fd_table = fd;
+    map = m;
+    map_len = len;
+    return 0;
+
+err:
+    e = errno;
+    if (m)
+        munmap (m, len);
+    fd_close (fd);
+    unlink (tmp);
+    errno = e;
+    return -1;
+}
+
+/* flags: AA_STATUS_TABLE_RDONLY, AA_STATUS_TABLE_RDWR to also update it, or
+ * AA_STATUS_TABLE_CREATE to create it if there's none (yet).
+ * Returns 1 if it is to be used, 0 if not (there's none), -1 on error.
+ * Must be called from the repodir */
+int
+aa_status_table_open (int flags)
+{
+    int writable = flags != AA_STATUS_TABLE_RDONLY;
+    int fd;
+    int r;
+
+    checked = 1;
+    if (fd_table >= 0)
+        return 1;
+    table_flags = flags;
+
+    fd = open (AA_STATUS_TABLE_FILENAME, ((writable) ? O_RDWR : O_RDONLY) | O_CLOEXEC);
+    if (fd >= 0)
+    {
+        r = map_table (fd, writable);
+        if (r > 0)
+        {
+            fd_table = fd;
+            return 1;
+        }
+        if (r < 0)
+        {
+            int e = errno;
+
+            fd_close (fd);
+            errno = e;
+            return -1;
+        }
+        fd_close (fd);
+    }
+    else if (errno != ENOENT)
+        return -1;
+
+    if (flags != AA_STATUS_TABLE_CREATE)
+        return 0;
+    else
+    {
+        uint32_t n = 0;
+        uint32_t nb_slots = MIN_SLOTS;
+
+        if (aa_scan_dirat (AT_FDCWD, ".", 0, it_count, &n) < 0)
+            return -1;
+        while (nb_slots < 2 * n)
+            nb_slots <<= 1;
+        /* an unusable one gets replaced; else someone might be creating it
+         * too, and whoever comes second uses the first one's */
+        if (build (nb_slots, fd < 0) < 0)
+        {
+            if (fd >= 0 || errno != EEXIST)
+                return -1;
+            return aa_status_table_open (AA_STATUS_TABLE_RDWR);
+        }
+        flock (fd_table, LOCK_UN);
+        return 1;
+    }
+}
+
+/* reopen after the table was flagged dead */
+static int
+reopen (void)
+{
+    int flags = table_flags;
+
+    aa_status_table_close ();
+    if (flags == AA_STATUS_TABLE_CREATE)
+        flags = AA_STATUS_TABLE_RDWR;
+    return aa_status_table_open (flags);
+}
+
+/* gets the status of name into svst. Returns 1 if found, 0 if there's none,
+ * -1 if the table can't be used (status file/journal should then be read) */
+int
+aa_status_table_get (aa_service_status *svst, const char *name)
+{
+    char st[AA_SVST_FIXED_SIZE];
+    char msg[AA_SVST_MAX_MSG_SIZE + 1];
+    struct slot *slot;
+    unsigned int n;
+    size_t l;
+    uint32_t u;
+
+    if (!map || strlen (name) >= AA_STATUS_TABLE_NAME_SIZE)
+        return -1;
+    if (header (map)->dead && reopen () <= 0)
+        return -1;
+
+    slot = find_slot (map, name);
+    if (!slot || !slot->used)
+        return 0;
+
+    for (n = 0; ; ++n)
+    {
+        uint32_t seq;
+
+        if (n == MAX_RETRIES)
+            return -1;
+        seq = slot->seq;
+        if (seq & 1)
+        {
+            sched_yield ();
+            continue;
+        }
+        __sync_synchronize ();
+        byte_copy (st, AA_SVST_FIXED_SIZE, slot->st);
+        byte_copy (msg, AA_SVST_MAX_MSG_SIZE + 1, slot->msg);
+        __sync_synchronize ();
+        if (slot->seq == seq)
+            break;
+    }
+    l = byte_chr (msg, AA_SVST_MAX_MSG_SIZE, '\0');
+
+    svst->sa.len = 0;
+    if (!stralloc_ready_tuned (&svst->sa, AA_SVST_FIXED_SIZE + l + 1, 0, 0, 1))
+        return -1;
+    stralloc_catb (&svst->sa, st, AA_SVST_FIXED_SIZE);
+    stralloc_catb (&svst->sa, msg, l);
+    stralloc_0 (&svst->sa);
+
+    tain_unpack (svst->sa.s, &svst->stamp);
+    uint32_unpack (svst->sa.s + 12, &u);
+    svst->event = (unsigned int) u;
+    uint32_unpack (svst->sa.s + 16, &u);
+    svst->code = (int) u;
+
+    return 1;
+}
+
+/* updates the slot of name w/ svst (already packed, see
+ * aa_service_status_write()). If the table wasn't opened, it is now so it
+ * isn't left out of date.
+ * Returns 1 if updated, 0 if there's no table in use, -1 on error, in which
+ * case the table is removed, so everyone goes back to status files/journal */
+int
+aa_status_table_set (aa_service_status *svst, const char *name)
+{
+    struct slot *slot;
+    int r;
+    int e;
+
+    if (!checked && aa_status_table_open (AA_STATUS_TABLE_RDWR) < 0)
+        goto err;
+    if (fd_table < 0 || table_flags == AA_STATUS_TABLE_RDONLY
+            || strlen (name) >= AA_STATUS_TABLE_NAME_SIZE)
+        return 0;
+
+    for (;;)
+    {
+        if (flock (fd_table, LOCK_EX) < 0)
+            goto err;
+        if (!header (map)->dead)
+            break;
+        /* replaced while we were waiting */
+        r = reopen ();
+        if (r <= 0)
+            return (r < 0) ? -1 : 0;
+    }
+
+    slot = new_slot (map, name);
+    if (!slot && errno == ENOSPC && build (header (map)->nb_slots << 1, 0) == 0)
+        slot = new_slot (map, name);
+    if (!slot)
+        goto err;
+    write_slot (slot, svst->sa.s, aa_service_status_get_msg (svst));
+
+    flock (fd_table, LOCK_UN);
+    return 1;
+
+err:
+    e = errno;
+    if (map && table_flags != AA_STATUS_TABLE_RDONLY)
+    {
+        unlink (AA_STATUS_TABLE_FILENAME);
+        header (map)->dead = 1;
+    }
+    aa_status_table_close ();
+    errno = e;
+    return -1;
+}
+
+void
+aa_status_table_close (void)
+{
+    if (map)
+        munmap (map, map_len);
+    map = NULL;
+    map_len = 0;
+    if (fd_table >= 0)
+        fd_close (fd_table);
+    fd_table = -1;
+}
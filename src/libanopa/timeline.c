@@ -0,0 +1,319 @@
+/*
+ * anopa - Copyright (C) 2015-2017 Olivier Brunel
+ *
+ * timeline.c
+ * Copyright (C) 2015-2017 Olivier Brunel <jjk@jjacky.com>
+ *
+ * This file is part of anopa.
+ *
+ * anopa is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * anopa is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * anopa. If not, see http://www.gnu.org/licenses/
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <skalibs/djbunix.h>
+#include <skalibs/bytestr.h>
+#include <skalibs/stralloc.h>
+#include <skalibs/genalloc.h>
+#include <skalibs/types.h>
+#include <skalibs/tai.h>
+#include <anopa/timeline.h>
+
+/* File format: magic, then transactions one after the other, oldest first.
+ * Each is made of its length (32bit little-endian, everything included), flags
+ * (32bit, 1 for a start), stamp of its beginning and number of services (32bit),
+ * then for each service its length (32bit), stamps of start, ready & end, event
+ * and code (both 32bit), and names of the service & its deciding dependency
+ * (both NUL-terminated, the later empty if none) */
+#define MAGIC               "aatmln\0\001"
+#define HEADER_SIZE         (4 + 4 + TAIN_PACK + 4)
+#define ENTRY_FIXED_SIZE    (4 + 3 * TAIN_PACK + 4 + 4)
+
+static int is_start = 0;
+static tain stamp = TAIN_ZERO;
+static stralloc sa_names = STRALLOC_ZERO;
+static genalloc ga_entries = GENALLOC_ZERO; /* aa_tl_entry */
+
+#define entry(i)            (&genalloc_s (aa_tl_entry, &ga_entries)[i])
+
+void
+aa_timeline_free (void)
+{
+    stralloc_free (&sa_names);
+    genalloc_free (aa_tl_entry, &ga_entries);
+}
+
+void
+aa_timeline_begin (int start)
+{
+    aa_timeline_free ();
+    is_start = start;
+    tain_copynow (&stamp);
+}
+
+int
+aa_timeline_add (const char *name, const char *after, tain const *start,
+                 tain const *ready, tain const *end, unsigned int event, int code)
+{
+    aa_tl_entry e = {
+        .offset_name = sa_names.len,
+        .offset_after = (size_t) -1,
+        .start = *start,
+        .ready = *ready,
+        .end = *end,
+        .event = event,
+        .code = code
+    };
+    size_t len = sa_names.len;
+
+    if (!stralloc_catb (&sa_names, name, strlen (name) + 1))
+        return -1;
+    if (after)
+    {
+        e.offset_after = sa_names.len;
+        if (!stralloc_catb (&sa_names, after, strlen (after) + 1))
+        {
+            sa_names.len = len;
+            return -1;
+        }
+    }
+    if (!genalloc_append (aa_tl_entry, &ga_entries, &e))
+    {
+        sa_names.len = len;
+        return -1;
+    }
+    return 0;
+}
+
+int
+aa_timeline_is_start (void)
+{
+    return is_start;
+}
+
+tain const *
+aa_timeline_stamp (void)
+{
+    return &stamp;
+}
+
+size_t
+aa_timeline_nb (void)
+{
+    return genalloc_len (aa_tl_entry, &ga_entries);
+}
+
+aa_tl_entry *
+aa_timeline_get (size_t i)
+{
+    return entry (i);
+}
+
+int
+aa_timeline_find (const char *name)
+{
+    size_t i;
+
+    for (i = 0; i < genalloc_len (aa_tl_entry, &ga_entries); ++i)
+        if (str_equal (sa_names.s + entry (i)->offset_name, name))
+            return i;
+    return -1;
+}
+
+const char *
+aa_timeline_name (aa_tl_entry *e)
+{
+    return sa_names.s + e->offset_name;
+}
+
+const char *
+aa_timeline_after (aa_tl_entry *e)
+{
+    return (e->offset_after == (size_t) -1) ? NULL : sa_names.s + e->offset_after;
+}
+
+/* fills ga (size_t) w/ offsets of all valid transactions in sa */
+static int
+parse (stralloc *sa, genalloc *ga)
+{
+    size_t i;
+
+    if (sa->len < 8 || byte_diff (sa->s, 8, MAGIC))
+        return 0;
+
+    /* one cut short (e.g. crash while writing) ends it */
+    for (i = 8; i + HEADER_SIZE <= sa->len; )
+    {
+        uint32_t len;
+
+        uint32_unpack (sa->s + i, &len);
+        if (len < HEADER_SIZE || len > sa->len - i)
+            break;
+        if (!genalloc_append (size_t, ga, &i))
+            return -1;
+        i += len;
+    }
+    return 1;
+}
+
+/* loads the n-th most recent transaction (0 being the last one).
+ * Returns 1 if loaded, 0 if there's none, -1 on error.
+ * Must be called from the repodir */
+int
+aa_timeline_load (unsigned int n)
+{
+    stralloc sa = STRALLOC_ZERO;
+    genalloc ga = GENALLOC_ZERO; /* size_t: offsets of transactions */
+    size_t nb;
+    size_t i;
+    size_t end;
+    uint32_t u;
+    int r;
+    int e;
+
+    aa_timeline_free ();
+
+    if (!openslurpclose (&sa, AA_TIMELINE_FILENAME))
+        return (errno == ENOENT) ? 0 : -1;
+
+    r = parse (&sa, &ga);
+    nb = genalloc_len (size_t, &ga);
+    if (r <= 0 || n >= nb)
+        goto done;
+
+    i = genalloc_s (size_t, &ga)[nb - 1 - n];
+    uint32_unpack (sa.s + i, &u);
+    end = i + u;
+    uint32_unpack (sa.s + i + 4, &u);
+    is_start = u & 1;
+    tain_unpack (sa.s + i + 8, &stamp);
+    i += HEADER_SIZE;
+
+    while (i + ENTRY_FIXED_SIZE + 2 <= end)
+    {
+        tain start, ready, stop;
+        uint32_t event, code;
+        const char *name;
+        size_t l;
+
+        uint32_unpack (sa.s + i, &u);
+        if (u < ENTRY_FIXED_SIZE + 2 || u > end - i || sa.s[i + u - 1] != '\0')
+            break;
+        name = sa.s + i + ENTRY_FIXED_SIZE;
+        l = byte_chr (name, u - ENTRY_FIXED_SIZE, '\0');
+        if (l == 0 || ENTRY_FIXED_SIZE + l + 1 >= u)
+            break;
+
+        tain_unpack (sa.s + i + 4, &start);
+        tain_unpack (sa.s + i + 4 + TAIN_PACK, &ready);
+        tain_unpack (sa.s + i + 4 + 2 * TAIN_PACK, &stop);
+        uint32_unpack (sa.s + i + 4 + 3 * TAIN_PACK, &event);
+        uint32_unpack (sa.s + i + 8 + 3 * TAIN_PACK, &code);
+        if (aa_timeline_add (name, (name[l + 1]) ? name + l + 1 : NULL,
+                    &start, &ready, &stop, event, (int) code) < 0)
+        {
+            r = -1;
+            goto done;
+        }
+        i += u;
+    }
+    r = 1;
+
+done:
+    e = errno;
+    if (r < 0)
+        aa_timeline_free ();
+    stralloc_free (&sa);
+    genalloc_free (size_t, &ga);
+    errno = e;
+    return (r < 0) ? -1 : (r > 0 && n < nb);
+}
+
+/* adds the current transaction to the file, only keeping the last
+ * AA_TIMELINE_KEEP ones.
+ * Must be called from the repodir */
+int
+aa_timeline_write (void)
+{
+    stralloc sa = STRALLOC_ZERO;
+    stralloc sa_old = STRALLOC_ZERO;
+    genalloc ga = GENALLOC_ZERO; /* size_t: offsets of transactions */
+    size_t nb;
+    size_t len;
+    size_t i;
+    char buf[ENTRY_FIXED_SIZE];
+    mode_t mask;
+    int r = -1;
+    int e;
+
+    if (!stralloc_catb (&sa, MAGIC, 8))
+        goto err;
+
+    /* previous transactions, if any */
+    if (!openslurpclose (&sa_old, AA_TIMELINE_FILENAME) && errno != ENOENT)
+        goto err;
+    if (parse (&sa_old, &ga) < 0)
+        goto err;
+    nb = genalloc_len (size_t, &ga);
+    if (nb > 0)
+    {
+        size_t from = genalloc_s (size_t, &ga)[(nb >= AA_TIMELINE_KEEP) ? nb - AA_TIMELINE_KEEP + 1 : 0];
+        uint32_t u;
+
+        uint32_unpack (sa_old.s + genalloc_s (size_t, &ga)[nb - 1], &u);
+        if (!stralloc_catb (&sa, sa_old.s + from, genalloc_s (size_t, &ga)[nb - 1] + u - from))
+            goto err;
+    }
+
+    len = sa.len;
+    uint32_pack (buf + 4, (uint32_t) is_start);
+    tain_pack (buf + 8, &stamp);
+    uint32_pack (buf + 8 + TAIN_PACK, (uint32_t) genalloc_len (aa_tl_entry, &ga_entries));
+    if (!stralloc_catb (&sa, buf, HEADER_SIZE))
+        goto err;
+    for (i = 0; i < genalloc_len (aa_tl_entry, &ga_entries); ++i)
+    {
+        aa_tl_entry *en = entry (i);
+        const char *name = aa_timeline_name (en);
+        const char *after = aa_timeline_after (en);
+        size_t l_name = strlen (name) + 1;
+        size_t l_after = (after) ? strlen (after) + 1 : 1;
+
+        uint32_pack (buf, (uint32_t) (ENTRY_FIXED_SIZE + l_name + l_after));
+        tain_pack (buf + 4, &en->start);
+        tain_pack (buf + 4 + TAIN_PACK, &en->ready);
+        tain_pack (buf + 4 + 2 * TAIN_PACK, &en->end);
+        uint32_pack (buf + 4 + 3 * TAIN_PACK, (uint32_t) en->event);
+        uint32_pack (buf + 8 + 3 * TAIN_PACK, (uint32_t) en->code);
+        if (!stralloc_catb (&sa, buf, ENTRY_FIXED_SIZE)
+                || !stralloc_catb (&sa, name, l_name)
+                || !stralloc_catb (&sa, (after) ? after : "", l_after))
+            goto err;
+    }
+    uint32_pack (sa.s + len, (uint32_t) (sa.len - len));
+
+    mask = umask (0022);
+    r = (openwritenclose_suffix (AA_TIMELINE_FILENAME, sa.s, sa.len, ".new")) ? 0 : -1;
+    umask (mask);
+
+err:
+    e = errno;
+    stralloc_free (&sa);
+    stralloc_free (&sa_old);
+    genalloc_free (size_t, &ga);
+    errno = e;
+    return r;
+}
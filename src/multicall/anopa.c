@@ -0,0 +1,150 @@
+/*
+ * anopa - Copyright (C) 2015-2017 Olivier Brunel
+ *
+ * anopa.c
+ * Copyright (C) 2015-2017 Olivier Brunel <jjk@jjacky.com>
+ *
+ * This file is part of anopa.
+ *
+ * anopa is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * anopa is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * anopa. If not, see http://www.gnu.org/licenses/
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <skalibs/bytestr.h>
+#include <anopa/common.h>
+#include <anopa/output.h>
+
+/* all programs are built w/ their main() renamed, e.g. aa_start_main(). Some
+ * don't use envp (or declare it differently), which is fine to pass anyways */
+typedef int (*main_fn) (int argc, char * const argv[], char * const envp[]);
+
+#define APPLET(name)    extern int name (int argc, char * const argv[], char * const envp[]);
+APPLET(aa_analyze_main)
+APPLET(aa_chroot_main)
+APPLET(aa_ctty_main)
+APPLET(aa_echo_main)
+APPLET(aa_enable_main)
+APPLET(aa_incmdline_main)
+APPLET(aa_kill_main)
+APPLET(aa_mount_main)
+APPLET(aa_pivot_main)
+APPLET(aa_reboot_main)
+APPLET(aa_reset_main)
+APPLET(aa_service_main)
+APPLET(aa_setready_main)
+APPLET(aa_start_main)
+APPLET(aa_status_main)
+APPLET(aa_stop_main)
+APPLET(aa_sync_main)
+APPLET(aa_terminate_main)
+APPLET(aa_test_main)
+APPLET(aa_tty_main)
+APPLET(aa_umount_main)
+#undef APPLET
+
+struct applet
+{
+    const char *name;
+    main_fn main;
+};
+
+/* sorted by name, for bsearch() */
+static const struct applet applets[] = {
+    { "aa-analyze",     aa_analyze_main },
+    { "aa-chroot",      aa_chroot_main },
+    { "aa-ctty",        aa_ctty_main },
+    { "aa-echo",        aa_echo_main },
+    { "aa-enable",      aa_enable_main },
+    { "aa-incmdline",   aa_incmdline_main },
+    { "aa-kill",        aa_kill_main },
+    { "aa-mount",       aa_mount_main },
+    { "aa-pivot",       aa_pivot_main },
+    { "aa-reboot",      aa_reboot_main },
+    { "aa-reset",       aa_reset_main },
+    { "aa-service",     aa_service_main },
+    { "aa-setready",    aa_setready_main },
+    { "aa-start",       aa_start_main },
+    { "aa-status",      aa_status_main },
+    { "aa-stop",        aa_stop_main },
+    { "aa-sync",        aa_sync_main },
+    { "aa-terminate",   aa_terminate_main },
+    { "aa-test",        aa_test_main },
+    { "aa-tty",         aa_tty_main },
+    { "aa-umount",      aa_umount_main }
+};
+#define NB_APPLETS      (sizeof (applets) / sizeof (*applets))
+
+static void
+dieusage (int rc)
+{
+    unsigned int i;
+
+    aa_bs_noflush (AA_OUT, "Usage: ");
+    aa_bs_noflush (AA_OUT, PROG);
+    aa_bs_noflush (AA_OUT, " PROGRAM [ARG...]\n\n"
+            " -h, --help                    Show this help screen and exit\n"
+            " -V, --version                 Show version information and exit\n"
+            "\nPrograms:\n");
+    for (i = 0; i < NB_APPLETS; ++i)
+    {
+        aa_bs_noflush (AA_OUT, " ");
+        aa_bs_noflush (AA_OUT, applets[i].name);
+        aa_bs_noflush (AA_OUT, "\n");
+    }
+    aa_bs_flush (AA_OUT, "");
+    _exit (rc);
+}
+
+static int
+cmp_applet (const void *name, const void *applet)
+{
+    return str_diff (name, ((const struct applet *) applet)->name);
+}
+
+static const struct applet *
+get_applet (const char *name)
+{
+    return bsearch (name, applets, NB_APPLETS, sizeof (*applets), cmp_applet);
+}
+
+int
+main (int argc, char * const argv[], char * const envp[])
+{
+    const struct applet *applet;
+    const char *name;
+
+    PROG = "anopa";
+
+    /* invoked via a symlink, e.g. aa-start -> anopa */
+    name = argv[0] + str_len (argv[0]);
+    while (name > argv[0] && name[-1] != '/')
+        --name;
+    applet = get_applet (name);
+    if (applet)
+        return applet->main (argc, argv, envp);
+
+    /* else as: anopa PROGRAM [ARG...] */
+    if (argc == 1)
+        dieusage (1);
+    if (str_equal (argv[1], "-V") || str_equal (argv[1], "--version"))
+        aa_die_version ();
+    if (str_equal (argv[1], "-h") || str_equal (argv[1], "--help"))
+        dieusage (0);
+
+    applet = get_applet (argv[1]);
+    if (!applet)
+        aa_strerr_dief2x (1, "unknown program: ", argv[1]);
+    return applet->main (argc - 1, argv + 1, envp);
+}
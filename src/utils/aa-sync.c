@@ -23,8 +23,7 @@
 #include <unistd.h>
 #include <skalibs/bytestr.h>
 #include <anopa/common.h>
-
-const char *PROG;
+#include <anopa/output.h>
 
 static void
 dieusage (int rc)